@@ -0,0 +1,61 @@
+#include "AllocationCounter.h"
+
+#ifdef VIDEOSLICER_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> g_allocationCount ( 0 );
+
+static void * CountedAllocate ( size_t size ) noexcept
+{
+	g_allocationCount.fetch_add ( 1, std::memory_order_relaxed );
+	return malloc ( size != 0 ? size : 1 );
+}
+
+void * operator new ( size_t size )
+{
+	void * ret = CountedAllocate ( size );
+	if ( ret == nullptr )
+		abort ();
+	return ret;
+}
+void * operator new [] ( size_t size )
+{
+	void * ret = CountedAllocate ( size );
+	if ( ret == nullptr )
+		abort ();
+	return ret;
+}
+void * operator new ( size_t size, const std::nothrow_t & ) noexcept { return CountedAllocate ( size ); }
+void * operator new [] ( size_t size, const std::nothrow_t & ) noexcept { return CountedAllocate ( size ); }
+
+void operator delete ( void * ptr ) noexcept { free ( ptr ); }
+void operator delete [] ( void * ptr ) noexcept { free ( ptr ); }
+void operator delete ( void * ptr, const std::nothrow_t & ) noexcept { free ( ptr ); }
+void operator delete [] ( void * ptr, const std::nothrow_t & ) noexcept { free ( ptr ); }
+
+uint64_t GetAllocationCount ()
+{
+	return g_allocationCount.load ( std::memory_order_relaxed );
+}
+
+bool IsAllocationCountEnabled ()
+{
+	return true;
+}
+
+#else
+
+uint64_t GetAllocationCount ()
+{
+	return 0;
+}
+
+bool IsAllocationCountEnabled ()
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __ALLOCATIONCOUNTER_H__
+#define __ALLOCATIONCOUNTER_H__
+
+#include <cstdint>
+
+// Number of operator new calls made by this module so far.
+// Counting is only compiled in with VIDEOSLICER_COUNT_ALLOCATIONS defined; otherwise this returns zero.
+uint64_t GetAllocationCount ();
+// Whether GetAllocationCount counts anything in this build
+bool IsAllocationCountEnabled ();
+
+#endif
@@ -0,0 +1,735 @@
+#include "Benchmark.h"
+
+#include <cstdarg>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <random>
+
+#include <Shlwapi.h>
+#include <atlbase.h>
+
+#include "Video/VideoDecoder.h"
+#include "Image/ImageEncoderContext.h"
+#include "ThreadPool.h"
+#include "CancellationToken.h"
+#include "FramePack.h"
+#include "ImageArchive.h"
+#include "ImageWriter.h"
+
+#pragma comment ( lib, "Shlwapi.lib" )
+
+// The follower gives up once the copy has stopped growing for this long
+#define FOLLOW_CHECK_IDLE_TIMEOUT 2000
+// Time the follower gets to read the first chunk before the file grows, and between appends
+#define FOLLOW_CHECK_START_DELAY 500
+#define FOLLOW_CHECK_APPEND_INTERVAL 50
+#define FOLLOW_CHECK_APPENDS 64
+
+// Tasks per contention run, split evenly over its producers
+#define CONTENTION_TASKS ( 1 << 20 )
+// Encoder loops started from pool tasks, the range of each, and one in how many is cancelled part way
+#define RUNNER_CHECK_LOOPS 4096
+#define RUNNER_CHECK_RANGE 257
+#define RUNNER_CHECK_CANCEL_EVERY 8
+
+// Frames decoded up front for the encoder table, and how often each is encoded per row
+#define ENCODER_CHECK_FRAMES 32
+#define ENCODER_CHECK_ROUNDS 4
+
+// Random reads of the frame read run when the caller gives no count
+#define FRAME_READ_CHECK_READS 10000
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+BenchmarkReport::BenchmarkReport ()
+	: _file ( INVALID_HANDLE_VALUE ), _passed ( true )
+{
+
+}
+
+BenchmarkReport::~BenchmarkReport ()
+{
+	Close ();
+}
+
+HRESULT BenchmarkReport::Open ( LPCWSTR path )
+{
+	_file = CreateFile ( path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( _file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+	_passed = true;
+	return S_OK;
+}
+
+void BenchmarkReport::Close ()
+{
+	if ( _file != INVALID_HANDLE_VALUE )
+		CloseHandle ( _file );
+	_file = INVALID_HANDLE_VALUE;
+}
+
+void BenchmarkReport::Print ( LPCWSTR format, ... )
+{
+	wchar_t line [ 1024 ];
+	va_list arguments;
+	va_start ( arguments, format );
+	wvsprintf ( line, format, arguments );
+	va_end ( arguments );
+
+	WriteLine ( line );
+}
+
+void BenchmarkReport::Check ( bool passed, LPCWSTR format, ... )
+{
+	wchar_t line [ 1024 ];
+	int length = wsprintf ( line, passed ? TEXT ( "PASS " ) : TEXT ( "FAIL " ) );
+	va_list arguments;
+	va_start ( arguments, format );
+	wvsprintf ( line + length, format, arguments );
+	va_end ( arguments );
+
+	_passed = _passed && passed;
+	WriteLine ( line );
+}
+
+void BenchmarkReport::WriteLine ( LPCWSTR line )
+{
+	OutputDebugString ( line );
+	OutputDebugString ( TEXT ( "\n" ) );
+
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	char text [ 4096 ];
+	int length = WideCharToMultiByte ( CP_UTF8, 0, line, -1, text, sizeof ( text ) - 2, nullptr, nullptr );
+	if ( length <= 0 )
+		return;
+
+	// The terminator counted by WideCharToMultiByte makes room for the line break
+	text [ length - 1 ] = '\r';
+	text [ length ] = '\n';
+	DWORD written;
+	WriteFile ( _file, text, ( DWORD ) length + 1, &written, nullptr );
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static LONG MillisecondsBetween ( const LARGE_INTEGER & from, const LARGE_INTEGER & to )
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency ( &frequency );
+	return ( LONG ) ( ( to.QuadPart - from.QuadPart ) * 1000 / frequency.QuadPart );
+}
+
+// Reads a decoder to its end, counting frames as they come out
+static HRESULT ReadAllFrames ( IVideoDecoder * decoder, std::atomic<uint64_t> & frames,
+	uint64_t * lastTimeStamp, LARGE_INTEGER * lastFrameTime )
+{
+	for ( ;; )
+	{
+		CComPtr<IVideoSample> sample;
+		uint64_t timeStamp;
+		HRESULT hr = decoder->ReadSample ( &sample, &timeStamp );
+		if ( FAILED ( hr ) )
+			return hr;
+		if ( sample == nullptr )
+			return S_OK;
+
+		*lastTimeStamp = timeStamp;
+		QueryPerformanceCounter ( lastFrameTime );
+		frames.fetch_add ( 1, std::memory_order_relaxed );
+	}
+}
+
+HRESULT BenchmarkFollow ( BenchmarkReport & report, LPCWSTR input, LPCWSTR workDirectory )
+{
+	HRESULT hr;
+
+	VideoDecoderSettings settings = { 0, };
+	settings.planarOutput = true;
+
+	std::atomic<uint64_t> expectedFrames ( 0 );
+	uint64_t expectedLastTimeStamp = 0;
+	LARGE_INTEGER frameTime;
+	{
+		CComPtr<IVideoDecoder> decoder;
+		if ( FAILED ( hr = CreateFFmpegVideoDecoder ( &decoder ) )
+			|| FAILED ( hr = decoder->Initialize ( input, &settings ) )
+			|| FAILED ( hr = ReadAllFrames ( decoder, expectedFrames, &expectedLastTimeStamp, &frameTime ) ) )
+		{
+			report.Check ( false, TEXT ( "follow: cannot read %s, 0x%08X" ), input, ( UINT ) hr );
+			return hr;
+		}
+	}
+
+	HANDLE source = CreateFile ( input, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if ( source == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	wchar_t copyName [ 64 ], copyPath [ MAX_PATH ];
+	wsprintf ( copyName, TEXT ( "follow-check%s" ), PathFindExtension ( input ) );
+	PathCombine ( copyPath, workDirectory, copyName );
+	HANDLE copy = CreateFile ( copyPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( copy == INVALID_HANDLE_VALUE )
+	{
+		hr = HRESULT_FROM_WIN32 ( GetLastError () );
+		CloseHandle ( source );
+		return hr;
+	}
+
+	// A quarter of the file up front, so the follower can open it, then the rest in small appends
+	LARGE_INTEGER sourceSize;
+	GetFileSizeEx ( source, &sourceSize );
+	DWORD firstChunk = ( DWORD ) ( std::min ) ( sourceSize.QuadPart / 4 + 1, ( LONGLONG ) 64 * 1024 * 1024 );
+	DWORD chunk = ( DWORD ) ( std::max ) ( ( std::min ) ( sourceSize.QuadPart / FOLLOW_CHECK_APPENDS + 1, ( LONGLONG ) 16 * 1024 * 1024 ),
+		( LONGLONG ) 64 * 1024 );
+	std::vector<BYTE> buffer ( ( std::max ) ( firstChunk, chunk ) );
+
+	auto append = [ source, copy, &buffer ] ( DWORD length )
+	{
+		DWORD read = 0, written = 0;
+		if ( !ReadFile ( source, buffer.data (), length, &read, nullptr ) || read == 0 )
+			return false;
+		return WriteFile ( copy, buffer.data (), read, &written, nullptr ) && written == read;
+	};
+	append ( firstChunk );
+
+	std::atomic<uint64_t> frames ( 0 );
+	uint64_t framesBeforeGrowth = 0, appends = 0;
+	LARGE_INTEGER finished = { 0, };
+	std::thread writer ( [ & ]
+	{
+		Sleep ( FOLLOW_CHECK_START_DELAY );
+		framesBeforeGrowth = frames.load ( std::memory_order_relaxed );
+		while ( append ( chunk ) )
+		{
+			++appends;
+			Sleep ( FOLLOW_CHECK_APPEND_INTERVAL );
+		}
+		QueryPerformanceCounter ( &finished );
+	} );
+
+	settings.follow = true;
+	settings.followIdleTimeout = FOLLOW_CHECK_IDLE_TIMEOUT;
+	uint64_t lastTimeStamp = 0;
+	{
+		CComPtr<IVideoDecoder> decoder;
+		if ( FAILED ( hr = CreateFFmpegVideoDecoder ( &decoder ) )
+			|| FAILED ( hr = decoder->Initialize ( copyPath, &settings ) ) )
+			report.Check ( false, TEXT ( "follow: cannot open the first %u KB of the file, 0x%08X" ), ( UINT ) ( firstChunk / 1024 ), ( UINT ) hr );
+		else
+			hr = ReadAllFrames ( decoder, frames, &lastTimeStamp, &frameTime );
+	}
+
+	writer.join ();
+	CloseHandle ( copy );
+	CloseHandle ( source );
+	DeleteFile ( copyPath );
+	if ( FAILED ( hr ) )
+		return hr;
+
+	uint64_t total = frames.load ();
+	report.Print ( TEXT ( "follow: %s, %u KB then %u appends of %u KB every %u ms" ), PathFindFileName ( input ),
+		( UINT ) ( firstChunk / 1024 ), ( UINT ) appends, ( UINT ) ( chunk / 1024 ), FOLLOW_CHECK_APPEND_INTERVAL );
+	report.Check ( total == expectedFrames.load () && lastTimeStamp == expectedLastTimeStamp,
+		TEXT ( "follow: %u of %u frames, %u of them read before the file grew" ),
+		( UINT ) total, ( UINT ) expectedFrames.load (), ( UINT ) framesBeforeGrowth );
+	report.Check ( appends > 0 && total > framesBeforeGrowth, TEXT ( "follow: frames keep coming after the file grows" ) );
+	report.Print ( TEXT ( "follow: last frame %d ms after the last append" ), MillisecondsBetween ( finished, frameTime ) );
+
+	return S_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The pool ThreadPool grew out of, kept as the reference: one queue behind one mutex, shared by every
+// producer and every worker
+class MutexQueuePool
+{
+public:
+	explicit MutexQueuePool ( size_t threads )
+		: _stop ( false )
+	{
+		for ( size_t i = 0; i < threads; ++i )
+			_workers.emplace_back ( [ this ] { WorkerLoop (); } );
+	}
+
+	~MutexQueuePool ()
+	{
+		{
+			std::unique_lock<std::mutex> lock ( _mutex );
+			_stop = true;
+		}
+		_condition.notify_all ();
+		for ( std::thread & worker : _workers )
+			worker.join ();
+	}
+
+	MutexQueuePool ( const MutexQueuePool & ) = delete;
+	MutexQueuePool & operator= ( const MutexQueuePool & ) = delete;
+
+public:
+	template<class F>
+	void post ( F && f )
+	{
+		{
+			std::unique_lock<std::mutex> lock ( _mutex );
+			_tasks.emplace_back ( std::forward<F> ( f ) );
+		}
+		_condition.notify_one ();
+	}
+
+private:
+	void WorkerLoop ()
+	{
+		for ( ;; )
+		{
+			std::function<void ()> task;
+			{
+				std::unique_lock<std::mutex> lock ( _mutex );
+				_condition.wait ( lock, [ this ] { return _stop || !_tasks.empty (); } );
+				if ( _stop && _tasks.empty () )
+					return;
+				task = std::move ( _tasks.front () );
+				_tasks.pop_front ();
+			}
+			task ();
+		}
+	}
+
+private:
+	std::vector<std::thread> _workers;
+	std::deque<std::function<void ()>> _tasks;
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	bool _stop;
+};
+
+static void SpinWork ( uint32_t iterations )
+{
+	volatile uint32_t sink = 0;
+	for ( uint32_t i = 0; i < iterations; ++i )
+		sink += i;
+}
+
+// Producer threads post parent tasks, and every parent posts fanout - 1 children from the worker it
+// runs on, the way an encoder posts its helpers. Returns the time until the last task finished.
+template<class Pool>
+static LONG RunContention ( Pool & pool, size_t producers, uint32_t work, uint32_t fanout, uint64_t * completed )
+{
+	std::atomic<uint64_t> done ( 0 );
+	uint64_t parents = CONTENTION_TASKS / fanout / producers;
+
+	LARGE_INTEGER started, finished;
+	QueryPerformanceCounter ( &started );
+
+	std::vector<std::thread> threads;
+	for ( size_t producer = 0; producer < producers; ++producer )
+		threads.emplace_back ( [ &pool, &done, parents, work, fanout ]
+		{
+			for ( uint64_t i = 0; i < parents; ++i )
+				pool.post ( [ &pool, &done, work, fanout ]
+				{
+					for ( uint32_t child = 1; child < fanout; ++child )
+						pool.post ( [ &done, work ]
+						{
+							SpinWork ( work );
+							done.fetch_add ( 1, std::memory_order_release );
+						} );
+					SpinWork ( work );
+					done.fetch_add ( 1, std::memory_order_release );
+				} );
+		} );
+	for ( std::thread & thread : threads )
+		thread.join ();
+
+	// Tasks count themselves done with release, so once the count is in no task touches this frame
+	uint64_t expected = parents * fanout * producers;
+	while ( done.load () < expected )
+		std::this_thread::yield ();
+	QueryPerformanceCounter ( &finished );
+
+	*completed = done.load ();
+	return MillisecondsBetween ( started, finished );
+}
+
+// Main.cpp; the runner check lends helpers the way the encode workers do
+bool PostEncoderHelper ( void * executor, void ( *task ) ( void * argument, bool run ), void * argument ) noexcept;
+
+struct RunnerCheck
+{
+	std::atomic<uint32_t> hits [ RUNNER_CHECK_RANGE ];
+	std::atomic<bool> badThread;
+	uint32_t threads, cancelAt;
+	CancellationToken * cancel;
+};
+
+static void RunnerCheckBody ( void * argument, uint32_t index, uint32_t thread )
+{
+	RunnerCheck * check = ( RunnerCheck* ) argument;
+	if ( thread >= check->threads )
+		check->badThread = true;
+	++check->hits [ index ];
+	if ( index == check->cancelAt )
+		check->cancel->Cancel ();
+}
+
+// Starts encoder loops from pool tasks with helpers posted back to the same pool, as encode workers
+// do, and counts the loops where an index ran other than once or on a thread number out of range.
+// In cancelled loops an index may be skipped but still never runs twice.
+static uint32_t RunEncoderLoops ( ThreadPool & pool, size_t workers )
+{
+	std::atomic<uint32_t> failures ( 0 ), finished ( 0 );
+	for ( uint32_t loop = 0; loop < RUNNER_CHECK_LOOPS; ++loop )
+		pool.post ( [ &pool, &failures, &finished, workers, loop ]
+		{
+			RunnerCheck check;
+			CancellationToken cancel;
+			bool cancelling = loop % RUNNER_CHECK_CANCEL_EVERY == RUNNER_CHECK_CANCEL_EVERY - 1;
+			for ( std::atomic<uint32_t> & hits : check.hits )
+				hits = 0;
+			check.badThread = false;
+			check.threads = 1 + loop % ( uint32_t ) workers;
+			check.cancelAt = cancelling ? loop % RUNNER_CHECK_RANGE : RUNNER_CHECK_RANGE;
+			check.cancel = &cancel;
+
+			ImageEncoderSettings settings = { };
+			settings.threads = check.threads;
+			settings.post = PostEncoderHelper;
+			settings.executor = &pool;
+			settings.cancel = &cancel;
+
+			HRESULT hr = RunParallel ( &settings, check.threads, 0, RUNNER_CHECK_RANGE, RunnerCheckBody, &check );
+			bool passed = !check.badThread && ( hr == S_OK || ( cancelling && hr == E_ABORT ) );
+			for ( std::atomic<uint32_t> & hits : check.hits )
+				passed = passed && ( hits == 1 || ( cancelling && hits == 0 ) );
+			if ( !passed )
+				++failures;
+			++finished;
+		} );
+
+	while ( finished.load () < RUNNER_CHECK_LOOPS )
+		std::this_thread::yield ();
+	return failures.load ();
+}
+
+HRESULT BenchmarkThreadPool ( BenchmarkReport & report )
+{
+	size_t workers = ( std::max ) ( std::thread::hardware_concurrency (), 2u );
+	const size_t producerCounts [] = { 1, workers };
+	const uint32_t fanouts [] = { 1, 16 };
+	const uint32_t works [] = { 0, 1024 };
+
+	report.Print ( TEXT ( "threadpool: %u workers, %u tasks a run, work-stealing pool against one mutex queue" ),
+		( UINT ) workers, CONTENTION_TASKS );
+
+	ThreadPool stealing ( workers );
+	MutexQueuePool reference ( workers );
+	for ( size_t producers : producerCounts )
+		for ( uint32_t fanout : fanouts )
+			for ( uint32_t work : works )
+			{
+				uint64_t expected = CONTENTION_TASKS / fanout / producers * fanout * producers;
+				uint64_t stealingDone, referenceDone;
+				LONG stealingTime = RunContention ( stealing, producers, work, fanout, &stealingDone );
+				LONG referenceTime = RunContention ( reference, producers, work, fanout, &referenceDone );
+
+				report.Check ( stealingDone == expected && referenceDone == expected,
+					TEXT ( "threadpool: %u producers, fanout %u, work %u: %d ms against %d ms, %u%% of the reference time" ),
+					( UINT ) producers, fanout, work, stealingTime, referenceTime,
+					( UINT ) ( referenceTime > 0 ? ( int64_t ) stealingTime * 100 / referenceTime : 0 ) );
+			}
+
+	uint32_t failures = RunEncoderLoops ( stealing, workers );
+	report.Check ( failures == 0, TEXT ( "threadpool: %u encoder loops of %u run from pool tasks, %u with an index run other than once" ),
+		RUNNER_CHECK_LOOPS, RUNNER_CHECK_RANGE, failures );
+
+	return S_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct EncoderCheckRow
+{
+	LPCWSTR name;
+	ImageEncoderCodec codec;
+	ImageEncoderBackend backend;
+	// PNG compression level, or JPEG quality in percent; unused for QOI and JPEG XL
+	int level;
+};
+
+static const EncoderCheckRow ENCODER_CHECK_ROWS [] =
+{
+	{ TEXT ( "PNG WIC" ), IEC_PNG, IEB_WIC, -1 },
+	{ TEXT ( "PNG FFmpeg" ), IEC_PNG, IEB_FFMPEG, -1 },
+	{ TEXT ( "PNG FFmpeg level 1" ), IEC_PNG, IEB_FFMPEG, 1 },
+	{ TEXT ( "PNG FFmpeg level 3" ), IEC_PNG, IEB_FFMPEG, 3 },
+	{ TEXT ( "PNG FFmpeg level 6" ), IEC_PNG, IEB_FFMPEG, 6 },
+	{ TEXT ( "PNG FFmpeg level 9" ), IEC_PNG, IEB_FFMPEG, 9 },
+	{ TEXT ( "QOI" ), IEC_QOI, IEB_AUTO, 0 },
+	{ TEXT ( "JPEG XL lossless" ), IEC_JXL, IEB_AUTO, 0 },
+	{ TEXT ( "JPEG 80 WIC" ), IEC_JPEG, IEB_WIC, 80 },
+	{ TEXT ( "JPEG 80 FFmpeg" ), IEC_JPEG, IEB_FFMPEG, 80 },
+};
+
+HRESULT BenchmarkEncoders ( BenchmarkReport & report, LPCWSTR input )
+{
+	HRESULT hr;
+
+	// Packed BGR, which every backend takes
+	VideoDecoderSettings decoderSettings = { 0, };
+	CComPtr<IVideoDecoder> decoder;
+	uint32_t width, height, stride;
+	if ( FAILED ( hr = CreateFFmpegVideoDecoder ( &decoder ) )
+		|| FAILED ( hr = decoder->Initialize ( input, &decoderSettings ) )
+		|| FAILED ( hr = decoder->GetVideoSize ( &width, &height, &stride ) ) )
+	{
+		report.Check ( false, TEXT ( "encoders: cannot read %s, 0x%08X" ), input, ( UINT ) hr );
+		return hr;
+	}
+
+	std::vector<std::vector<BYTE>> frames;
+	while ( frames.size () < ENCODER_CHECK_FRAMES )
+	{
+		CComPtr<IVideoSample> sample;
+		uint64_t timeStamp;
+		if ( FAILED ( hr = decoder->ReadSample ( &sample, &timeStamp ) ) )
+			return hr;
+		if ( sample == nullptr )
+			break;
+
+		BYTE * pixels;
+		uint64_t length;
+		if ( FAILED ( hr = sample->Lock ( ( LPVOID* ) &pixels, &length ) ) )
+			return hr;
+		frames.emplace_back ( pixels, pixels + length );
+		sample->Unlock ();
+	}
+	decoder.Release ();
+	if ( frames.empty () )
+		return E_FAIL;
+
+	report.Print ( TEXT ( "encoders: %s, %u frames of %ux%u, each encoded %u times on one thread" ), PathFindFileName ( input ),
+		( UINT ) frames.size (), width, height, ENCODER_CHECK_ROUNDS );
+
+	ImageEncoderContext * context;
+	if ( FAILED ( hr = CreateImageEncoderContext ( &context ) ) )
+		return hr;
+	EncodedImage image = { 0, };
+
+	// Images per second and bytes per image of each row, zero for rows not in this build
+	const size_t rowCount = sizeof ( ENCODER_CHECK_ROWS ) / sizeof ( ENCODER_CHECK_ROWS [ 0 ] );
+	uint64_t rates [ rowCount ] = { 0, }, sizes [ rowCount ] = { 0, };
+
+	for ( size_t index = 0; index < rowCount; ++index )
+	{
+		const EncoderCheckRow & row = ENCODER_CHECK_ROWS [ index ];
+		ImageEncoderSettings settings = { };
+		settings.codecType = row.codec;
+		settings.backend = row.backend;
+		settings.imageProp.width = width;
+		settings.imageProp.height = height;
+		settings.imageProp.stride = stride;
+		settings.imageProp.pixelFormat = IEPF_BGR;
+		settings.threads = 1;
+		if ( row.codec == IEC_PNG )
+		{
+			settings.settings.png.filtering = true;
+			settings.settings.png.compressionLevel = row.level;
+		}
+		else if ( row.codec == IEC_JPEG )
+		{
+			settings.settings.jpeg.quality = row.level / 100.0f;
+			settings.settings.jpeg.chromaSubsample = row.level < 100;
+		}
+
+		uint64_t images = 0, bytes = 0;
+		LARGE_INTEGER started, finished;
+		QueryPerformanceCounter ( &started );
+		hr = S_OK;
+		for ( uint32_t round = 0; round < ENCODER_CHECK_ROUNDS && SUCCEEDED ( hr ); ++round )
+			for ( size_t i = 0; i < frames.size () && SUCCEEDED ( hr ); ++i )
+			{
+				if ( SUCCEEDED ( hr = EncodeImage ( &settings, frames [ i ].data (), frames [ i ].size (), &image, context ) ) )
+				{
+					++images;
+					bytes += image.size;
+				}
+			}
+		QueryPerformanceCounter ( &finished );
+
+		if ( hr == E_NOTIMPL )
+		{
+			report.Print ( TEXT ( "encoders: %-20s not in this build" ), row.name );
+			continue;
+		}
+
+		LONG elapsed = ( std::max ) ( MillisecondsBetween ( started, finished ), 1L );
+		rates [ index ] = images * 1000 / elapsed;
+		sizes [ index ] = images > 0 ? bytes / images : 0;
+		report.Check ( SUCCEEDED ( hr ), TEXT ( "encoders: %-20s %6u images/s %8u KB each" ), row.name,
+			( UINT ) rates [ index ], ( UINT ) ( sizes [ index ] / 1024 ) );
+	}
+
+	// QOI is the lossless choice for speed, so it is set against every PNG row that ran
+	for ( size_t qoi = 0; qoi < rowCount; ++qoi )
+		if ( ENCODER_CHECK_ROWS [ qoi ].codec == IEC_QOI && rates [ qoi ] > 0 )
+			for ( size_t png = 0; png < rowCount; ++png )
+				if ( ENCODER_CHECK_ROWS [ png ].codec == IEC_PNG && rates [ png ] > 0 && sizes [ png ] > 0 )
+					report.Print ( TEXT ( "encoders: QOI against %-20s %5u%% the images/s %5u%% the size" ),
+						ENCODER_CHECK_ROWS [ png ].name, ( UINT ) ( rates [ qoi ] * 100 / rates [ png ] ),
+						( UINT ) ( sizes [ qoi ] * 100 / sizes [ png ] ) );
+
+	FreeEncodedImage ( &image );
+	DestroyImageEncoderContext ( context );
+	return S_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void GetLooseFramePath ( LPCWSTR workDirectory, uint64_t index, LPWSTR path )
+{
+	wchar_t name [ 32 ];
+	wsprintf ( name, TEXT ( "frame-read-%u.bin" ), ( UINT ) index );
+	PathCombine ( path, workDirectory, name );
+}
+
+// Reads the given frames out of the pack; returns how many failed or did not match the index
+static UINT ReadPackFrames ( const FramePackReader & reader, const std::vector<uint64_t> & indices )
+{
+	UINT failures = 0;
+	for ( uint64_t index : indices )
+	{
+		FramePackSpan span;
+		if ( FAILED ( reader.GetFrame ( index, &span ) ) || ImageArchive::Checksum ( span.data, span.size ) != span.entry->crc )
+			++failures;
+	}
+	return failures;
+}
+
+// The same frames out of their loose copies
+static UINT ReadLooseFrames ( const FramePackReader & reader, LPCWSTR workDirectory, const std::vector<uint64_t> & indices,
+	std::vector<BYTE> & buffer )
+{
+	UINT failures = 0;
+	for ( uint64_t index : indices )
+	{
+		FramePackSpan span;
+		if ( FAILED ( reader.GetFrame ( index, &span ) ) )
+		{
+			++failures;
+			continue;
+		}
+
+		wchar_t path [ MAX_PATH ];
+		GetLooseFramePath ( workDirectory, index, path );
+		HANDLE file = CreateFile ( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+		if ( file == INVALID_HANDLE_VALUE )
+		{
+			++failures;
+			continue;
+		}
+
+		LARGE_INTEGER fileSize;
+		DWORD read = 0;
+		if ( GetFileSizeEx ( file, &fileSize ) && fileSize.QuadPart < 0x7fffffff )
+		{
+			buffer.resize ( ( size_t ) fileSize.QuadPart );
+			if ( !ReadFile ( file, buffer.data (), ( DWORD ) buffer.size (), &read, nullptr ) )
+				read = 0;
+		}
+		CloseHandle ( file );
+
+		if ( read != span.size || ImageArchive::Checksum ( buffer.data (), read ) != span.entry->crc )
+			++failures;
+	}
+	return failures;
+}
+
+HRESULT BenchmarkFrameReads ( BenchmarkReport & report, LPCWSTR packPath, LPCWSTR workDirectory, uint32_t count )
+{
+	HRESULT hr;
+	FramePackReader reader;
+	if ( FAILED ( hr = reader.Open ( packPath ) ) || reader.GetFrameCount () == 0 )
+	{
+		report.Check ( false, TEXT ( "framereads: cannot read a frame pack from %s, 0x%08X" ), packPath, ( UINT ) hr );
+		return FAILED ( hr ) ? hr : E_FAIL;
+	}
+
+	if ( count == 0 )
+		count = FRAME_READ_CHECK_READS;
+	std::mt19937_64 random ( 0 );
+	std::vector<uint64_t> indices ( count );
+	for ( uint64_t & index : indices )
+		index = random () % reader.GetFrameCount ();
+
+	// Only the frames the run reads get a loose copy, written from the pack so both hold the same bytes
+	std::vector<uint64_t> copied ( indices );
+	std::sort ( copied.begin (), copied.end () );
+	copied.erase ( std::unique ( copied.begin (), copied.end () ), copied.end () );
+	UINT copyFailures = 0;
+	for ( uint64_t index : copied )
+	{
+		FramePackSpan span;
+		wchar_t path [ MAX_PATH ];
+		GetLooseFramePath ( workDirectory, index, path );
+		EncodedImage image = { 0, };
+		if ( SUCCEEDED ( reader.GetFrame ( index, &span ) ) )
+		{
+			image.data = ( uint8_t* ) span.data;
+			image.size = image.capacity = span.size;
+		}
+		if ( image.data == nullptr || FAILED ( WriteImageFile ( path, &image, false ) ) )
+			++copyFailures;
+	}
+	report.Print ( TEXT ( "framereads: %s, %u random reads over %u of its %u frames" ), PathFindFileName ( packPath ),
+		count, ( UINT ) copied.size (), ( UINT ) reader.GetFrameCount () );
+	report.Check ( copyFailures == 0, TEXT ( "framereads: %u frames could not be copied out to loose files" ), copyFailures );
+
+	// The pack is mapped and the copies were just written; one untimed pass over each leaves both
+	// warm, so neither side is timed against the other's cold cache
+	std::vector<BYTE> buffer;
+	ReadPackFrames ( reader, indices );
+	ReadLooseFrames ( reader, workDirectory, indices, buffer );
+
+	LARGE_INTEGER started, finished;
+	QueryPerformanceCounter ( &started );
+	UINT packFailures = ReadPackFrames ( reader, indices );
+	QueryPerformanceCounter ( &finished );
+	LONG packTime = MillisecondsBetween ( started, finished );
+
+	QueryPerformanceCounter ( &started );
+	UINT fileFailures = ReadLooseFrames ( reader, workDirectory, indices, buffer );
+	QueryPerformanceCounter ( &finished );
+	LONG fileTime = MillisecondsBetween ( started, finished );
+
+	report.Check ( packFailures == 0, TEXT ( "framereads: pack %d ms, %u reads failed or differ from the index" ),
+		packTime, packFailures );
+	report.Check ( fileFailures == 0, TEXT ( "framereads: loose files %d ms, %u reads failed or differ from the index" ),
+		fileTime, fileFailures );
+
+	for ( uint64_t index : copied )
+	{
+		wchar_t path [ MAX_PATH ];
+		GetLooseFramePath ( workDirectory, index, path );
+		DeleteFile ( path );
+	}
+	return S_OK;
+}
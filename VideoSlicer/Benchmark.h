@@ -0,0 +1,53 @@
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <Windows.h>
+
+// Plain-text report of a headless run, written as UTF-8; every line also goes to the debugger.
+class BenchmarkReport
+{
+public:
+	BenchmarkReport ();
+	~BenchmarkReport ();
+
+	BenchmarkReport ( const BenchmarkReport & ) = delete;
+	BenchmarkReport & operator= ( const BenchmarkReport & ) = delete;
+
+public:
+	HRESULT Open ( LPCWSTR path );
+	void Close ();
+
+	// One line per call, formatted as wsprintf does
+	void Print ( LPCWSTR format, ... );
+	// A line marked PASS or FAIL; one failure fails the whole run
+	void Check ( bool passed, LPCWSTR format, ... );
+	bool HasPassed () const { return _passed; }
+
+private:
+	void WriteLine ( LPCWSTR line );
+
+private:
+	HANDLE _file;
+	bool _passed;
+};
+
+// Copies a video into a new file a chunk at a time while a following decoder reads it, and checks
+// that the follower gets every frame a plain read of the finished file gets
+HRESULT BenchmarkFollow ( BenchmarkReport & report, LPCWSTR input, LPCWSTR workDirectory );
+
+// Times ThreadPool against a single mutex-guarded queue with few and many producers, with and
+// without tasks posted from workers, and checks that every task ran on both. Then runs the encoder
+// loop runner from pool tasks, with and without cancels, and checks every index ran once.
+HRESULT BenchmarkThreadPool ( BenchmarkReport & report );
+
+// Encodes the same decoded frames with every image backend and setting on the calling thread, and
+// reports images per second and the average image size of each as one table, then how QOI
+// compares with each PNG setting on both
+HRESULT BenchmarkEncoders ( BenchmarkReport & report, LPCWSTR input );
+
+// Copies the frames a run of random reads will touch out of a frame pack into loose files, then
+// times the same reads out of the pack and out of the files, both from a warm cache. Every read is
+// checked against the CRC of the index. A count of 0 takes the default.
+HRESULT BenchmarkFrameReads ( BenchmarkReport & report, LPCWSTR packPath, LPCWSTR workDirectory, uint32_t count );
+
+#endif
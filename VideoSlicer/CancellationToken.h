@@ -0,0 +1,55 @@
+#ifndef __CANCELLATIONTOKEN_H__
+#define __CANCELLATIONTOKEN_H__
+
+#include <Windows.h>
+
+#include <atomic>
+
+// Sticky cancel request shared by everything working on one job.
+// Loops poll IsCancelled; blocking waits add GetWaitHandle to what they wait on.
+class CancellationToken
+{
+public:
+	CancellationToken ()
+		: _cancelled ( false )
+		, _event ( CreateEvent ( nullptr, TRUE, FALSE, nullptr ) )
+	{
+		_requested.QuadPart = 0;
+	}
+	~CancellationToken () { if ( _event != nullptr ) CloseHandle ( _event ); }
+
+	CancellationToken ( const CancellationToken & ) = delete;
+	CancellationToken & operator= ( const CancellationToken & ) = delete;
+
+public:
+	void Cancel ()
+	{
+		if ( _cancelled.load ( std::memory_order_relaxed ) )
+			return;
+		QueryPerformanceCounter ( &_requested );
+		_cancelled.store ( true, std::memory_order_release );
+		if ( _event != nullptr )
+			SetEvent ( _event );
+	}
+	// Only while nothing else holds the token
+	void Reset ()
+	{
+		_cancelled.store ( false, std::memory_order_relaxed );
+		_requested.QuadPart = 0;
+		if ( _event != nullptr )
+			ResetEvent ( _event );
+	}
+
+	bool IsCancelled () const { return _cancelled.load ( std::memory_order_acquire ); }
+	// Manual-reset event signalled by Cancel
+	HANDLE GetWaitHandle () const { return _event; }
+	// Performance counter value taken when Cancel was first called; zero before that
+	LARGE_INTEGER GetRequestTime () const { return IsCancelled () ? _requested : LARGE_INTEGER (); }
+
+private:
+	std::atomic<bool> _cancelled;
+	HANDLE _event;
+	LARGE_INTEGER _requested;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "CpuTopology.h"
+
+static uint32_t CountProcessors ( DWORD_PTR mask )
+{
+	uint32_t count = 0;
+	for ( ; mask != 0; mask &= mask - 1 )
+		++count;
+	return count;
+}
+
+// Appends one single-processor mask per bit of mask, lowest first
+static void SplitProcessors ( DWORD_PTR mask, std::vector<DWORD_PTR> & processors )
+{
+	for ( ; mask != 0; mask &= mask - 1 )
+		processors.push_back ( mask & ( ~mask + 1 ) );
+}
+
+HRESULT QueryCpuTopology ( CpuTopology * topology )
+{
+	DWORD_PTR processMask, systemMask;
+	if ( !GetProcessAffinityMask ( GetCurrentProcess (), &processMask, &systemMask ) )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	topology->cores.clear ();
+
+	DWORD length = 0;
+	GetLogicalProcessorInformation ( nullptr, &length );
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> information (
+		length / sizeof ( SYSTEM_LOGICAL_PROCESSOR_INFORMATION ) );
+	if ( !information.empty () && GetLogicalProcessorInformation ( information.data (), &length ) )
+	{
+		for ( const SYSTEM_LOGICAL_PROCESSOR_INFORMATION & entry : information )
+		{
+			if ( entry.Relationship == RelationProcessorCore && ( entry.ProcessorMask & processMask ) != 0 )
+				topology->cores.push_back ( entry.ProcessorMask & processMask );
+		}
+	}
+
+	// Without core information every allowed processor counts as a core of its own
+	if ( topology->cores.empty () )
+		SplitProcessors ( processMask, topology->cores );
+
+	topology->processorCount = CountProcessors ( processMask );
+	topology->usableCount = topology->processorCount;
+
+	// Containers cap CPU time through their job object instead of narrowing the affinity mask
+	JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rateControl;
+	if ( QueryInformationJobObject ( nullptr, JobObjectCpuRateControlInformation,
+			&rateControl, sizeof ( rateControl ), nullptr )
+		&& ( rateControl.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE ) )
+	{
+		// Rates are hundredths of a percent of every processor in the system; weights cap nothing
+		uint64_t rate = 0;
+		if ( rateControl.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP )
+			rate = rateControl.CpuRate;
+		else if ( rateControl.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_MIN_MAX_RATE )
+			rate = rateControl.MaxRate;
+
+		if ( rate != 0 )
+		{
+			uint64_t systemProcessors = GetActiveProcessorCount ( ALL_PROCESSOR_GROUPS );
+			uint32_t quota = ( uint32_t ) ( ( rate * systemProcessors + 9999 ) / 10000 );
+			if ( quota < 1 )
+				quota = 1;
+			if ( quota < topology->usableCount )
+				topology->usableCount = quota;
+		}
+	}
+
+	return S_OK;
+}
+
+void AssignProcessors ( const CpuTopology * topology, CpuPlacement placement,
+	uint32_t decoderCount, uint32_t encoderCount, CpuAssignment * assignment )
+{
+	const std::vector<DWORD_PTR> & cores = topology->cores;
+
+	if ( cores.empty () )
+		placement = CP_NONE;
+	if ( placement == CP_SIBLINGS && topology->processorCount <= cores.size () )
+		placement = CP_SEPARATE;
+	if ( placement == CP_SEPARATE && cores.size () <= decoderCount )
+		placement = CP_PIN;
+
+	// First hardware thread of every core available to the encoders, then all their siblings
+	std::vector<DWORD_PTR> primaries, siblings;
+	for ( size_t i = placement == CP_SEPARATE ? decoderCount : 0; i < cores.size (); ++i )
+	{
+		DWORD_PTR primary = cores [ i ] & ( ~cores [ i ] + 1 );
+		primaries.push_back ( primary );
+		SplitProcessors ( cores [ i ] & ~primary, siblings );
+	}
+
+	if ( encoderCount > topology->usableCount )
+		encoderCount = topology->usableCount;
+	if ( encoderCount < 1 )
+		encoderCount = 1;
+	assignment->decoders.assign ( decoderCount, 0 );
+	assignment->encoders.clear ();
+
+	switch ( placement )
+	{
+		case CP_NONE:
+			assignment->encoders.assign ( encoderCount, 0 );
+			return;
+
+		case CP_PIN:
+			assignment->encoders = primaries;
+			assignment->encoders.insert ( assignment->encoders.end (), siblings.begin (), siblings.end () );
+			break;
+
+		case CP_SEPARATE:
+			for ( uint32_t i = 0; i < decoderCount; ++i )
+				assignment->decoders [ i ] = cores [ i ];
+			assignment->encoders = primaries;
+			assignment->encoders.insert ( assignment->encoders.end (), siblings.begin (), siblings.end () );
+			break;
+
+		case CP_SIBLINGS:
+			for ( uint32_t i = 0; i < decoderCount; ++i )
+				assignment->decoders [ i ] = siblings [ i % siblings.size () ];
+			assignment->encoders = primaries;
+			break;
+	}
+
+	if ( assignment->encoders.size () > encoderCount )
+		assignment->encoders.resize ( encoderCount );
+}
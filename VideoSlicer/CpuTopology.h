@@ -0,0 +1,47 @@
+#ifndef __CPUTOPOLOGY_H__
+#define __CPUTOPOLOGY_H__
+
+#include <Windows.h>
+
+#include <cstdint>
+#include <vector>
+
+struct CpuTopology
+{
+	// Affinity mask of every physical core, restricted to the processors this process may run on
+	std::vector<DWORD_PTR> cores;
+	// Number of logical processors in cores
+	uint32_t processorCount;
+	// Processors the job object CPU rate cap lets us keep busy; processorCount when there is no cap
+	uint32_t usableCount;
+};
+
+// Only the processor group of the calling process is considered.
+HRESULT QueryCpuTopology ( CpuTopology * topology );
+
+enum CpuPlacement
+{
+	// Threads are left to the scheduler
+	CP_NONE,
+	// Encode workers are pinned to one logical processor each, physical cores first
+	CP_PIN,
+	// Decode threads get whole cores of their own; encode workers share the rest
+	CP_SEPARATE,
+	// Decode threads run on hyperthread siblings of the cores the encode workers are pinned to
+	CP_SIBLINGS,
+};
+
+struct CpuAssignment
+{
+	// One affinity mask per decode thread and per encode worker; zero leaves that thread unpinned
+	std::vector<DWORD_PTR> decoders;
+	std::vector<DWORD_PTR> encoders;
+};
+
+// Sizes the encode workers to encoderCount, the processors left once decoding has its share, and
+// picks masks for the placement. Placements the topology cannot satisfy fall back to the next
+// simpler one.
+void AssignProcessors ( const CpuTopology * topology, CpuPlacement placement,
+	uint32_t decoderCount, uint32_t encoderCount, CpuAssignment * assignment );
+
+#endif
@@ -0,0 +1,129 @@
+#include "FramePack.h"
+
+#include <cstring>
+
+FramePackReader::FramePackReader ()
+	: _file ( INVALID_HANDLE_VALUE ), _mapping ( nullptr ), _view ( nullptr ), _size ( 0 )
+	, _index ( nullptr ), _frameCount ( 0 ), _entrySize ( 0 )
+{
+
+}
+
+FramePackReader::~FramePackReader ()
+{
+	Close ();
+}
+
+HRESULT FramePackReader::Open ( LPCWSTR path )
+{
+	if ( _file != INVALID_HANDLE_VALUE )
+		return E_INVALIDARG;
+
+	_file = CreateFile ( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr );
+	if ( _file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx ( _file, &fileSize ) )
+	{
+		HRESULT hr = HRESULT_FROM_WIN32 ( GetLastError () );
+		Close ();
+		return hr;
+	}
+	_size = fileSize.QuadPart;
+	// A view of the whole file has to fit the address space
+	if ( _size < sizeof ( FramePackHeader ) + sizeof ( FramePackFooter ) || _size > ( SIZE_T ) -1 )
+	{
+		Close ();
+		return HRESULT_FROM_WIN32 ( ERROR_INVALID_DATA );
+	}
+
+	_mapping = CreateFileMapping ( _file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	if ( _mapping != nullptr )
+		_view = ( const uint8_t* ) MapViewOfFile ( _mapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( _view == nullptr )
+	{
+		HRESULT hr = HRESULT_FROM_WIN32 ( GetLastError () );
+		Close ();
+		return hr;
+	}
+
+	FramePackHeader header;
+	FramePackFooter footer;
+	memcpy ( &header, _view, sizeof ( header ) );
+	memcpy ( &footer, _view + _size - sizeof ( footer ), sizeof ( footer ) );
+
+	// The index has to fill the space between the images and the footer exactly, its entries
+	// aligned so they can be read in place
+	uint64_t indexEnd = _size - sizeof ( footer );
+	if ( memcmp ( header.magic, FRAME_PACK_MAGIC, 8 ) != 0 || memcmp ( footer.magic, FRAME_PACK_MAGIC, 8 ) != 0
+		|| header.version != FRAME_PACK_VERSION || footer.entrySize < sizeof ( FramePackEntry )
+		|| footer.entrySize % 8 != 0 || footer.indexOffset % 8 != 0
+		|| footer.indexOffset < sizeof ( header ) || footer.indexOffset > indexEnd
+		|| footer.frameCount != ( indexEnd - footer.indexOffset ) / footer.entrySize
+		|| ( indexEnd - footer.indexOffset ) % footer.entrySize != 0 )
+	{
+		Close ();
+		return HRESULT_FROM_WIN32 ( ERROR_INVALID_DATA );
+	}
+
+	_index = _view + footer.indexOffset;
+	_frameCount = footer.frameCount;
+	_entrySize = footer.entrySize;
+	return S_OK;
+}
+
+void FramePackReader::Close ()
+{
+	if ( _view != nullptr )
+		UnmapViewOfFile ( _view );
+	if ( _mapping != nullptr )
+		CloseHandle ( _mapping );
+	if ( _file != INVALID_HANDLE_VALUE )
+		CloseHandle ( _file );
+
+	_file = INVALID_HANDLE_VALUE;
+	_mapping = nullptr;
+	_view = nullptr;
+	_size = 0;
+	_index = nullptr;
+	_frameCount = 0;
+	_entrySize = 0;
+}
+
+HRESULT FramePackReader::GetFrame ( uint64_t index, FramePackSpan * span ) const
+{
+	if ( index >= _frameCount )
+		return E_INVALIDARG;
+
+	const FramePackEntry * entry = ( const FramePackEntry* ) ( _index + index * _entrySize );
+	uint64_t imagesEnd = _index - _view;
+	if ( entry->offset < sizeof ( FramePackHeader ) || entry->offset > imagesEnd || entry->size > imagesEnd - entry->offset )
+		return HRESULT_FROM_WIN32 ( ERROR_INVALID_DATA );
+
+	span->data = _view + entry->offset;
+	span->size = entry->size;
+	span->entry = entry;
+	return S_OK;
+}
+
+HRESULT FramePackReader::FindFrame ( uint32_t stream, int64_t timeStamp, uint64_t * index ) const
+{
+	// First entry past ( stream, timeStamp ); the one before it is the answer if it is of the stream
+	uint64_t low = 0, high = _frameCount;
+	while ( low < high )
+	{
+		uint64_t middle = low + ( high - low ) / 2;
+		const FramePackEntry * entry = ( const FramePackEntry* ) ( _index + middle * _entrySize );
+		if ( entry->stream < stream || ( entry->stream == stream && entry->timeStamp <= timeStamp ) )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if ( low == 0 || ( ( const FramePackEntry* ) ( _index + ( low - 1 ) * _entrySize ) )->stream != stream )
+		return HRESULT_FROM_WIN32 ( ERROR_NOT_FOUND );
+
+	*index = low - 1;
+	return S_OK;
+}
@@ -0,0 +1,90 @@
+#ifndef __FRAMEPACK_H__
+#define __FRAMEPACK_H__
+
+#include <Windows.h>
+
+#include <cstdint>
+
+// A frame pack is one file of encoded images laid end to end after a header, followed by an index
+// of fixed-size entries and a footer that finds the index. Everything is little-endian, and the
+// index starts 8-byte aligned. It is sorted by stream, then by time stamp, so a frame is found
+// without reading any image.
+// This header and FramePack.cpp need nothing else from VideoSlicer, so readers can take them alone.
+
+#define FRAME_PACK_MAGIC "VSFRPACK"
+#define FRAME_PACK_VERSION 1
+
+struct FramePackHeader
+{
+	char magic [ 8 ];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct FramePackEntry
+{
+	// 100-nanosecond units, as the decoders give them
+	int64_t timeStamp;
+	uint64_t offset;
+	uint32_t size;
+	// CRC-32 of the image, the one zip uses
+	uint32_t crc;
+	uint32_t stream;
+	// ImageEncoderCodec
+	uint32_t codec;
+	uint32_t width, height;
+};
+
+struct FramePackFooter
+{
+	uint64_t indexOffset;
+	uint64_t frameCount;
+	// sizeof ( FramePackEntry ) of the writer, so later versions may append fields to an entry
+	uint32_t entrySize;
+	uint32_t version;
+	char magic [ 8 ];
+};
+
+static_assert ( sizeof ( FramePackHeader ) == 16, "frame pack header layout" );
+static_assert ( sizeof ( FramePackEntry ) == 40, "frame pack entry layout" );
+static_assert ( sizeof ( FramePackFooter ) == 32, "frame pack footer layout" );
+
+// One image inside a mapped pack; valid until the reader is closed
+struct FramePackSpan
+{
+	const uint8_t * data;
+	size_t size;
+	const FramePackEntry * entry;
+};
+
+// Maps a whole pack read-only and hands out images in place, without copying them.
+// Any number of threads may read one open pack.
+class FramePackReader
+{
+public:
+	FramePackReader ();
+	~FramePackReader ();
+
+	FramePackReader ( const FramePackReader & ) = delete;
+	FramePackReader & operator= ( const FramePackReader & ) = delete;
+
+public:
+	HRESULT Open ( LPCWSTR path );
+	void Close ();
+
+	uint64_t GetFrameCount () const { return _frameCount; }
+	// Frames are numbered in index order
+	HRESULT GetFrame ( uint64_t index, FramePackSpan * span ) const;
+	// The last frame of the stream at or before the time stamp, the one on screen at that time
+	HRESULT FindFrame ( uint32_t stream, int64_t timeStamp, uint64_t * index ) const;
+
+private:
+	HANDLE _file, _mapping;
+	const uint8_t * _view;
+	uint64_t _size;
+	const uint8_t * _index;
+	uint64_t _frameCount;
+	uint32_t _entrySize;
+};
+
+#endif
@@ -0,0 +1,401 @@
+#include "ImageEncoderContext.h"
+
+#include <vector>
+#include <algorithm>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
+
+#pragma comment ( lib, "avcodec.lib" )
+#pragma comment ( lib, "avutil.lib" )
+#pragma comment ( lib, "swscale.lib" )
+
+HRESULT CreateImageEncoderContext ( ImageEncoderContext ** context )
+{
+	ImageEncoderContext * created = new ImageEncoderContext;
+	created->codecContext = nullptr;
+	created->pts = 0;
+	created->prediction = nullptr;
+	created->threads = 0;
+	created->jxlEncoder = nullptr;
+	created->frame = av_frame_alloc ();
+	created->source = av_frame_alloc ();
+	created->packet = av_packet_alloc ();
+
+	if ( created->frame == nullptr || created->source == nullptr || created->packet == nullptr )
+	{
+		DestroyImageEncoderContext ( created );
+		return E_OUTOFMEMORY;
+	}
+
+	*context = created;
+	return S_OK;
+}
+
+void DestroyImageEncoderContext ( ImageEncoderContext * context )
+{
+	if ( context == nullptr )
+		return;
+
+	avcodec_free_context ( &context->codecContext );
+	for ( SwsContext * swsContext : context->swsContexts )
+		sws_freeContext ( swsContext );
+	for ( AVFrame * bandFrame : context->bandFrames )
+		av_frame_free ( &bandFrame );
+	av_frame_free ( &context->frame );
+	av_frame_free ( &context->source );
+	av_packet_free ( &context->packet );
+	DestroyJxlEncoder ( context );
+	delete context;
+}
+
+// libjpeg scales its example quantization tables by 200 - 2 * quality percent above quality 50 and by
+// 5000 / quality below it. The MJPEG encoder writes the MPEG-1 intra matrix times qscale / 8, which is
+// about 0.63 of the example tables, so the same tables come out at roughly 12.7 times the libjpeg scale.
+static int JpegQualityToQScale ( float quality )
+{
+	float percent = quality * 100;
+	float scale = percent >= 50 ? ( 200 - 2 * percent ) / 100 : 50 / ( percent > 1 ? percent : 1 );
+	int qscale = ( int ) ( scale * 12.7f + 0.5f );
+	return qscale < 1 ? 1 : ( qscale > 31 ? 31 : qscale );
+}
+
+// Sub and Up filter rows with the vectorized byte difference; Paeth compresses better at a scalar
+// pace, and mixed tries every filter on every row the way WIC's adaptive filtering does.
+static LPCSTR GetPngPrediction ( const ImageEncoderSettings * settings )
+{
+	int level = settings->settings.png.compressionLevel;
+	if ( !settings->settings.png.filtering || level == 0 )
+		return "none";
+	if ( level > 0 && level <= 3 )
+		return "up";
+	if ( level >= 9 )
+		return "mixed";
+	return "paeth";
+}
+
+// The codec context is only reopened when the codec, the image size, the sampling or the PNG settings change
+static HRESULT PrepareCodec ( ImageEncoderContext * context, const ImageEncoderSettings * settings,
+	int width, int height, AVPixelFormat format )
+{
+	bool png = settings->codecType == IEC_PNG;
+	AVCodecID codecId = png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG;
+	int level = png && settings->settings.png.compressionLevel >= 0
+		? settings->settings.png.compressionLevel : FF_COMPRESSION_DEFAULT;
+	LPCSTR prediction = png ? GetPngPrediction ( settings ) : nullptr;
+	int interlace = png && settings->settings.png.interlace ? AV_CODEC_FLAG_INTERLACED_DCT : 0;
+	// PNG deflates the whole image as one stream, so only JPEG splits the encode itself
+	uint32_t threads = !png && settings->threads > 1 ? settings->threads : 1;
+
+	AVCodecContext * codecContext = context->codecContext;
+	if ( codecContext != nullptr && codecContext->codec_id == codecId
+		&& codecContext->width == width && codecContext->height == height && codecContext->pix_fmt == format
+		&& codecContext->compression_level == level && context->prediction == prediction
+		&& ( codecContext->flags & AV_CODEC_FLAG_INTERLACED_DCT ) == interlace && context->threads == threads )
+		return S_OK;
+
+	avcodec_free_context ( &context->codecContext );
+	av_frame_unref ( context->frame );
+
+	AVCodec * codec = avcodec_find_encoder ( codecId );
+	if ( codec == nullptr )
+		return E_NOTIMPL;
+
+	codecContext = avcodec_alloc_context3 ( codec );
+	if ( codecContext == nullptr )
+		return E_OUTOFMEMORY;
+
+	codecContext->width = width;
+	codecContext->height = height;
+	codecContext->pix_fmt = format;
+	codecContext->time_base.num = 1;
+	codecContext->time_base.den = 25;
+	// Sliced JPEG separates the strips with restart markers, each strip's entropy segment
+	// coded on a thread of its own
+	codecContext->thread_count = threads;
+	codecContext->thread_type = FF_THREAD_SLICE;
+
+	AVDictionary * options = nullptr;
+	if ( png )
+	{
+		codecContext->compression_level = level;
+		codecContext->flags |= interlace;
+		av_dict_set ( &options, "pred", prediction, 0 );
+	}
+	else
+	{
+		codecContext->color_range = AVCOL_RANGE_JPEG;
+		codecContext->flags |= AV_CODEC_FLAG_QSCALE;
+		codecContext->qmin = 1;
+	}
+
+	int result = avcodec_open2 ( codecContext, codec, &options );
+	av_dict_free ( &options );
+	if ( result < 0 )
+	{
+		avcodec_free_context ( &codecContext );
+		return E_FAIL;
+	}
+	context->codecContext = codecContext;
+	context->prediction = prediction;
+	context->threads = threads;
+
+	context->frame->format = format;
+	context->frame->width = width;
+	context->frame->height = height;
+	if ( av_frame_get_buffer ( context->frame, 32 ) < 0 )
+	{
+		avcodec_free_context ( &context->codecContext );
+		return E_OUTOFMEMORY;
+	}
+
+	return S_OK;
+}
+
+static AVPixelFormat GetSourceFormat ( const ImageEncoderSettings * settings )
+{
+	bool fullRange = settings->imageProp.fullRange;
+	switch ( settings->imageProp.pixelFormat )
+	{
+		case IEPF_YUV420P: return fullRange ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+		case IEPF_YUV422P: return fullRange ? AV_PIX_FMT_YUVJ422P : AV_PIX_FMT_YUV422P;
+		case IEPF_YUV444P: return fullRange ? AV_PIX_FMT_YUVJ444P : AV_PIX_FMT_YUV444P;
+		default: return settings->imageProp.width * 4 == settings->imageProp.stride ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_BGR24;
+	}
+}
+
+// PNG takes RGB. JPEG keeps the sampling of subsampled sources; 4:4:4 and BGR are brought down
+// to 4:2:0 when asked.
+static AVPixelFormat GetTargetFormat ( const ImageEncoderSettings * settings )
+{
+	if ( settings->codecType == IEC_PNG )
+		return AV_PIX_FMT_RGB24;
+	if ( !settings->settings.jpeg.chromaSubsample )
+		return AV_PIX_FMT_YUVJ444P;
+	return settings->imageProp.pixelFormat == IEPF_YUV422P ? AV_PIX_FMT_YUVJ422P : AV_PIX_FMT_YUVJ420P;
+}
+
+// Rows top to bottom go through a scaler of their own as if they were a whole image. Converted
+// in 64-row steps so a cancelled job gives the worker back within a fraction of an image.
+// Converts source rows [ top, bottom ) as an image of their own into the target planes
+static HRESULT ConvertRows ( SwsContext ** swsContext, const ImageEncoderSettings * settings,
+	AVPixelFormat sourceFormat, const uint8_t * const sourceData [ 4 ], const int sourceStride [ 4 ],
+	AVPixelFormat targetFormat, uint8_t * const target [ 4 ], const int targetStride [ 4 ], int top, int bottom )
+{
+	int width = settings->imageProp.width, height = bottom - top;
+	*swsContext = sws_getCachedContext ( *swsContext, width, height, sourceFormat,
+		width, height, targetFormat, SWS_BICUBIC, nullptr, nullptr, nullptr );
+	if ( *swsContext == nullptr )
+		return E_FAIL;
+
+	int sourceShift = av_pix_fmt_desc_get ( sourceFormat )->log2_chroma_h;
+
+	const int stepHeight = 64;
+	for ( int row = 0; row < height; row += stepHeight )
+	{
+		if ( settings->cancel != nullptr && settings->cancel->IsCancelled () )
+			return E_ABORT;
+
+		const uint8_t * source [ 4 ];
+		for ( int plane = 0; plane < 4; ++plane )
+			source [ plane ] = sourceData [ plane ] == nullptr ? nullptr
+				: sourceData [ plane ] + ( size_t ) ( plane == 0 ? top + row : ( top + row ) >> sourceShift ) * sourceStride [ plane ];
+		sws_scale ( *swsContext, source, sourceStride, row,
+			height - row < stepHeight ? height - row : stepHeight, target, targetStride );
+	}
+
+	return S_OK;
+}
+
+// Rows a band converts past each of its edges when chroma is resampled vertically, so the filter
+// reads the neighbours it would across the whole image instead of a repeated edge row. Even, so
+// the extra rows start on a chroma row.
+#define BAND_OVERLAP_ROWS 16
+
+// One band of the conversion; bands start on a multiple of 16 rows and so on a chroma row
+struct ConvertJob
+{
+	ImageEncoderContext * context;
+	const ImageEncoderSettings * settings;
+	AVPixelFormat sourceFormat;
+	const uint8_t * const * sourceData;
+	const int * sourceStride;
+	AVFrame * frame;
+	int bandHeight;
+	bool overlap;
+};
+
+static HRESULT ConvertBand ( const ConvertJob * job, uint32_t band )
+{
+	const ImageEncoderSettings * settings = job->settings;
+	AVFrame * frame = job->frame;
+	AVPixelFormat format = ( AVPixelFormat ) frame->format;
+	int height = settings->imageProp.height;
+	int top = band * job->bandHeight, bottom = ( std::min ) ( top + job->bandHeight, height );
+	int targetShift = av_pix_fmt_desc_get ( format )->log2_chroma_h;
+	SwsContext ** swsContext = &job->context->swsContexts [ band ];
+
+	if ( !job->overlap )
+	{
+		uint8_t * target [ 4 ];
+		for ( int plane = 0; plane < 4; ++plane )
+			target [ plane ] = frame->data [ plane ] == nullptr ? nullptr
+				: frame->data [ plane ] + ( size_t ) ( plane == 0 ? top : top >> targetShift ) * frame->linesize [ plane ];
+		return ConvertRows ( swsContext, settings, job->sourceFormat, job->sourceData, job->sourceStride,
+			format, target, frame->linesize, top, bottom );
+	}
+
+	// The band and its overlap go to a frame of the band's own, and only the band's rows are kept
+	int first = ( std::max ) ( top - BAND_OVERLAP_ROWS, 0 ), last = ( std::min ) ( bottom + BAND_OVERLAP_ROWS, height );
+	AVFrame * scratch = job->context->bandFrames [ band ];
+	if ( scratch->format != format || scratch->width != frame->width || scratch->height < last - first )
+	{
+		av_frame_unref ( scratch );
+		scratch->format = format;
+		scratch->width = frame->width;
+		scratch->height = last - first;
+		if ( av_frame_get_buffer ( scratch, 0 ) < 0 )
+			return E_OUTOFMEMORY;
+	}
+
+	HRESULT hr;
+	if ( FAILED ( hr = ConvertRows ( swsContext, settings, job->sourceFormat, job->sourceData, job->sourceStride,
+		format, scratch->data, scratch->linesize, first, last ) ) )
+		return hr;
+
+	for ( int plane = 0; plane < 4 && frame->data [ plane ] != nullptr; ++plane )
+	{
+		int shift = plane == 0 ? 0 : targetShift;
+		int rows = ( ( bottom + ( 1 << shift ) - 1 ) >> shift ) - ( top >> shift );
+		av_image_copy_plane ( frame->data [ plane ] + ( size_t ) ( top >> shift ) * frame->linesize [ plane ], frame->linesize [ plane ],
+			scratch->data [ plane ] + ( size_t ) ( ( top - first ) >> shift ) * scratch->linesize [ plane ], scratch->linesize [ plane ],
+			av_image_get_linesize ( format, frame->width, plane ), rows );
+	}
+
+	return S_OK;
+}
+
+static void ConvertBandBody ( void * argument, uint32_t band, uint32_t )
+{
+	const ConvertJob * job = ( const ConvertJob* ) argument;
+	job->context->bandResults [ band ] = ConvertBand ( job, band );
+}
+
+static HRESULT EncodeWithContext ( ImageEncoderContext * context, const ImageEncoderSettings * settings,
+	LPVOID buffer, uint64_t bufferLength, EncodedImage * output )
+{
+	HRESULT hr;
+
+	int width = settings->imageProp.width, height = settings->imageProp.height;
+	int stride = settings->imageProp.stride, chromaStride = settings->imageProp.chromaStride;
+	bool planar = settings->imageProp.pixelFormat != IEPF_BGR;
+
+	// Planes follow each other in the buffer, chroma halved vertically for 4:2:0 only
+	int chromaShift = settings->imageProp.pixelFormat == IEPF_YUV420P ? 1 : 0;
+	int chromaHeight = planar ? ( height + chromaShift ) >> chromaShift : 0;
+	if ( ( uint64_t ) stride * height + ( uint64_t ) chromaStride * chromaHeight * 2 > bufferLength )
+		return E_INVALIDARG;
+
+	const uint8_t * sourceData [ 4 ] = { ( const uint8_t* ) buffer, nullptr, nullptr, nullptr };
+	int sourceStride [ 4 ] = { stride, 0, 0, 0 };
+	if ( planar )
+	{
+		sourceData [ 1 ] = sourceData [ 0 ] + ( size_t ) stride * height;
+		sourceData [ 2 ] = sourceData [ 1 ] + ( size_t ) chromaStride * chromaHeight;
+		sourceStride [ 1 ] = sourceStride [ 2 ] = chromaStride;
+	}
+
+	AVPixelFormat sourceFormat = GetSourceFormat ( settings );
+	AVPixelFormat format = GetTargetFormat ( settings );
+	if ( FAILED ( hr = PrepareCodec ( context, settings, width, height, format ) ) )
+		return hr;
+
+	AVFrame * frame = context->frame;
+	if ( sourceFormat == format )
+	{
+		// Full-range planes in the target sampling go to the encoder without a conversion pass
+		frame = context->source;
+		frame->format = format;
+		frame->width = width;
+		frame->height = height;
+		for ( int plane = 0; plane < 3; ++plane )
+		{
+			frame->data [ plane ] = ( uint8_t* ) sourceData [ plane ];
+			frame->linesize [ plane ] = sourceStride [ plane ];
+		}
+	}
+	else
+	{
+		if ( av_frame_make_writable ( frame ) < 0 )
+			return E_OUTOFMEMORY;
+
+		// Large images convert in bands on workers the caller's pool lends; the calling thread takes
+		// part and does whatever no helper got to
+		uint32_t bands = settings->threads > 1 ? settings->threads : 1;
+		int bandHeight = ( ( height + bands - 1 ) / bands + 15 ) & ~15;
+		bands = ( height + bandHeight - 1 ) / bandHeight;
+		for ( size_t i = context->swsContexts.size (); i < bands; ++i )
+			context->swsContexts.push_back ( nullptr );
+		for ( size_t i = context->bandFrames.size (); i < bands; ++i )
+		{
+			AVFrame * bandFrame = av_frame_alloc ();
+			if ( bandFrame == nullptr )
+				return E_OUTOFMEMORY;
+			context->bandFrames.push_back ( bandFrame );
+		}
+
+		std::vector<HRESULT> & results = context->bandResults;
+		results.assign ( bands, S_OK );
+
+		ConvertJob job = { context, settings, sourceFormat, sourceData, sourceStride, frame, bandHeight,
+			bands > 1 && av_pix_fmt_desc_get ( sourceFormat )->log2_chroma_h != av_pix_fmt_desc_get ( format )->log2_chroma_h };
+		if ( FAILED ( hr = RunParallel ( settings, bands, 0, bands, ConvertBandBody, &job ) ) )
+			return hr;
+
+		for ( HRESULT result : results )
+			if ( FAILED ( result ) )
+				return result;
+	}
+
+	if ( settings->cancel != nullptr && settings->cancel->IsCancelled () )
+		return E_ABORT;
+
+	if ( settings->codecType == IEC_JPEG )
+		frame->quality = JpegQualityToQScale ( settings->settings.jpeg.quality ) * FF_QP2LAMBDA;
+	frame->pts = context->pts++;
+
+	if ( avcodec_send_frame ( context->codecContext, frame ) < 0 )
+		return E_FAIL;
+
+	AVPacket * packet = context->packet;
+	if ( avcodec_receive_packet ( context->codecContext, packet ) < 0 )
+		return E_FAIL;
+
+	hr = AppendEncodedImage ( output, packet->data, packet->size );
+	av_packet_unref ( packet );
+	return hr;
+}
+
+HRESULT EncodeImageFFmpeg ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context )
+{
+	// Callers without a context of their own pay the codec setup for every image
+	ImageEncoderContext * oneShot = nullptr;
+	if ( context == nullptr )
+	{
+		HRESULT hr;
+		if ( FAILED ( hr = CreateImageEncoderContext ( &oneShot ) ) )
+			return hr;
+		context = oneShot;
+	}
+
+	HRESULT hr = EncodeWithContext ( context, settings, buffer, bufferLength, output );
+	DestroyImageEncoderContext ( oneShot );
+	return hr;
+}
@@ -0,0 +1,173 @@
+#include "ImageEncoderContext.h"
+
+#ifdef VIDEOSLICER_JXL
+
+#include <vector>
+
+#include <jxl/encode.h>
+
+#pragma comment ( lib, "jxl.lib" )
+
+#define JXL_OUTPUT_CHUNK_SIZE ( 1024 * 1024 )
+
+// libjxl's parallel-for over the shared loop runner
+struct JxlLoop
+{
+	void * jxlOpaque;
+	JxlParallelRunFunction function;
+};
+
+static void RunJxlBody ( void * argument, uint32_t index, uint32_t thread )
+{
+	JxlLoop * loop = ( JxlLoop* ) argument;
+	loop->function ( loop->jxlOpaque, index, thread );
+}
+
+static JxlParallelRetCode RunOnPool ( void * runnerOpaque, void * jxlOpaque, JxlParallelRunInit init,
+	JxlParallelRunFunction function, uint32_t startRange, uint32_t endRange )
+{
+	const ImageEncoderSettings * settings = ( const ImageEncoderSettings* ) runnerOpaque;
+	uint32_t count = endRange - startRange;
+	if ( count == 0 )
+		return 0;
+
+	uint32_t threads = settings->threads > 1 && settings->post != nullptr ? settings->threads : 1;
+	if ( threads > count )
+		threads = count;
+
+	JxlParallelRetCode result = init ( jxlOpaque, threads );
+	if ( result != 0 )
+		return result;
+
+	JxlLoop loop = { jxlOpaque, function };
+	return FAILED ( RunParallel ( settings, threads, startRange, endRange, RunJxlBody, &loop ) ) ? -1 : 0;
+}
+
+// libjxl fills whatever room is left and asks for more until the codestream is complete
+static HRESULT TakeEncodedImage ( JxlEncoder * encoder, EncodedImage * output )
+{
+	for ( ;; )
+	{
+		HRESULT hr;
+		if ( FAILED ( hr = ReserveEncodedImage ( output, output->size + JXL_OUTPUT_CHUNK_SIZE ) ) )
+			return hr;
+
+		uint8_t * next = output->data + output->size;
+		size_t available = output->capacity - output->size;
+		JxlEncoderStatus status = JxlEncoderProcessOutput ( encoder, &next, &available );
+		if ( status == JXL_ENC_ERROR )
+			return E_FAIL;
+
+		output->size = next - output->data;
+		if ( status == JXL_ENC_SUCCESS )
+			return S_OK;
+	}
+}
+
+// libjxl takes RGB, so rows are swizzled out of BGR24 or BGR0 first. A context keeps the encoder
+// and the rows for the next image; without one both are made for this image alone.
+static HRESULT EncodeJxl ( const ImageEncoderSettings * settings, const uint8_t * pixels, EncodedImage * output,
+	ImageEncoderContext * context )
+{
+	uint32_t width = settings->imageProp.width, height = settings->imageProp.height;
+	uint32_t stride = settings->imageProp.stride;
+	uint32_t pixelSize = width * 4 == stride ? 4 : 3;
+
+	std::vector<uint8_t> ownPixels;
+	std::vector<uint8_t> & rgb = context != nullptr ? context->jxlPixels : ownPixels;
+	rgb.resize ( ( size_t ) width * height * 3 );
+	for ( uint32_t y = 0; y < height; ++y )
+	{
+		const uint8_t * source = pixels + ( size_t ) y * stride;
+		uint8_t * target = &rgb [ ( size_t ) y * width * 3 ];
+		for ( uint32_t x = 0; x < width; ++x, source += pixelSize, target += 3 )
+		{
+			target [ 0 ] = source [ 2 ];
+			target [ 1 ] = source [ 1 ];
+			target [ 2 ] = source [ 0 ];
+		}
+	}
+
+	JxlEncoder * encoder = context != nullptr ? context->jxlEncoder : nullptr;
+	if ( encoder != nullptr )
+		JxlEncoderReset ( encoder );
+	else if ( ( encoder = JxlEncoderCreate ( nullptr ) ) == nullptr )
+		return E_OUTOFMEMORY;
+	else if ( context != nullptr )
+		context->jxlEncoder = encoder;
+
+	HRESULT hr = E_FAIL;
+	do
+	{
+		if ( JxlEncoderSetParallelRunner ( encoder, RunOnPool, ( void* ) settings ) != JXL_ENC_SUCCESS )
+			break;
+
+		JxlBasicInfo info;
+		JxlEncoderInitBasicInfo ( &info );
+		info.xsize = width;
+		info.ysize = height;
+		info.bits_per_sample = 8;
+		info.num_color_channels = 3;
+		info.uses_original_profile = JXL_TRUE;
+		if ( JxlEncoderSetBasicInfo ( encoder, &info ) != JXL_ENC_SUCCESS )
+			break;
+
+		JxlColorEncoding colorEncoding;
+		JxlColorEncodingSetToSRGB ( &colorEncoding, JXL_FALSE );
+		if ( JxlEncoderSetColorEncoding ( encoder, &colorEncoding ) != JXL_ENC_SUCCESS )
+			break;
+
+		// Effort 1 is libjxl's dedicated fast lossless path
+		JxlEncoderFrameSettings * frameSettings = JxlEncoderFrameSettingsCreate ( encoder, nullptr );
+		if ( JxlEncoderSetFrameLossless ( frameSettings, JXL_TRUE ) != JXL_ENC_SUCCESS
+			|| JxlEncoderFrameSettingsSetOption ( frameSettings, JXL_ENC_FRAME_SETTING_EFFORT, 1 ) != JXL_ENC_SUCCESS )
+			break;
+
+		JxlPixelFormat pixelFormat = { 3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0 };
+		if ( JxlEncoderAddImageFrame ( frameSettings, &pixelFormat, rgb.data (), rgb.size () ) != JXL_ENC_SUCCESS )
+			break;
+		JxlEncoderCloseInput ( encoder );
+
+		hr = TakeEncodedImage ( encoder, output );
+	} while ( false );
+
+	if ( context == nullptr )
+		JxlEncoderDestroy ( encoder );
+
+	if ( FAILED ( hr ) && settings->cancel != nullptr && settings->cancel->IsCancelled () )
+		return E_ABORT;
+	return hr;
+}
+
+HRESULT EncodeImageJXL ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context )
+{
+	if ( settings->imageProp.pixelFormat != IEPF_BGR )
+		return E_INVALIDARG;
+	if ( ( uint64_t ) settings->imageProp.stride * settings->imageProp.height > bufferLength )
+		return E_INVALIDARG;
+
+	return EncodeJxl ( settings, ( const uint8_t* ) buffer, output, context );
+}
+
+void DestroyJxlEncoder ( ImageEncoderContext * context )
+{
+	if ( context->jxlEncoder != nullptr )
+		JxlEncoderDestroy ( context->jxlEncoder );
+	context->jxlEncoder = nullptr;
+}
+
+#else
+
+HRESULT EncodeImageJXL ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context )
+{
+	return E_NOTIMPL;
+}
+
+void DestroyJxlEncoder ( ImageEncoderContext * context )
+{
+
+}
+
+#endif
@@ -0,0 +1,217 @@
+#include "ImageEncoder.h"
+
+#include <cstring>
+
+// The Quite OK Image format, https://qoiformat.org/qoi-specification.pdf
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_PIXELS 400000000
+#define QOI_HASH( r, g, b, a ) ( ( ( r ) * 3 + ( g ) * 5 + ( b ) * 7 + ( a ) * 11 ) & 63 )
+
+static const uint8_t QOI_PADDING [ 8 ] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static void PutBigEndian ( uint8_t * data, uint32_t value )
+{
+	data [ 0 ] = ( uint8_t ) ( value >> 24 );
+	data [ 1 ] = ( uint8_t ) ( value >> 16 );
+	data [ 2 ] = ( uint8_t ) ( value >> 8 );
+	data [ 3 ] = ( uint8_t ) value;
+}
+
+static uint32_t GetBigEndian ( const uint8_t * data )
+{
+	return ( ( uint32_t ) data [ 0 ] << 24 ) | ( ( uint32_t ) data [ 1 ] << 16 ) | ( ( uint32_t ) data [ 2 ] << 8 ) | data [ 3 ];
+}
+
+// BGR24 and BGR0 rows are read as they are; both come out as three-channel sRGB
+static HRESULT EncodeQoi ( const ImageEncoderSettings * settings, const uint8_t * pixels, EncodedImage * output )
+{
+	HRESULT hr;
+	uint32_t width = settings->imageProp.width, height = settings->imageProp.height;
+	uint32_t stride = settings->imageProp.stride;
+	uint32_t pixelSize = width * 4 == stride ? 4 : 3;
+
+	// No pixel takes more than an RGB op, so the output is reserved once and never checked again
+	if ( FAILED ( hr = ReserveEncodedImage ( output, QOI_HEADER_SIZE + ( size_t ) width * height * 4 + sizeof ( QOI_PADDING ) ) ) )
+		return hr;
+	uint8_t * encoded = output->data;
+	size_t length = 0;
+
+	memcpy ( encoded, "qoif", 4 );
+	PutBigEndian ( encoded + 4, width );
+	PutBigEndian ( encoded + 8, height );
+	encoded [ 12 ] = 3;
+	encoded [ 13 ] = 0;
+	length = QOI_HEADER_SIZE;
+
+	// Entries start out transparent black, which no opaque pixel matches
+	uint32_t index [ 64 ] = { 0, };
+	uint8_t pr = 0, pg = 0, pb = 0;
+	uint32_t run = 0;
+
+	for ( uint32_t y = 0; y < height; ++y )
+	{
+		if ( ( y & 63 ) == 0 && settings->cancel != nullptr && settings->cancel->IsCancelled () )
+			return E_ABORT;
+
+		const uint8_t * row = pixels + ( size_t ) y * stride;
+		for ( uint32_t x = 0; x < width; ++x, row += pixelSize )
+		{
+			uint8_t r = row [ 2 ], g = row [ 1 ], b = row [ 0 ];
+			if ( r == pr && g == pg && b == pb )
+			{
+				if ( ++run == 62 )
+				{
+					encoded [ length++ ] = QOI_OP_RUN | ( run - 1 );
+					run = 0;
+				}
+				continue;
+			}
+
+			if ( run > 0 )
+			{
+				encoded [ length++ ] = QOI_OP_RUN | ( run - 1 );
+				run = 0;
+			}
+
+			int hash = QOI_HASH ( r, g, b, 255 );
+			uint32_t packed = r | ( g << 8 ) | ( b << 16 ) | 0xff000000u;
+			if ( index [ hash ] == packed )
+				encoded [ length++ ] = QOI_OP_INDEX | hash;
+			else
+			{
+				index [ hash ] = packed;
+
+				int8_t vr = ( int8_t ) ( r - pr ), vg = ( int8_t ) ( g - pg ), vb = ( int8_t ) ( b - pb );
+				int vgr = vr - vg, vgb = vb - vg;
+				if ( vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1 )
+					encoded [ length++ ] = QOI_OP_DIFF | ( ( vr + 2 ) << 4 ) | ( ( vg + 2 ) << 2 ) | ( vb + 2 );
+				else if ( vgr >= -8 && vgr <= 7 && vg >= -32 && vg <= 31 && vgb >= -8 && vgb <= 7 )
+				{
+					encoded [ length++ ] = QOI_OP_LUMA | ( vg + 32 );
+					encoded [ length++ ] = ( uint8_t ) ( ( ( vgr + 8 ) << 4 ) | ( vgb + 8 ) );
+				}
+				else
+				{
+					encoded [ length++ ] = QOI_OP_RGB;
+					encoded [ length++ ] = r;
+					encoded [ length++ ] = g;
+					encoded [ length++ ] = b;
+				}
+			}
+
+			pr = r;
+			pg = g;
+			pb = b;
+		}
+	}
+
+	if ( run > 0 )
+		encoded [ length++ ] = QOI_OP_RUN | ( run - 1 );
+	memcpy ( encoded + length, QOI_PADDING, sizeof ( QOI_PADDING ) );
+	length += sizeof ( QOI_PADDING );
+
+	output->size = length;
+	return S_OK;
+}
+
+HRESULT EncodeImageQOI ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength, EncodedImage * output )
+{
+	if ( settings->imageProp.pixelFormat != IEPF_BGR )
+		return E_INVALIDARG;
+	if ( ( uint64_t ) settings->imageProp.stride * settings->imageProp.height > bufferLength
+		|| ( uint64_t ) settings->imageProp.width * settings->imageProp.height > QOI_MAX_PIXELS )
+		return E_INVALIDARG;
+
+	return EncodeQoi ( settings, ( const uint8_t* ) buffer, output );
+}
+
+HRESULT DecodeQoiImage ( const void * encoded, size_t encodedLength, uint32_t * width, uint32_t * height,
+	LPVOID buffer, uint64_t bufferLength )
+{
+	const uint8_t * data = ( const uint8_t* ) encoded;
+	if ( encodedLength < QOI_HEADER_SIZE + sizeof ( QOI_PADDING ) || memcmp ( data, "qoif", 4 ) != 0 )
+		return E_INVALIDARG;
+	*width = GetBigEndian ( &data [ 4 ] );
+	*height = GetBigEndian ( &data [ 8 ] );
+	uint8_t channels = data [ 12 ], colorspace = data [ 13 ];
+	if ( *width == 0 || *height == 0 || ( channels != 3 && channels != 4 ) || colorspace > 1
+		|| ( uint64_t ) *width * *height > QOI_MAX_PIXELS )
+		return E_INVALIDARG;
+
+	uint64_t pixelCount = ( uint64_t ) *width * *height;
+	if ( pixelCount * 3 > bufferLength )
+		return HRESULT_FROM_WIN32 ( ERROR_INSUFFICIENT_BUFFER );
+
+	uint8_t index [ 64 ][ 4 ] = { { 0, }, };
+	uint8_t r = 0, g = 0, b = 0, a = 255;
+	uint32_t run = 0;
+	size_t position = QOI_HEADER_SIZE, end = encodedLength - sizeof ( QOI_PADDING );
+
+	uint8_t * pixel = ( uint8_t* ) buffer;
+	for ( uint64_t i = 0; i < pixelCount; ++i, pixel += 3 )
+	{
+		if ( run > 0 )
+			--run;
+		else if ( position < end )
+		{
+			uint8_t op = data [ position++ ];
+			if ( op == QOI_OP_RGB || op == QOI_OP_RGBA )
+			{
+				if ( end - position < ( op == QOI_OP_RGB ? 3u : 4u ) )
+					return E_INVALIDARG;
+				r = data [ position++ ];
+				g = data [ position++ ];
+				b = data [ position++ ];
+				if ( op == QOI_OP_RGBA )
+					a = data [ position++ ];
+			}
+			else if ( ( op & QOI_MASK_2 ) == QOI_OP_INDEX )
+			{
+				r = index [ op ][ 0 ];
+				g = index [ op ][ 1 ];
+				b = index [ op ][ 2 ];
+				a = index [ op ][ 3 ];
+			}
+			else if ( ( op & QOI_MASK_2 ) == QOI_OP_DIFF )
+			{
+				r += ( ( op >> 4 ) & 3 ) - 2;
+				g += ( ( op >> 2 ) & 3 ) - 2;
+				b += ( op & 3 ) - 2;
+			}
+			else if ( ( op & QOI_MASK_2 ) == QOI_OP_LUMA )
+			{
+				if ( position == end )
+					return E_INVALIDARG;
+				uint8_t next = data [ position++ ];
+				int vg = ( op & 0x3f ) - 32;
+				r += vg - 8 + ( ( next >> 4 ) & 0x0f );
+				g += vg;
+				b += vg - 8 + ( next & 0x0f );
+			}
+			else
+				run = op & 0x3f;
+
+			uint8_t * entry = index [ QOI_HASH ( r, g, b, a ) ];
+			entry [ 0 ] = r;
+			entry [ 1 ] = g;
+			entry [ 2 ] = b;
+			entry [ 3 ] = a;
+		}
+		else
+			return E_INVALIDARG;
+
+		pixel [ 0 ] = b;
+		pixel [ 1 ] = g;
+		pixel [ 2 ] = r;
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,223 @@
+#include "ImageEncoder.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <atlbase.h>
+#include <Wincodec.h>
+
+#pragma comment ( lib, "windowscodecs.lib" )
+
+// Lets WIC encode into an EncodedImage. Lives on the stack for one encode; the encoder objects
+// holding it are released before it goes out of scope, so references are not counted.
+class EncodedImageStream : public IStream
+{
+public:
+	EncodedImageStream ( EncodedImage * image ) : _image ( image ), _position ( 0 ) { }
+
+public:
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface ( REFIID riid, void ** ppvObject )
+	{
+		if ( riid == __uuidof ( IUnknown ) || riid == __uuidof ( ISequentialStream ) || riid == __uuidof ( IStream ) )
+		{
+			*ppvObject = static_cast<IStream*> ( this );
+			return S_OK;
+		}
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+	virtual ULONG STDMETHODCALLTYPE AddRef () { return 1; }
+	virtual ULONG STDMETHODCALLTYPE Release () { return 1; }
+
+public:
+	virtual HRESULT STDMETHODCALLTYPE Read ( void * pv, ULONG cb, ULONG * pcbRead )
+	{
+		ULONG read = _position < _image->size ? ( ULONG ) ( ( std::min ) ( ( uint64_t ) cb, _image->size - _position ) ) : 0;
+		memcpy ( pv, _image->data + _position, read );
+		_position += read;
+		if ( pcbRead != nullptr )
+			*pcbRead = read;
+		return read == cb ? S_OK : S_FALSE;
+	}
+	virtual HRESULT STDMETHODCALLTYPE Write ( const void * pv, ULONG cb, ULONG * pcbWritten )
+	{
+		if ( FAILED ( ReserveEncodedImage ( _image, ( size_t ) _position + cb ) ) )
+			return STG_E_MEDIUMFULL;
+
+		// A seek past the end leaves a gap the stream reads back as zeros
+		if ( _position > _image->size )
+			memset ( _image->data + _image->size, 0, ( size_t ) _position - _image->size );
+		memcpy ( _image->data + _position, pv, cb );
+		_position += cb;
+		if ( _position > _image->size )
+			_image->size = ( size_t ) _position;
+		if ( pcbWritten != nullptr )
+			*pcbWritten = cb;
+		return S_OK;
+	}
+
+public:
+	virtual HRESULT STDMETHODCALLTYPE Seek ( LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER * plibNewPosition )
+	{
+		int64_t position;
+		switch ( dwOrigin )
+		{
+			case STREAM_SEEK_SET: position = dlibMove.QuadPart; break;
+			case STREAM_SEEK_CUR: position = ( int64_t ) _position + dlibMove.QuadPart; break;
+			case STREAM_SEEK_END: position = ( int64_t ) _image->size + dlibMove.QuadPart; break;
+			default: return STG_E_INVALIDFUNCTION;
+		}
+		if ( position < 0 )
+			return STG_E_INVALIDFUNCTION;
+
+		_position = ( uint64_t ) position;
+		if ( plibNewPosition != nullptr )
+			plibNewPosition->QuadPart = _position;
+		return S_OK;
+	}
+	virtual HRESULT STDMETHODCALLTYPE SetSize ( ULARGE_INTEGER libNewSize )
+	{
+		if ( FAILED ( ReserveEncodedImage ( _image, ( size_t ) libNewSize.QuadPart ) ) )
+			return STG_E_MEDIUMFULL;
+		if ( libNewSize.QuadPart > _image->size )
+			memset ( _image->data + _image->size, 0, ( size_t ) libNewSize.QuadPart - _image->size );
+		_image->size = ( size_t ) libNewSize.QuadPart;
+		return S_OK;
+	}
+	virtual HRESULT STDMETHODCALLTYPE Stat ( STATSTG * pstatstg, DWORD grfStatFlag )
+	{
+		memset ( pstatstg, 0, sizeof ( STATSTG ) );
+		pstatstg->type = STGTY_STREAM;
+		pstatstg->cbSize.QuadPart = _image->size;
+		return S_OK;
+	}
+	virtual HRESULT STDMETHODCALLTYPE Commit ( DWORD grfCommitFlags ) { return S_OK; }
+	virtual HRESULT STDMETHODCALLTYPE Revert () { return E_NOTIMPL; }
+	virtual HRESULT STDMETHODCALLTYPE CopyTo ( IStream * pstm, ULARGE_INTEGER cb, ULARGE_INTEGER * pcbRead, ULARGE_INTEGER * pcbWritten ) { return E_NOTIMPL; }
+	virtual HRESULT STDMETHODCALLTYPE LockRegion ( ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType ) { return STG_E_INVALIDFUNCTION; }
+	virtual HRESULT STDMETHODCALLTYPE UnlockRegion ( ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType ) { return STG_E_INVALIDFUNCTION; }
+	virtual HRESULT STDMETHODCALLTYPE Clone ( IStream ** ppstm ) { return E_NOTIMPL; }
+
+private:
+	EncodedImage * _image;
+	uint64_t _position;
+};
+
+// The WIC factory is free-threaded, so one instance serves every encode for the process lifetime
+static HRESULT GetImagingFactory ( IWICImagingFactory ** imagingFactory )
+{
+	static IWICImagingFactory * sharedFactory;
+
+	if ( sharedFactory == nullptr )
+	{
+		HRESULT hr;
+		IWICImagingFactory * createdFactory;
+		if ( FAILED ( hr = CoCreateInstance ( CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER,
+			IID_IWICImagingFactory, ( LPVOID* ) &createdFactory ) ) )
+			return hr;
+
+		if ( InterlockedCompareExchangePointer ( ( PVOID* ) &sharedFactory, createdFactory, nullptr ) != nullptr )
+			createdFactory->Release ();
+	}
+
+	*imagingFactory = sharedFactory;
+	return S_OK;
+}
+
+HRESULT EncodeImageWIC ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output )
+{
+	HRESULT hr;
+
+	if ( settings->imageProp.pixelFormat != IEPF_BGR )
+		return E_INVALIDARG;
+
+	IWICImagingFactory * imagingFactory;
+	if ( FAILED ( hr = GetImagingFactory ( &imagingFactory ) ) )
+		return hr;
+
+	GUID containerFormat;
+	switch ( settings->codecType )
+	{
+		case IEC_JPEG: containerFormat = GUID_ContainerFormatJpeg; break;
+		case IEC_PNG: containerFormat = GUID_ContainerFormatPng; break;
+	}
+
+	// Declared ahead of the encoder objects so it outlives them
+	EncodedImageStream outputStream ( output );
+
+	CComPtr<IWICBitmapEncoder> encoder;
+	if ( FAILED ( hr = imagingFactory->CreateEncoder (
+		containerFormat, nullptr, &encoder ) ) )
+		return hr;
+
+	if ( FAILED ( hr = encoder->Initialize ( &outputStream, WICBitmapEncoderNoCache ) ) )
+		return hr;
+
+	CComPtr<IWICBitmapFrameEncode> frameEncode;
+	CComPtr<IPropertyBag2> encoderOptions;
+	if ( FAILED ( encoder->CreateNewFrame ( &frameEncode, &encoderOptions ) ) )
+		return hr;
+
+	PROPBAG2 propBag2 = { 0 };
+	VARIANT variant;
+	if ( containerFormat == GUID_ContainerFormatPng )
+	{
+		propBag2.pstrName = ( LPOLESTR ) L"InterlaceOption";
+		VariantInit ( &variant );
+		variant.vt = VT_BOOL;
+		variant.boolVal = settings->settings.png.interlace ? VARIANT_TRUE : VARIANT_FALSE;
+		encoderOptions->Write ( 0, &propBag2, &variant );
+
+		propBag2.pstrName = ( LPOLESTR ) L"FilterOption";
+		VariantInit ( &variant );
+		variant.vt = VT_UI1;
+		variant.bVal = WICPngFilterAdaptive;
+		encoderOptions->Write ( 1, &propBag2, &variant );
+	}
+	else if ( containerFormat == GUID_ContainerFormatJpeg )
+	{
+		propBag2.pstrName = ( LPOLESTR ) L"ImageQuality";
+		VariantInit ( &variant );
+		variant.vt = VT_R4;
+		variant.fltVal = settings->settings.jpeg.quality;
+		encoderOptions->Write ( 0, &propBag2, &variant );
+
+		propBag2.pstrName = ( LPOLESTR ) L"JpegYCrCbSubsampling";
+		VariantInit ( &variant );
+		variant.vt = VT_UI1;
+		variant.bVal = settings->settings.jpeg.chromaSubsample
+			? WICJpegYCrCbSubsampling420
+			: WICJpegYCrCbSubsampling444;
+		encoderOptions->Write ( 1, &propBag2, &variant );
+	}
+
+	if ( FAILED ( hr = frameEncode->Initialize ( encoderOptions ) ) )
+		return hr;
+
+	WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat24bppBGR;
+	if ( settings->imageProp.width * 4 == settings->imageProp.stride )
+		pixelFormat = GUID_WICPixelFormat32bppBGR;
+	frameEncode->SetPixelFormat ( &pixelFormat );
+	frameEncode->SetSize ( settings->imageProp.width, settings->imageProp.height );
+
+	// Rows go in bands so a cancelled job gives the worker back within a fraction of an image
+	const uint32_t bandHeight = 64;
+	uint32_t height = settings->imageProp.height, stride = settings->imageProp.stride;
+	for ( uint32_t row = 0; row < height; row += bandHeight )
+	{
+		if ( settings->cancel != nullptr && settings->cancel->IsCancelled () )
+			return E_ABORT;
+
+		uint32_t lines = height - row < bandHeight ? height - row : bandHeight;
+		if ( ( uint64_t ) ( row + lines ) * stride > bufferLength )
+			return E_INVALIDARG;
+		if ( FAILED ( hr = frameEncode->WritePixels ( lines, stride, lines * stride, ( BYTE* ) buffer + ( size_t ) row * stride ) ) )
+			return hr;
+	}
+
+	frameEncode->Commit ();
+	encoder->Commit ();
+
+	return S_OK;
+}
@@ -1,88 +1,196 @@
-#include "ImageEncoder.h"
-
-#include <atlbase.h>
-#include <Wincodec.h>
-
-#pragma comment ( lib, "windowscodecs.lib" )
+#include "ImageEncoderContext.h"
+
+#include <malloc.h>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+
+HRESULT EncodeImageFFmpeg ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context );
+HRESULT EncodeImageQOI ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength, EncodedImage * output );
+HRESULT EncodeImageJXL ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context );
+HRESULT EncodeImageWIC ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength, EncodedImage * output );
+
+HRESULT ReserveEncodedImage ( EncodedImage * image, size_t capacity )
+{
+	if ( capacity <= image->capacity )
+		return S_OK;
+
+	// Doubling keeps a run of growing images from reallocating on every one
+	if ( capacity < image->capacity * 2 )
+		capacity = image->capacity * 2;
+	capacity = ( capacity + ENCODED_IMAGE_ALIGNMENT - 1 ) & ~( size_t ) ( ENCODED_IMAGE_ALIGNMENT - 1 );
+	uint8_t * data = ( uint8_t* ) _aligned_realloc ( image->data, capacity, ENCODED_IMAGE_ALIGNMENT );
+	if ( data == nullptr )
+		return E_OUTOFMEMORY;
+
+	image->data = data;
+	image->capacity = capacity;
+	return S_OK;
+}
 
-HRESULT SaveImage ( LPCWSTR filename, const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength )
+HRESULT AppendEncodedImage ( EncodedImage * image, const void * data, size_t length )
 {
 	HRESULT hr;
-
-	CComPtr<IWICImagingFactory> imagingFactory;
-	if ( FAILED ( hr = CoCreateInstance ( CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER,
-		IID_IWICImagingFactory, ( LPVOID* ) &imagingFactory ) ) )
+	if ( FAILED ( hr = ReserveEncodedImage ( image, image->size + length ) ) )
 		return hr;
 
-	GUID containerFormat;
+	memcpy ( image->data + image->size, data, length );
+	image->size += length;
+	return S_OK;
+}
+
+void FreeEncodedImage ( EncodedImage * image )
+{
+	_aligned_free ( image->data );
+	image->data = nullptr;
+	image->size = image->capacity = 0;
+}
+
+// zlib through FFmpeg has not shown itself faster than WIC's PNG encoder at the default level, so
+// PNG only goes there for the levels WIC cannot do or when asked for by name
+static bool UsesFFmpeg ( const ImageEncoderSettings * settings )
+{
 	switch ( settings->codecType )
 	{
-		case IEC_JPEG: containerFormat = GUID_ContainerFormatJpeg; break;
-		case IEC_PNG: containerFormat = GUID_ContainerFormatPng; break;
+		case IEC_JPEG: return settings->backend != IEB_WIC;
+		case IEC_PNG: return settings->backend == IEB_FFMPEG
+			|| ( settings->backend == IEB_AUTO && settings->settings.png.compressionLevel >= 0 );
+		default: return false;
 	}
+}
 
-	CComPtr<IWICBitmapEncoder> encoder;
-	if ( FAILED ( hr = imagingFactory->CreateEncoder (
-		containerFormat, nullptr, &encoder ) ) )
-		return hr;
+bool ImageEncoderTakesPlanar ( const ImageEncoderSettings * settings )
+{
+	return UsesFFmpeg ( settings );
+}
 
-	CComPtr<IStream> outputStream;
-	if ( FAILED ( hr = SHCreateStreamOnFile ( filename, STGM_WRITE | STGM_CREATE, &outputStream ) ) )
-		return hr;
+bool ImageEncoderSplitsImages ( const ImageEncoderSettings * settings )
+{
+	return settings->codecType == IEC_JXL || ( settings->codecType == IEC_JPEG && UsesFFmpeg ( settings ) );
+}
 
-	if ( FAILED ( hr = encoder->Initialize ( outputStream, WICBitmapEncoderNoCache ) ) )
-		return hr;
+// One parallel loop. The calling thread always takes part; helpers lent by the caller's pool join
+// in when they get to run, and any that start after the range is used up simply leave. Whoever
+// drops the last reference puts it back, so the caller never waits for a helper to start.
+struct ParallelRun
+{
+	std::atomic<uint32_t> references;
+	std::atomic<uint32_t> next, finished, nextThread;
+	uint32_t end, count;
+	ParallelBody body;
+	void * argument;
+	const CancellationToken * cancel;
+	std::atomic<bool> cancelled;
+
+	std::mutex mutex;
+	std::condition_variable done;
+};
+
+// Finished runs wait here for the next loop instead of going back to the heap
+static std::mutex g_freeRunsMutex;
+static std::vector<std::unique_ptr<ParallelRun>> g_freeRuns;
+
+static ParallelRun * AcquireRun ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( g_freeRunsMutex );
+		if ( !g_freeRuns.empty () )
+		{
+			ParallelRun * run = g_freeRuns.back ().release ();
+			g_freeRuns.pop_back ();
+			return run;
+		}
+	}
+	return new ParallelRun;
+}
 
-	CComPtr<IWICBitmapFrameEncode> frameEncode;
-	CComPtr<IPropertyBag2> encoderOptions;
-	if ( FAILED ( encoder->CreateNewFrame ( &frameEncode, &encoderOptions ) ) )
-		return hr;
+static void ReleaseRun ( ParallelRun * run )
+{
+	if ( --run->references != 0 )
+		return;
 
-	PROPBAG2 propBag2 = { 0 };
-	VARIANT variant;
-	if ( containerFormat == GUID_ContainerFormatPng )
+	std::unique_lock<std::mutex> lock ( g_freeRunsMutex );
+	g_freeRuns.emplace_back ( run );
+}
+
+static void WorkOnRun ( ParallelRun * run )
+{
+	uint32_t thread = run->nextThread++;
+	for ( uint32_t index; ( index = run->next++ ) < run->end; )
 	{
-		propBag2.pstrName = ( LPOLESTR ) L"InterlaceOption";
-		VariantInit ( &variant );
-		variant.vt = VT_BOOL;
-		variant.boolVal = settings->settings.png.interlace ? VARIANT_TRUE : VARIANT_FALSE;
-		encoderOptions->Write ( 0, &propBag2, &variant );
-
-		propBag2.pstrName = ( LPOLESTR ) L"FilterOption";
-		VariantInit ( &variant );
-		variant.vt = VT_UI1;
-		variant.bVal = WICPngFilterAdaptive;
-		encoderOptions->Write ( 1, &propBag2, &variant );
+		// Indices left after a cancel count as finished so the caller still wakes up
+		if ( run->cancelled || ( run->cancel != nullptr && run->cancel->IsCancelled () ) )
+			run->cancelled = true;
+		else
+			run->body ( run->argument, index, thread );
+
+		if ( ++run->finished == run->count )
+		{
+			std::unique_lock<std::mutex> lock ( run->mutex );
+			run->done.notify_all ();
+		}
 	}
-	else if ( containerFormat == GUID_ContainerFormatJpeg )
+}
+
+static void RunHelper ( void * argument, bool run )
+{
+	if ( run )
+		WorkOnRun ( ( ParallelRun* ) argument );
+	ReleaseRun ( ( ParallelRun* ) argument );
+}
+
+HRESULT RunParallel ( const ImageEncoderSettings * settings, uint32_t threads, uint32_t begin, uint32_t end,
+	ParallelBody body, void * argument )
+{
+	if ( begin >= end )
+		return S_OK;
+
+	ParallelRun * run = AcquireRun ();
+	run->references = 1;
+	run->next = begin;
+	run->finished = 0;
+	run->nextThread = 0;
+	run->end = end;
+	run->count = end - begin;
+	run->body = body;
+	run->argument = argument;
+	run->cancel = settings->cancel;
+	run->cancelled = false;
+
+	// A refused helper is still called, with run false, and gives its reference back itself
+	for ( uint32_t i = 1; i < threads && i < run->count && settings->post != nullptr; ++i )
 	{
-		propBag2.pstrName = ( LPOLESTR ) L"ImageQuality";
-		VariantInit ( &variant );
-		variant.vt = VT_R4;
-		variant.fltVal = settings->settings.jpeg.quality;
-		encoderOptions->Write ( 0, &propBag2, &variant );
-
-		propBag2.pstrName = ( LPOLESTR ) L"JpegYCrCbSubsampling";
-		VariantInit ( &variant );
-		variant.vt = VT_UI1;
-		variant.bVal = settings->settings.jpeg.chromaSubsample
-			? WICJpegYCrCbSubsampling444
-			: WICJpegYCrCbSubsampling420;
-		encoderOptions->Write ( 1, &propBag2, &variant );
+		++run->references;
+		if ( !settings->post ( settings->executor, RunHelper, run ) )
+			break;
 	}
 
-	if ( FAILED ( hr = frameEncode->Initialize ( encoderOptions ) ) )
-		return hr;
-
-	WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat24bppBGR;
-	if ( settings->imageProp.width * 4 == settings->imageProp.stride )
-		pixelFormat = GUID_WICPixelFormat32bppBGR;
-	frameEncode->SetPixelFormat ( &pixelFormat );
-	frameEncode->SetSize ( settings->imageProp.width, settings->imageProp.height );
-	frameEncode->WritePixels ( settings->imageProp.height, settings->imageProp.stride, bufferLength, ( BYTE* ) buffer );
+	WorkOnRun ( run );
+	{
+		std::unique_lock<std::mutex> lock ( run->mutex );
+		run->done.wait ( lock, [ run ] { return run->finished >= run->count; } );
+	}
 
-	frameEncode->Commit ();
-	encoder->Commit ();
+	HRESULT hr = run->cancelled ? E_ABORT : S_OK;
+	ReleaseRun ( run );
+	return hr;
+}
 
-	return S_OK;
+HRESULT EncodeImage ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context )
+{
+	output->size = 0;
+
+	if ( settings->codecType == IEC_QOI )
+		return EncodeImageQOI ( settings, buffer, bufferLength, output );
+	if ( settings->codecType == IEC_JXL )
+		return EncodeImageJXL ( settings, buffer, bufferLength, output, context );
+	if ( UsesFFmpeg ( settings ) )
+		return EncodeImageFFmpeg ( settings, buffer, bufferLength, output, context );
+	return EncodeImageWIC ( settings, buffer, bufferLength, output );
 }
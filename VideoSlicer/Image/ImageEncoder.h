@@ -5,19 +5,52 @@
 
 #include <cstdint>
 
+#include "../CancellationToken.h"
+
 enum ImageEncoderCodec
 {
 	IEC_UNKNOWN,
 	IEC_PNG,
-	IEC_JPEG
+	IEC_JPEG,
+	// Lossless and far cheaper than PNG, for consumers that only need the pixels back; packed BGR only
+	IEC_QOI,
+	// Lossless JPEG XL at libjxl's fastest effort; packed BGR only. Built with VIDEOSLICER_JXL,
+	// E_NOTIMPL otherwise.
+	IEC_JXL,
+};
+
+enum ImageEncoderBackend
+{
+	// FFmpeg for JPEG. PNG goes through WIC unless it asks for a compression level, which only
+	// FFmpeg offers.
+	IEB_AUTO,
+	// Windows Imaging Component for PNG and JPEG
+	IEB_WIC,
+	// FFmpeg for PNG and JPEG whatever the settings
+	IEB_FFMPEG,
+};
+
+enum ImageEncoderPixelFormat
+{
+	// Packed BGR, 24 or 32 bits per pixel as the stride says
+	IEPF_BGR,
+	// 8-bit Y, Cb and Cr planes back to back; the FFmpeg encoders only
+	IEPF_YUV420P,
+	IEPF_YUV422P,
+	IEPF_YUV444P,
 };
 
 struct ImageEncoderSettings
 {
 	ImageEncoderCodec codecType;
+	ImageEncoderBackend backend;
 	struct
 	{
 		uint32_t width, height, stride;
+		ImageEncoderPixelFormat pixelFormat;
+		// Planar formats only: bytes per chroma row and whether samples span 0-255
+		uint32_t chromaStride;
+		bool fullRange;
 	} imageProp;
 	union
 	{
@@ -25,6 +58,9 @@ struct ImageEncoderSettings
 		{
 			bool interlace;
 			bool filtering;
+			// zlib effort from 0 (stored) through 1 (fastest) to 9 (smallest); -1 keeps the
+			// encoder default. WIC has no such control and ignores it.
+			int compressionLevel;
 		} png;
 		struct
 		{
@@ -32,9 +68,56 @@ struct ImageEncoderSettings
 			bool chromaSubsample;
 		} jpeg;
 	} settings;
+	// Threads one image is split across: JPEG strips between restart markers and the colour
+	// conversion ahead of them, and libjxl's parallel loops. 0 or 1 keeps the whole encode on the
+	// calling thread.
+	uint32_t threads;
+	// Lends the split the threads of the caller's pool instead of starting threads of its own. post returns
+	// false when no thread can take the task now. Every task handed to post is called exactly once,
+	// with run false if post refused it or it was dropped before starting. Null runs those loops on
+	// the calling thread.
+	bool ( *post ) ( void * executor, void ( *task ) ( void * argument, bool run ), void * argument );
+	void * executor;
+	// Checked between row bands; a cancelled encode returns E_ABORT. May be null.
+	const CancellationToken * cancel;
+};
+
+// Encoded images start on a page and their capacity is a whole number of pages, so they can be
+// written unbuffered as they are
+#define ENCODED_IMAGE_ALIGNMENT 4096
+
+// Bytes of one encoded image. The allocation grows to the largest image seen and is kept from
+// one encode to the next; start from { 0, } and release with FreeEncodedImage.
+struct EncodedImage
+{
+	uint8_t * data;
+	size_t size, capacity;
 };
 
-HRESULT SaveImage ( LPCWSTR filename, const ImageEncoderSettings * settings,
+HRESULT ReserveEncodedImage ( EncodedImage * image, size_t capacity );
+HRESULT AppendEncodedImage ( EncodedImage * image, const void * data, size_t length );
+void FreeEncodedImage ( EncodedImage * image );
+
+// Encoder state for one thread, reused by every encode that passes it
+struct ImageEncoderContext;
+HRESULT CreateImageEncoderContext ( ImageEncoderContext ** context );
+void DestroyImageEncoderContext ( ImageEncoderContext * context );
+
+// Whether the backend these settings pick takes the planar pixel formats; the others need packed BGR
+bool ImageEncoderTakesPlanar ( const ImageEncoderSettings * settings );
+
+// Whether the backend these settings pick splits one image across settings.threads; the others
+// keep each image on the calling thread
+bool ImageEncoderSplitsImages ( const ImageEncoderSettings * settings );
+
+// Replaces what output held with the encoded image. Encoders never touch the disk; writing the
+// image out is up to the caller.
+HRESULT EncodeImage ( const ImageEncoderSettings * settings, LPVOID buffer, uint64_t bufferLength,
+	EncodedImage * output, ImageEncoderContext * context = nullptr );
+
+// Decodes an encoded QOI image back into BGR24 rows of width * 3 bytes, to check what the encoder made.
+// A buffer too small for the image fails with ERROR_INSUFFICIENT_BUFFER once the size is filled in.
+HRESULT DecodeQoiImage ( const void * data, size_t length, uint32_t * width, uint32_t * height,
 	LPVOID buffer, uint64_t bufferLength );
 
 #endif
\ No newline at end of file
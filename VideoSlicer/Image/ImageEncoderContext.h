@@ -0,0 +1,50 @@
+#ifndef __IMAGEENCODERCONTEXT_H__
+#define __IMAGEENCODERCONTEXT_H__
+
+#include "ImageEncoder.h"
+
+#include <vector>
+
+// Shared by the encoder backends and the benchmark that checks them; everyone else holds the
+// context through ImageEncoder.h
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+struct JxlEncoderStruct;
+
+// Everything an encode needs, kept from one image to the next on the same thread
+struct ImageEncoderContext
+{
+	AVCodecContext * codecContext;
+	// One scaler per band of rows converted in parallel
+	std::vector<SwsContext*> swsContexts;
+	// Outcome of each band, sized once for the largest split
+	std::vector<HRESULT> bandResults;
+	// Rows of a band and its overlap, for conversions that resample chroma vertically
+	std::vector<AVFrame*> bandFrames;
+	AVFrame * frame;
+	// Wraps caller planes the encoder can take as they are
+	AVFrame * source;
+	AVPacket * packet;
+	// The encoder rejects timestamps that do not increase
+	int64_t pts;
+	// PNG row filter and slice threads the codec context was opened with
+	LPCSTR prediction;
+	uint32_t threads;
+
+	// libjxl encoder, reset between images, and the RGB rows it reads
+	JxlEncoderStruct * jxlEncoder;
+	std::vector<uint8_t> jxlPixels;
+};
+
+void DestroyJxlEncoder ( ImageEncoderContext * context );
+
+// Calls body once for every index in [ begin, end ), on the calling thread and on up to threads - 1
+// helpers lent through settings->post; thread numbers the participant, below threads. Returns once
+// every index is done, or E_ABORT when a cancel skipped the ones left.
+typedef void ( *ParallelBody ) ( void * argument, uint32_t index, uint32_t thread );
+HRESULT RunParallel ( const ImageEncoderSettings * settings, uint32_t threads, uint32_t begin, uint32_t end,
+	ParallelBody body, void * argument );
+
+#endif
@@ -0,0 +1,398 @@
+#include "ImageArchive.h"
+
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+
+// Headers gather here with the smaller images; anything at least this large goes straight to the file
+#define ARCHIVE_STAGING_SIZE ( 4 * 1024 * 1024 )
+
+#define TAR_BLOCK_SIZE 512
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_ZIP64_EXTRA_SIZE 12
+#define ZIP_ZIP64_END_SIZE 56
+#define ZIP_ZIP64_LOCATOR_SIZE 20
+#define ZIP_END_SIZE 22
+// Names are UTF-8
+#define ZIP_FLAG_UTF8 0x0800
+#define ZIP_VERSION_DEFAULT 20
+#define ZIP_VERSION_ZIP64 45
+
+static void Put16 ( uint8_t * data, uint16_t value )
+{
+	data [ 0 ] = ( uint8_t ) value;
+	data [ 1 ] = ( uint8_t ) ( value >> 8 );
+}
+
+static void Put32 ( uint8_t * data, uint32_t value )
+{
+	Put16 ( data, ( uint16_t ) value );
+	Put16 ( data + 2, ( uint16_t ) ( value >> 16 ) );
+}
+
+static void Put64 ( uint8_t * data, uint64_t value )
+{
+	Put32 ( data, ( uint32_t ) value );
+	Put32 ( data + 4, ( uint32_t ) ( value >> 32 ) );
+}
+
+// tar numbers are zero-padded octal filling all but the field's terminating NUL
+static void PutOctal ( char * field, size_t fieldSize, uint64_t value )
+{
+	for ( size_t i = fieldSize - 1; i-- > 0; value >>= 3 )
+		field [ i ] = ( char ) ( '0' + ( value & 7 ) );
+	field [ fieldSize - 1 ] = '\0';
+}
+
+ImageArchive::ImageArchive ()
+	: _file ( INVALID_HANDLE_VALUE ), _format ( IAF_NONE ), _offset ( 0 ), _entryCount ( 0 ), _staged ( 0 ), _result ( S_OK )
+	, _dosTime ( 0 ), _dosDate ( 0 ), _unixTime ( 0 )
+{
+
+}
+
+ImageArchive::~ImageArchive ()
+{
+	if ( _file != INVALID_HANDLE_VALUE )
+		CloseHandle ( _file );
+}
+
+HRESULT ImageArchive::Open ( LPCWSTR path, ImageArchiveFormat format )
+{
+	if ( format == IAF_NONE || _file != INVALID_HANDLE_VALUE )
+		return E_INVALIDARG;
+
+	_file = CreateFile ( path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if ( _file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	_format = format;
+	_offset = 0;
+	_entryCount = 0;
+	_staging.resize ( ARCHIVE_STAGING_SIZE );
+	_staged = 0;
+	_result = S_OK;
+	_entries.clear ();
+	_names.clear ();
+	_frames.clear ();
+
+	// Every entry carries the time the archive was started
+	FILETIME now, localNow;
+	GetSystemTimeAsFileTime ( &now );
+	_unixTime = ( ( ( uint64_t ) now.dwHighDateTime << 32 | now.dwLowDateTime ) - 116444736000000000ull ) / 10000000;
+	FileTimeToLocalFileTime ( &now, &localNow );
+	FileTimeToDosDateTime ( &localNow, &_dosDate, &_dosTime );
+
+	if ( format == IAF_PACK )
+	{
+		FramePackHeader header = { 0, };
+		memcpy ( header.magic, FRAME_PACK_MAGIC, 8 );
+		header.version = FRAME_PACK_VERSION;
+		return Write ( &header, sizeof ( header ) );
+	}
+
+	return S_OK;
+}
+
+HRESULT ImageArchive::Append ( const ImageArchiveEntry & entry, const EncodedImage * image )
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return E_UNEXPECTED;
+	// Entries carry 32-bit sizes; only offsets need zip64
+	if ( image->size > 0xfffffffeull )
+		return E_INVALIDARG;
+
+	HRESULT hr;
+	if ( _format == IAF_PACK )
+	{
+		FramePackEntry frame;
+		frame.timeStamp = entry.timeStamp;
+		frame.offset = _offset;
+		frame.size = ( uint32_t ) image->size;
+		frame.crc = entry.crc;
+		frame.stream = entry.stream;
+		frame.codec = ( uint32_t ) entry.codec;
+		frame.width = entry.width;
+		frame.height = entry.height;
+
+		if ( FAILED ( hr = Write ( image->data, image->size ) ) )
+			return hr;
+
+		_frames.push_back ( frame );
+		++_entryCount;
+		return S_OK;
+	}
+
+	char utf8 [ MAX_PATH * 3 ];
+	int nameLength = WideCharToMultiByte ( CP_UTF8, 0, entry.name, -1, utf8, sizeof ( utf8 ), nullptr, nullptr ) - 1;
+	if ( nameLength <= 0 )
+		return E_INVALIDARG;
+
+	if ( _format == IAF_TAR )
+	{
+		if ( nameLength >= 100 )
+			return E_INVALIDARG;
+
+		char header [ TAR_BLOCK_SIZE ] = { 0, };
+		memcpy ( header, utf8, nameLength );
+		PutOctal ( header + 100, 8, 0644 );
+		PutOctal ( header + 108, 8, 0 );
+		PutOctal ( header + 116, 8, 0 );
+		PutOctal ( header + 124, 12, image->size );
+		PutOctal ( header + 136, 12, _unixTime );
+		header [ 156 ] = '0';
+		memcpy ( header + 257, "ustar", 6 );
+		memcpy ( header + 263, "00", 2 );
+
+		// The checksum adds up the header with its own field taken as spaces
+		memset ( header + 148, ' ', 8 );
+		uint32_t checksum = 0;
+		for ( int i = 0; i < TAR_BLOCK_SIZE; ++i )
+			checksum += ( uint8_t ) header [ i ];
+		PutOctal ( header + 148, 7, checksum );
+
+		static const uint8_t padding [ TAR_BLOCK_SIZE ] = { 0, };
+		size_t paddingLength = ( TAR_BLOCK_SIZE - image->size % TAR_BLOCK_SIZE ) % TAR_BLOCK_SIZE;
+		if ( FAILED ( hr = Write ( header, sizeof ( header ) ) )
+			|| FAILED ( hr = Write ( image->data, image->size ) )
+			|| FAILED ( hr = Write ( padding, paddingLength ) ) )
+			return hr;
+	}
+	else
+	{
+		Entry record;
+		record.offset = _offset;
+		record.size = ( uint32_t ) image->size;
+		record.crc = entry.crc;
+		record.nameOffset = ( uint32_t ) _names.size ();
+		record.nameLength = ( uint16_t ) nameLength;
+
+		uint8_t header [ ZIP_LOCAL_HEADER_SIZE ];
+		Put32 ( header, 0x04034b50 );
+		Put16 ( header + 4, ZIP_VERSION_DEFAULT );
+		Put16 ( header + 6, ZIP_FLAG_UTF8 );
+		Put16 ( header + 8, 0 );
+		Put16 ( header + 10, _dosTime );
+		Put16 ( header + 12, _dosDate );
+		Put32 ( header + 14, record.crc );
+		Put32 ( header + 18, record.size );
+		Put32 ( header + 22, record.size );
+		Put16 ( header + 26, record.nameLength );
+		Put16 ( header + 28, 0 );
+
+		if ( FAILED ( hr = Write ( header, sizeof ( header ) ) )
+			|| FAILED ( hr = Write ( utf8, nameLength ) )
+			|| FAILED ( hr = Write ( image->data, image->size ) ) )
+			return hr;
+
+		_entries.push_back ( record );
+		_names.insert ( _names.end (), utf8, utf8 + nameLength );
+	}
+
+	++_entryCount;
+	return S_OK;
+}
+
+HRESULT ImageArchive::Close ()
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return S_OK;
+
+	HRESULT hr;
+	if ( _format == IAF_TAR )
+	{
+		static const uint8_t endBlocks [ TAR_BLOCK_SIZE * 2 ] = { 0, };
+		hr = Write ( endBlocks, sizeof ( endBlocks ) );
+	}
+	else if ( _format == IAF_ZIP )
+		hr = WriteCentralDirectory ();
+	else
+		hr = WritePackIndex ();
+
+	if ( SUCCEEDED ( hr ) )
+		hr = FlushStaging ();
+
+	CloseHandle ( _file );
+	_file = INVALID_HANDLE_VALUE;
+	return hr;
+}
+
+HRESULT ImageArchive::WriteCentralDirectory ()
+{
+	HRESULT hr;
+	uint64_t directoryOffset = _offset;
+	bool zip64 = _entries.size () >= 0xffff || directoryOffset >= 0xffffffffull;
+
+	for ( const Entry & entry : _entries )
+	{
+		bool farOffset = entry.offset >= 0xffffffffull;
+
+		uint8_t header [ ZIP_CENTRAL_HEADER_SIZE + ZIP_ZIP64_EXTRA_SIZE ];
+		Put32 ( header, 0x02014b50 );
+		Put16 ( header + 4, ZIP_VERSION_ZIP64 );
+		Put16 ( header + 6, farOffset ? ZIP_VERSION_ZIP64 : ZIP_VERSION_DEFAULT );
+		Put16 ( header + 8, ZIP_FLAG_UTF8 );
+		Put16 ( header + 10, 0 );
+		Put16 ( header + 12, _dosTime );
+		Put16 ( header + 14, _dosDate );
+		Put32 ( header + 16, entry.crc );
+		Put32 ( header + 20, entry.size );
+		Put32 ( header + 24, entry.size );
+		Put16 ( header + 28, entry.nameLength );
+		Put16 ( header + 30, farOffset ? ZIP_ZIP64_EXTRA_SIZE : 0 );
+		Put16 ( header + 32, 0 );
+		Put16 ( header + 34, 0 );
+		Put16 ( header + 36, 0 );
+		Put32 ( header + 38, 0 );
+		Put32 ( header + 42, farOffset ? 0xffffffff : ( uint32_t ) entry.offset );
+
+		// The extra field follows the name
+		Put16 ( header + ZIP_CENTRAL_HEADER_SIZE, 0x0001 );
+		Put16 ( header + ZIP_CENTRAL_HEADER_SIZE + 2, 8 );
+		Put64 ( header + ZIP_CENTRAL_HEADER_SIZE + 4, entry.offset );
+
+		if ( FAILED ( hr = Write ( header, ZIP_CENTRAL_HEADER_SIZE ) )
+			|| FAILED ( hr = Write ( &_names [ entry.nameOffset ], entry.nameLength ) )
+			|| ( farOffset && FAILED ( hr = Write ( header + ZIP_CENTRAL_HEADER_SIZE, ZIP_ZIP64_EXTRA_SIZE ) ) ) )
+			return hr;
+	}
+
+	uint64_t directorySize = _offset - directoryOffset;
+	zip64 = zip64 || directorySize >= 0xffffffffull;
+	if ( zip64 )
+	{
+		uint64_t endOffset = _offset;
+
+		uint8_t end [ ZIP_ZIP64_END_SIZE + ZIP_ZIP64_LOCATOR_SIZE ];
+		Put32 ( end, 0x06064b50 );
+		Put64 ( end + 4, ZIP_ZIP64_END_SIZE - 12 );
+		Put16 ( end + 12, ZIP_VERSION_ZIP64 );
+		Put16 ( end + 14, ZIP_VERSION_ZIP64 );
+		Put32 ( end + 16, 0 );
+		Put32 ( end + 20, 0 );
+		Put64 ( end + 24, _entries.size () );
+		Put64 ( end + 32, _entries.size () );
+		Put64 ( end + 40, directorySize );
+		Put64 ( end + 48, directoryOffset );
+
+		uint8_t * locator = end + ZIP_ZIP64_END_SIZE;
+		Put32 ( locator, 0x07064b50 );
+		Put32 ( locator + 4, 0 );
+		Put64 ( locator + 8, endOffset );
+		Put32 ( locator + 16, 1 );
+
+		if ( FAILED ( hr = Write ( end, sizeof ( end ) ) ) )
+			return hr;
+	}
+
+	uint16_t entryCount = zip64 ? 0xffff : ( uint16_t ) _entries.size ();
+	uint8_t end [ ZIP_END_SIZE ];
+	Put32 ( end, 0x06054b50 );
+	Put16 ( end + 4, 0 );
+	Put16 ( end + 6, 0 );
+	Put16 ( end + 8, entryCount );
+	Put16 ( end + 10, entryCount );
+	Put32 ( end + 12, zip64 ? 0xffffffff : ( uint32_t ) directorySize );
+	Put32 ( end + 16, zip64 ? 0xffffffff : ( uint32_t ) directoryOffset );
+	Put16 ( end + 20, 0 );
+	return Write ( end, sizeof ( end ) );
+}
+
+HRESULT ImageArchive::WritePackIndex ()
+{
+	// Streams were appended interleaved, and a stream's frames may come out of presentation order
+	std::stable_sort ( _frames.begin (), _frames.end (), [] ( const FramePackEntry & a, const FramePackEntry & b )
+	{
+		return a.stream < b.stream || ( a.stream == b.stream && a.timeStamp < b.timeStamp );
+	} );
+
+	HRESULT hr;
+	static const uint8_t padding [ 8 ] = { 0, };
+	if ( FAILED ( hr = Write ( padding, ( 8 - _offset % 8 ) % 8 ) ) )
+		return hr;
+
+	FramePackFooter footer;
+	footer.indexOffset = _offset;
+	footer.frameCount = _frames.size ();
+	footer.entrySize = sizeof ( FramePackEntry );
+	footer.version = FRAME_PACK_VERSION;
+	memcpy ( footer.magic, FRAME_PACK_MAGIC, 8 );
+
+	if ( !_frames.empty () && FAILED ( hr = Write ( _frames.data (), _frames.size () * sizeof ( FramePackEntry ) ) ) )
+		return hr;
+	return Write ( &footer, sizeof ( footer ) );
+}
+
+HRESULT ImageArchive::Write ( const void * data, size_t length )
+{
+	if ( FAILED ( _result ) || ( _staged + length > _staging.size () && FAILED ( FlushStaging () ) ) )
+		return _result;
+
+	if ( length >= _staging.size () )
+	{
+		DWORD written;
+		if ( !WriteFile ( _file, data, ( DWORD ) length, &written, nullptr ) )
+			_result = HRESULT_FROM_WIN32 ( GetLastError () );
+		else if ( written != length )
+			_result = HRESULT_FROM_WIN32 ( ERROR_DISK_FULL );
+		if ( FAILED ( _result ) )
+			return _result;
+	}
+	else
+	{
+		memcpy ( &_staging [ _staged ], data, length );
+		_staged += length;
+	}
+
+	_offset += length;
+	return S_OK;
+}
+
+HRESULT ImageArchive::FlushStaging ()
+{
+	if ( FAILED ( _result ) || _staged == 0 )
+		return _result;
+
+	DWORD written;
+	if ( !WriteFile ( _file, _staging.data (), ( DWORD ) _staged, &written, nullptr ) )
+		_result = HRESULT_FROM_WIN32 ( GetLastError () );
+	else if ( written != _staged )
+		_result = HRESULT_FROM_WIN32 ( ERROR_DISK_FULL );
+	_staged = 0;
+	return _result;
+}
+
+uint32_t ImageArchive::Checksum ( const void * data, size_t length )
+{
+	// Reflected 0xEDB88320 tables, eight bytes per step
+	static uint32_t table [ 8 ][ 256 ];
+	static std::once_flag once;
+	std::call_once ( once, [] {
+		for ( uint32_t i = 0; i < 256; ++i )
+		{
+			uint32_t value = i;
+			for ( int bit = 0; bit < 8; ++bit )
+				value = ( value >> 1 ) ^ ( ( value & 1 ) ? 0xedb88320 : 0 );
+			table [ 0 ][ i ] = value;
+		}
+		for ( uint32_t i = 0; i < 256; ++i )
+			for ( int slice = 1; slice < 8; ++slice )
+				table [ slice ][ i ] = ( table [ slice - 1 ][ i ] >> 8 ) ^ table [ 0 ][ table [ slice - 1 ][ i ] & 0xff ];
+	} );
+
+	const uint8_t * bytes = ( const uint8_t* ) data;
+	uint32_t crc = 0xffffffff;
+	for ( ; length >= 8; length -= 8, bytes += 8 )
+	{
+		uint32_t low = crc ^ ( bytes [ 0 ] | bytes [ 1 ] << 8 | bytes [ 2 ] << 16 | ( uint32_t ) bytes [ 3 ] << 24 );
+		crc = table [ 7 ][ low & 0xff ] ^ table [ 6 ][ ( low >> 8 ) & 0xff ]
+			^ table [ 5 ][ ( low >> 16 ) & 0xff ] ^ table [ 4 ][ low >> 24 ]
+			^ table [ 3 ][ bytes [ 4 ] ] ^ table [ 2 ][ bytes [ 5 ] ]
+			^ table [ 1 ][ bytes [ 6 ] ] ^ table [ 0 ][ bytes [ 7 ] ];
+	}
+	for ( ; length > 0; --length, ++bytes )
+		crc = ( crc >> 8 ) ^ table [ 0 ][ ( crc ^ *bytes ) & 0xff ];
+	return crc ^ 0xffffffff;
+}
@@ -0,0 +1,94 @@
+#ifndef __IMAGEARCHIVE_H__
+#define __IMAGEARCHIVE_H__
+
+#include <Windows.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "Image/ImageEncoder.h"
+#include "FramePack.h"
+
+enum ImageArchiveFormat
+{
+	IAF_NONE,
+	// ustar; names up to 99 bytes of UTF-8
+	IAF_TAR,
+	// Stored entries, switching to zip64 records once the archive outgrows the 32-bit fields
+	IAF_ZIP,
+	// FramePack.h; indexed by stream and time stamp rather than by name
+	IAF_PACK,
+};
+
+// What an archive records of an image besides its bytes
+struct ImageArchiveEntry
+{
+	LPCWSTR name;
+	// CRC-32 of the image, which zip and the frame pack record; Checksum gives it
+	uint32_t crc;
+	// Only the frame pack records these
+	int64_t timeStamp;
+	uint32_t stream;
+	ImageEncoderCodec codec;
+	uint32_t width, height;
+};
+
+// Images of a job in one archive instead of a file each. Entries are appended in the order they
+// come, through a staging buffer so the file sees large sequential writes; Close finishes the
+// archive with the zip central directory, the tar end blocks or the frame pack index. After a failed write every call
+// returns that failure, so the archive never goes on past a hole. One thread at a time.
+class ImageArchive
+{
+public:
+	ImageArchive ();
+	~ImageArchive ();
+
+	ImageArchive ( const ImageArchive & ) = delete;
+	ImageArchive & operator= ( const ImageArchive & ) = delete;
+
+public:
+	HRESULT Open ( LPCWSTR path, ImageArchiveFormat format );
+	HRESULT Append ( const ImageArchiveEntry & entry, const EncodedImage * image );
+	HRESULT Close ();
+
+	ImageArchiveFormat GetFormat () const { return _format; }
+	uint64_t GetEntryCount () const { return _entryCount; }
+	uint64_t GetSize () const { return _offset; }
+
+	// CRC-32 as zip uses it; slow enough that encoders take it in parallel rather than the archive
+	static uint32_t Checksum ( const void * data, size_t length );
+
+private:
+	HRESULT Write ( const void * data, size_t length );
+	HRESULT FlushStaging ();
+	HRESULT WriteCentralDirectory ();
+	HRESULT WritePackIndex ();
+
+private:
+	struct Entry
+	{
+		uint64_t offset;
+		uint32_t size, crc;
+		uint32_t nameOffset;
+		uint16_t nameLength;
+	};
+
+	HANDLE _file;
+	ImageArchiveFormat _format;
+	// Bytes appended so far, staged or not
+	uint64_t _offset;
+	uint64_t _entryCount;
+	std::vector<uint8_t> _staging;
+	size_t _staged;
+	HRESULT _result;
+
+	// Central directory material; names packed together so an entry does not allocate
+	std::vector<Entry> _entries;
+	std::vector<char> _names;
+	std::vector<FramePackEntry> _frames;
+
+	uint16_t _dosTime, _dosDate;
+	uint64_t _unixTime;
+};
+
+#endif
@@ -0,0 +1,424 @@
+#include "ImageWriter.h"
+
+#include <cstring>
+#include <algorithm>
+
+EncodedImagePool::~EncodedImagePool ()
+{
+	for ( EncodedImage * image : _buffers )
+	{
+		FreeEncodedImage ( image );
+		delete image;
+	}
+}
+
+EncodedImage * EncodedImagePool::Acquire ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	if ( !_freeBuffers.empty () )
+	{
+		EncodedImage * image = _freeBuffers.back ();
+		_freeBuffers.pop_back ();
+		return image;
+	}
+
+	EncodedImage * image = new EncodedImage ();
+	_buffers.push_back ( image );
+	return image;
+}
+
+void EncodedImagePool::Recycle ( EncodedImage * image )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_freeBuffers.push_back ( image );
+}
+
+ImageWriter::ImageWriter ( const ImageWriterSettings & settings )
+	: _settings ( settings )
+	, _items ( 16 )
+	, _head ( 0 ), _count ( 0 )
+	, _dirtyBytes ( 0 ), _peakDirtyBytes ( 0 )
+	, _writers ( 0 )
+	, _cancelled ( false )
+	, _completionPort ( nullptr )
+{
+	for ( std::atomic<uint64_t> & bucket : _latency )
+		bucket = 0;
+
+	if ( settings.queueDepth == 0 )
+		return;
+
+	_completionPort = CreateIoCompletionPort ( INVALID_HANDLE_VALUE, nullptr, 0, 1 );
+	if ( _completionPort == nullptr )
+		return;
+
+	_pending.resize ( settings.queueDepth );
+	for ( PendingWrite & pending : _pending )
+		_freePending.push_back ( &pending );
+	_completionThread = std::thread ( &ImageWriter::CompleteWrites, this );
+}
+
+ImageWriter::~ImageWriter ()
+{
+	if ( _completionPort != nullptr )
+	{
+		// An empty packet tells the completion thread to stop
+		Drain ();
+		PostQueuedCompletionStatus ( _completionPort, 0, 0, nullptr );
+		_completionThread.join ();
+		CloseHandle ( _completionPort );
+	}
+}
+
+bool ImageWriter::Push ( ImageWrite && item )
+{
+	// The whole buffer stays held until the write is done, not only the encoded bytes in it
+	size_t size = item.image->capacity;
+
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_writable.wait ( lock, [ this, size ] { return _cancelled || _dirtyBytes == 0 || _dirtyBytes + size <= _settings.dirtyBudget; } );
+	if ( _cancelled )
+		return false;
+
+	if ( _count == _items.size () )
+	{
+		std::vector<ImageWrite> items ( _items.size () * 2 );
+		for ( size_t i = 0; i < _count; ++i )
+			items [ i ] = _items [ ( _head + i ) % _items.size () ];
+		_items.swap ( items );
+		_head = 0;
+	}
+
+	_items [ ( _head + _count ) % _items.size () ] = item;
+	++_count;
+	_dirtyBytes += size;
+	if ( _dirtyBytes > _peakDirtyBytes )
+		_peakDirtyBytes = _dirtyBytes;
+
+	lock.unlock ();
+	_readable.notify_one ();
+	return true;
+}
+
+bool ImageWriter::Pop ( ImageWrite & item )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_readable.wait ( lock, [ this ] { return _cancelled || _count > 0 || _writers == 0; } );
+	if ( _cancelled || _count == 0 )
+		return false;
+
+	item = _items [ _head ];
+	_head = ( _head + 1 ) % _items.size ();
+	--_count;
+	return true;
+}
+
+HRESULT ImageWriter::Write ( const ImageWrite & item )
+{
+	HRESULT hr;
+	LARGE_INTEGER started;
+	QueryPerformanceCounter ( &started );
+
+	if ( _completionPort != nullptr )
+	{
+		PendingWrite * pending;
+		{
+			std::unique_lock<std::mutex> lock ( _mutex );
+			_pendingFreed.wait ( lock, [ this ] { return !_freePending.empty (); } );
+			pending = _freePending.back ();
+			_freePending.pop_back ();
+		}
+		pending->item = item;
+		pending->started = started;
+
+		bool taken = StartWrite ( pending, &hr );
+		if ( taken && SUCCEEDED ( hr ) )
+			return hr;
+
+		ReleasePending ( pending );
+		if ( taken )
+		{
+			Finish ( item, hr, started );
+			return hr;
+		}
+	}
+
+	hr = WriteImageFile ( item.path, item.image, _settings.flushPolicy == IFP_PER_FILE );
+	Finish ( item, hr, started );
+	return hr;
+}
+
+bool ImageWriter::StartWrite ( PendingWrite * pending, HRESULT * result )
+{
+	const EncodedImage * image = pending->item.image;
+	DWORD length = ( DWORD ) image->size;
+	DWORD flags = FILE_FLAG_OVERLAPPED;
+	if ( _settings.unbuffered )
+	{
+		// Encoded buffers are page-aligned with whole pages of capacity, so the padded length is there to write
+		length = ( DWORD ) ( ( image->size + ENCODED_IMAGE_ALIGNMENT - 1 ) & ~( size_t ) ( ENCODED_IMAGE_ALIGNMENT - 1 ) );
+		flags |= FILE_FLAG_NO_BUFFERING;
+	}
+
+	// Volumes that refuse either flag leave the image to the synchronous path, which reports any error for good
+	HANDLE file = CreateFile ( pending->item.path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | flags, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return false;
+	if ( CreateIoCompletionPort ( file, _completionPort, 0, 0 ) == nullptr )
+	{
+		CloseHandle ( file );
+		return false;
+	}
+
+	memset ( &pending->overlapped, 0, sizeof ( OVERLAPPED ) );
+	pending->file = file;
+	if ( !WriteFile ( file, image->data, length, nullptr, &pending->overlapped ) )
+	{
+		DWORD error = GetLastError ();
+		if ( error != ERROR_IO_PENDING )
+		{
+			CloseHandle ( file );
+			// Sectors larger than a page cannot be written unbuffered from our buffers
+			if ( error == ERROR_INVALID_PARAMETER && _settings.unbuffered )
+				return false;
+
+			DeleteFile ( pending->item.path );
+			*result = HRESULT_FROM_WIN32 ( error );
+			return true;
+		}
+	}
+
+	// Writes that complete at once still queue their completion
+	*result = S_OK;
+	return true;
+}
+
+void ImageWriter::ReleasePending ( PendingWrite * pending )
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_freePending.push_back ( pending );
+	}
+	_pendingFreed.notify_all ();
+}
+
+void ImageWriter::CompleteWrites ()
+{
+	for ( ;; )
+	{
+		DWORD transferred;
+		ULONG_PTR key;
+		OVERLAPPED * overlapped;
+		BOOL succeeded = GetQueuedCompletionStatus ( _completionPort, &transferred, &key, &overlapped, INFINITE );
+		if ( overlapped == nullptr )
+			break;
+
+		PendingWrite * pending = ( PendingWrite* ) overlapped;
+		const EncodedImage * image = pending->item.image;
+		HRESULT hr = S_OK;
+		if ( !succeeded )
+			hr = HRESULT_FROM_WIN32 ( GetLastError () );
+		else if ( transferred < image->size )
+			hr = HRESULT_FROM_WIN32 ( ERROR_DISK_FULL );
+		else if ( _settings.unbuffered )
+		{
+			// Cut the page padding off again
+			FILE_END_OF_FILE_INFO endOfFile;
+			endOfFile.EndOfFile.QuadPart = image->size;
+			if ( !SetFileInformationByHandle ( pending->file, FileEndOfFileInfo, &endOfFile, sizeof ( endOfFile ) ) )
+				hr = HRESULT_FROM_WIN32 ( GetLastError () );
+		}
+		if ( SUCCEEDED ( hr ) && _settings.flushPolicy == IFP_PER_FILE && !FlushFileBuffers ( pending->file ) )
+			hr = HRESULT_FROM_WIN32 ( GetLastError () );
+
+		CloseHandle ( pending->file );
+		if ( FAILED ( hr ) )
+			DeleteFile ( pending->item.path );
+
+		Finish ( pending->item, hr, pending->started );
+		ReleasePending ( pending );
+	}
+}
+
+// Every image ends here once, whichever path wrote it
+void ImageWriter::Finish ( const ImageWrite & item, HRESULT hr, const LARGE_INTEGER & started )
+{
+	LARGE_INTEGER finished, frequency;
+	QueryPerformanceCounter ( &finished );
+	QueryPerformanceFrequency ( &frequency );
+	uint64_t microseconds = ( finished.QuadPart - started.QuadPart ) * 1000000 / frequency.QuadPart;
+	int bucket = 0;
+	while ( bucket < IMAGE_WRITE_LATENCY_BUCKETS - 1 && microseconds >= ( 2ull << bucket ) )
+		++bucket;
+	++_latency [ bucket ];
+
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_dirtyBytes -= item.image->capacity;
+		if ( SUCCEEDED ( hr ) )
+			AppendWrittenPath ( item.path );
+	}
+	_writable.notify_all ();
+	_pool.Recycle ( item.image );
+
+	if ( _settings.completed != nullptr )
+		_settings.completed ( hr );
+}
+
+void ImageWriter::Drain ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_pendingFreed.wait ( lock, [ this ] { return _freePending.size () == _pending.size (); } );
+}
+
+void ImageWriter::AppendWrittenPath ( LPCWSTR path )
+{
+	if ( _settings.flushPolicy == IFP_END_OF_JOB )
+		_writtenPaths.insert ( _writtenPaths.end (), path, path + lstrlen ( path ) + 1 );
+}
+
+void ImageWriter::AddWritten ( LPCWSTR path )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	AppendWrittenPath ( path );
+}
+
+// A volume handle flushes every file on the volume in one call, but opening one takes administrator rights
+static bool FlushVolume ( LPCWSTR mountPoint )
+{
+	wchar_t name [ MAX_PATH ];
+	if ( !GetVolumeNameForVolumeMountPoint ( mountPoint, name, MAX_PATH ) )
+		return false;
+
+	// The volume opens by its name without the trailing backslash
+	name [ lstrlen ( name ) - 1 ] = L'\0';
+	HANDLE volume = CreateFile ( name, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr );
+	if ( volume == INVALID_HANDLE_VALUE )
+		return false;
+
+	BOOL flushed = FlushFileBuffers ( volume );
+	CloseHandle ( volume );
+	return flushed != FALSE;
+}
+
+static HRESULT FlushImageFile ( LPCWSTR path )
+{
+	HANDLE file = CreateFile ( path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	HRESULT hr = S_OK;
+	if ( !FlushFileBuffers ( file ) )
+		hr = HRESULT_FROM_WIN32 ( GetLastError () );
+	CloseHandle ( file );
+	return hr;
+}
+
+// Files still in the cache are written out together, so the disk sees them in one batch
+// rather than one flush per image after another
+HRESULT ImageWriter::Flush ()
+{
+	std::vector<wchar_t> paths;
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		paths.swap ( _writtenPaths );
+	}
+
+	std::vector<std::wstring> flushedVolumes, refusedVolumes;
+	std::vector<LPCWSTR> files;
+	for ( size_t offset = 0; offset < paths.size (); offset += lstrlen ( &paths [ offset ] ) + 1 )
+	{
+		LPCWSTR path = &paths [ offset ];
+		wchar_t mountPoint [ MAX_PATH ];
+		if ( GetVolumePathName ( path, mountPoint, MAX_PATH ) )
+		{
+			if ( std::find ( flushedVolumes.begin (), flushedVolumes.end (), mountPoint ) != flushedVolumes.end () )
+				continue;
+			if ( std::find ( refusedVolumes.begin (), refusedVolumes.end (), mountPoint ) == refusedVolumes.end () )
+			{
+				if ( FlushVolume ( mountPoint ) )
+				{
+					flushedVolumes.push_back ( mountPoint );
+					continue;
+				}
+				refusedVolumes.push_back ( mountPoint );
+			}
+		}
+		files.push_back ( path );
+	}
+
+	// The rest go out on as many threads as writes are kept in flight, so the disk has them queued together
+	std::atomic<size_t> next ( 0 );
+	std::atomic<HRESULT> result ( S_OK );
+	auto flushFiles = [ &files, &next, &result ]
+	{
+		for ( size_t i; ( i = next++ ) < files.size (); )
+		{
+			HRESULT hr = FlushImageFile ( files [ i ] );
+			if ( FAILED ( hr ) )
+				result = hr;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for ( size_t i = 1; i < _settings.queueDepth && i < files.size (); ++i )
+		threads.emplace_back ( flushFiles );
+	flushFiles ();
+	for ( std::thread & thread : threads )
+		thread.join ();
+
+	return result;
+}
+
+void ImageWriter::GetLatencyHistogram ( uint64_t buckets [ IMAGE_WRITE_LATENCY_BUCKETS ] ) const
+{
+	for ( int i = 0; i < IMAGE_WRITE_LATENCY_BUCKETS; ++i )
+		buckets [ i ] = _latency [ i ];
+}
+
+void ImageWriter::AddWriter ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	++_writers;
+}
+
+void ImageWriter::RemoveWriter ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		--_writers;
+	}
+	_readable.notify_all ();
+}
+
+void ImageWriter::Cancel ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_cancelled = true;
+	}
+	_readable.notify_all ();
+	_writable.notify_all ();
+}
+
+HRESULT WriteImageFile ( LPCWSTR path, const EncodedImage * image, bool flush )
+{
+	HANDLE file = CreateFile ( path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	HRESULT hr = S_OK;
+	DWORD written;
+	if ( !WriteFile ( file, image->data, ( DWORD ) image->size, &written, nullptr ) )
+		hr = HRESULT_FROM_WIN32 ( GetLastError () );
+	else if ( written != image->size )
+		hr = HRESULT_FROM_WIN32 ( ERROR_DISK_FULL );
+	else if ( flush && !FlushFileBuffers ( file ) )
+		hr = HRESULT_FROM_WIN32 ( GetLastError () );
+
+	CloseHandle ( file );
+	if ( FAILED ( hr ) )
+		DeleteFile ( path );
+	return hr;
+}
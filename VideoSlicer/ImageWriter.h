@@ -0,0 +1,168 @@
+#ifndef __IMAGEWRITER_H__
+#define __IMAGEWRITER_H__
+
+#include <Windows.h>
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "Pipeline.h"
+#include "Image/ImageEncoder.h"
+
+// Bucket n counts files that took from 2^n up to 2^(n+1) microseconds, the last one everything slower
+#define IMAGE_WRITE_LATENCY_BUCKETS 24
+
+enum ImageFlushPolicy
+{
+	// Leave the files to the cache manager's lazy writer
+	IFP_NONE,
+	// Flush each file before it is closed
+	IFP_PER_FILE,
+	// Flush every file of the job in one batch once the job is written
+	IFP_END_OF_JOB,
+};
+
+struct ImageWriterSettings
+{
+	// Bytes of encoded buffers, by capacity, pushed and not yet written
+	uint64_t dirtyBudget;
+	ImageFlushPolicy flushPolicy;
+	// Writes kept in flight through an I/O completion port. 0 writes synchronously on the calling
+	// thread, which is also what happens when the port or an overlapped open is not available.
+	// Flush keeps as many file flushes in flight, at least one.
+	uint32_t queueDepth;
+	// Overlapped writes bypass the system cache: whole pages go out of the encoded buffer, and the
+	// file is trimmed to the image size afterwards
+	bool unbuffered;
+	// Called once per image on whichever thread finished writing it. May be null.
+	void ( *completed ) ( HRESULT hr );
+};
+
+// Buffers for encodes, each grown by the images it held before. The pool owns every buffer it
+// hands out and frees them when it is destroyed.
+class EncodedImagePool
+{
+public:
+	EncodedImagePool () { }
+	~EncodedImagePool ();
+
+	EncodedImagePool ( const EncodedImagePool & ) = delete;
+	EncodedImagePool & operator= ( const EncodedImagePool & ) = delete;
+
+public:
+	EncodedImage * Acquire ();
+	void Recycle ( EncodedImage * image );
+
+private:
+	std::mutex _mutex;
+	std::vector<EncodedImage*> _buffers, _freeBuffers;
+};
+
+// One encoded image on its way to disk. The path is inline so queueing it does not allocate.
+struct ImageWrite
+{
+	wchar_t path [ MAX_PATH ];
+	EncodedImage * image;
+};
+
+// Write-behind between the encoders and the disk. Encoders take a buffer, encode into it and push it;
+// a stage of its own pops the images and writes each with a single call, either in place or as an
+// overlapped write a completion thread finishes. The bytes pushed and not yet written are bounded,
+// so a slow disk holds up the encoders instead of filling memory.
+class ImageWriter : public PipelineInlet<ImageWrite>, public PipelineOutlet<ImageWrite>
+{
+public:
+	explicit ImageWriter ( const ImageWriterSettings & settings );
+	~ImageWriter ();
+
+	ImageWriter ( const ImageWriter & ) = delete;
+	ImageWriter & operator= ( const ImageWriter & ) = delete;
+
+public:
+	// A buffer for one encode. Buffers belong to the writer until it is destroyed.
+	EncodedImage * AcquireBuffer () { return _pool.Acquire (); }
+	// Gives back a buffer that was never pushed
+	void RecycleBuffer ( EncodedImage * image ) { _pool.Recycle ( image ); }
+
+	// Blocks while the image's buffer would take the dirty bytes past the budget; one larger than the
+	// whole budget waits until nothing else is dirty. The buffer stays the caller's when this fails.
+	bool Push ( ImageWrite && item ) override;
+	bool Pop ( ImageWrite & item ) override;
+
+	// Writes a popped image, then releases its bytes and recycles its buffer. Overlapped writes return
+	// once started, blocking while the queue is full; their result goes to the completed callback.
+	HRESULT Write ( const ImageWrite & item );
+	// Waits for the overlapped writes still in flight
+	void Drain ();
+	// Flushes the files written so far under IFP_END_OF_JOB; nothing to do otherwise. A volume the
+	// process may open is flushed once for all its files, and the files on any other go out several
+	// at a time.
+	HRESULT Flush ();
+	// Adds a file written outside the writer, such as the first frame, to the next Flush
+	void AddWritten ( LPCWSTR path );
+
+	bool IsOverlapped () const { return _completionPort != nullptr; }
+	uint64_t GetDirtyBudget () const { return _settings.dirtyBudget; }
+	uint64_t GetPeakDirtyBytes () const { return _peakDirtyBytes; }
+	void GetLatencyHistogram ( uint64_t buckets [ IMAGE_WRITE_LATENCY_BUCKETS ] ) const;
+
+private:
+	void AddWriter () override;
+	void RemoveWriter () override;
+	void Cancel () override;
+
+private:
+	// Callers hold _mutex
+	void AppendWrittenPath ( LPCWSTR path );
+
+	// OVERLAPPED comes first so a completion leads back to its write
+	struct PendingWrite
+	{
+		OVERLAPPED overlapped;
+		HANDLE file;
+		ImageWrite item;
+		LARGE_INTEGER started;
+	};
+
+	// false when the image has to go through the synchronous path instead
+	bool StartWrite ( PendingWrite * pending, HRESULT * result );
+	void ReleasePending ( PendingWrite * pending );
+	void CompleteWrites ();
+	void Finish ( const ImageWrite & item, HRESULT hr, const LARGE_INTEGER & started );
+
+private:
+	ImageWriterSettings _settings;
+
+	std::mutex _mutex;
+	std::condition_variable _readable, _writable;
+	// Ring of pushed images, doubled when full
+	std::vector<ImageWrite> _items;
+	size_t _head, _count;
+	uint64_t _dirtyBytes, _peakDirtyBytes;
+	size_t _writers;
+	bool _cancelled;
+
+	EncodedImagePool _pool;
+	// Paths waiting for Flush, one after another with their terminators, so recording one only
+	// allocates when the buffer grows
+	std::vector<wchar_t> _writtenPaths;
+
+	HANDLE _completionPort;
+	std::thread _completionThread;
+	std::vector<PendingWrite> _pending;
+	std::vector<PendingWrite*> _freePending;
+	std::condition_variable _pendingFreed;
+
+	std::atomic<uint64_t> _latency [ IMAGE_WRITE_LATENCY_BUCKETS ];
+};
+
+// Creates the file and writes the whole image in one call, flushing it before it is closed when asked.
+// A failed write leaves no file behind.
+HRESULT WriteImageFile ( LPCWSTR path, const EncodedImage * image, bool flush );
+
+#endif
@@ -7,6 +7,9 @@
 #endif
 
 #include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
 
 #include <Windows.h>
 #include <CommCtrl.h>
@@ -20,6 +23,15 @@
 #include "Video/VideoDecoder.h"
 #include "Image/ImageEncoder.h"
 #include "ThreadPool.h"
+#include "AllocationCounter.h"
+#include "CpuTopology.h"
+#include "StageBalancer.h"
+#include "CancellationToken.h"
+#include "Pipeline.h"
+#include "ImageWriter.h"
+#include "ImageArchive.h"
+#include "ReorderBuffer.h"
+#include "Benchmark.h"
 
 #pragma comment ( lib, "comctl32.lib" )
 
@@ -29,20 +41,130 @@ enum SAVEFILEFORMAT
 	SFF_JPEG_100 = 202,
 	SFF_JPEG_80 = 203,
 	SFF_JPEG_60 = 204,
+	SFF_QOI = 205,
+	SFF_JXL = 206,
 };
 
 std::wstring g_openedVideoFile;
 std::wstring g_saveTo;
 
-bool g_isStarted;
-double g_progress;
+std::atomic<bool> g_isStarted;
+// Written by every decode thread, read by the dialog's timer
+std::atomic<double> g_progress;
+// Set from the dialog thread; the decode threads, the demuxer and the encoders all stop on it
+CancellationToken g_cancel;
+
+LARGE_INTEGER g_jobStarted;
+volatile LONG g_timeToFirstFrame = -1;
+
+#define WARM_UP_FRAMES 256
+volatile LONG g_submittedFrames;
+volatile LONG g_encodedFrames;
+volatile LONGLONG g_encodedBytes;
+uint64_t g_warmAllocationCount;
+// Allocations between the end of warm-up and the end of the last stage
+uint64_t g_steadyAllocationCount;
 
 HANDLE g_thread;
 DWORD g_threadId;
 
 SAVEFILEFORMAT g_saveFileFormat = SFF_JPEG_100;
 
-std::wstring ConvertTimeStamp ( LONGLONG nanosec, LPCWSTR ext ) noexcept
+bool g_followMode = false;
+uint32_t g_followIdleTimeout = 10000;
+
+std::vector<int> g_streams;
+bool g_allVideoStreams = false;
+
+int64_t g_probeSize = 0;
+int64_t g_analyzeDuration = 0;
+std::wstring g_probeCacheDirectory;
+
+bool g_lowLatency = false;
+
+int g_workerPriority = THREAD_PRIORITY_NORMAL;
+CpuPlacement g_cpuPlacement = CP_NONE;
+bool g_nodeLocalBuffers = false;
+bool g_balanceStages = true;
+ImageEncoderBackend g_imageBackend = IEB_AUTO;
+int g_pngCompressionLevel = -1;
+// Threads each image is split across; zero picks them from the frame size
+uint32_t g_imageThreads = 0;
+// Read every QOI image back and compare it with the frame it came from
+bool g_verifyImages = false;
+volatile LONG g_verifyFailures;
+uint32_t g_jobImageThreads = 1;
+
+// One processor in this many of the usable ones goes to the codec threads of the decoders
+#define DECODE_BUDGET_SHARE 4
+
+#define LARGE_IMAGE_PIXELS ( 3840 * 2160 )
+#define LARGE_IMAGE_THREADS 4
+
+// Encoded bytes allowed to wait for the write stage, or held back for an archive's order, and the
+// threads the write stage writes them on
+uint64_t g_dirtyBudget = 256 * 1024 * 1024;
+uint32_t g_writerThreads = 2;
+ImageFlushPolicy g_flushPolicy = IFP_NONE;
+// Overlapped writes in flight at once, zero to write synchronously; unbuffered skips the system cache
+uint32_t g_writeQueueDepth = 16;
+bool g_unbufferedWrites = false;
+// Images go into one archive under the output directory instead of a file each
+ImageArchiveFormat g_archiveFormat = IAF_NONE;
+// Random reads of the frame read benchmark; 0 takes its default
+uint32_t g_readBenchmarkCount = 0;
+// Runs a benchmark in place of the dialog; the input and output options stand in for its pickers
+std::wstring g_benchmark;
+std::wstring g_benchmarkReport = TEXT ( "VideoSlicer-benchmark.txt" );
+
+// Per-thread state of an encoding worker, reached from tasks through ThreadPool::context
+struct EncodeWorker
+{
+	bool comInitialized;
+	ImageEncoderSettings settings;
+	ImageEncoderContext * encoderContext;
+	// Decoded copy of the last image when verifying, kept for the next one
+	std::vector<BYTE> verifyBuffer;
+};
+
+struct SushiStream
+{
+	CComPtr<IVideoDecoder> decoder;
+	std::wstring saveTo;
+	// Entry names start with this in an archive, the stream's directory there
+	std::wstring archivePrefix;
+	uint32_t index;
+	uint32_t width, height, stride;
+	uint64_t duration;
+	// Basis points of the duration decoded; written by this stream's decode thread, read by the others
+	volatile LONG progress;
+	DWORD_PTR affinity;
+	size_t lane;
+};
+
+// What the decode stages hand to the encode stage
+struct SushiFrame
+{
+	SushiStream * stream;
+	CComPtr<IVideoSample> sample;
+	uint64_t timeStamp;
+	size_t lane;
+	// Position in the archive, taken in decode order
+	uint64_t sequence;
+};
+
+// What the encode stage hands to the archive stage, through the reorder buffer
+struct ArchiveImage
+{
+	SushiStream * stream;
+	uint64_t timeStamp;
+	EncodedImage * image;
+	uint32_t crc;
+	// Size the image was encoded at, which the pack index records
+	UINT width, height;
+};
+
+void ConvertTimeStamp ( LONGLONG nanosec, LPCWSTR ext, LPWSTR filename ) noexcept
 {
 	UINT millisec = ( UINT ) ( nanosec / 10000 );
 
@@ -53,10 +175,159 @@ std::wstring ConvertTimeStamp ( LONGLONG nanosec, LPCWSTR ext ) noexcept
 	UINT second = millisec / 1000;
 	millisec -= second * 1000;
 
-	wchar_t temp [ 256 ];
-	wsprintf ( temp, TEXT ( "%02dː%02dː%02d˙%03d.%s" ), hour, minute, second, millisec, ext );
+	wsprintf ( filename, TEXT ( "%02dː%02dː%02d˙%03d.%s" ), hour, minute, second, millisec, ext );
+}
+
+bool IsOption ( LPCWSTR arg, LPCWSTR name, LPCWSTR * value ) noexcept
+{
+	if ( arg [ 0 ] != L'/' && arg [ 0 ] != L'-' )
+		return false;
+
+	size_t nameLength = wcslen ( name );
+	if ( _wcsnicmp ( arg + 1, name, nameLength ) != 0 )
+		return false;
+
+	LPCWSTR rest = arg + 1 + nameLength;
+	if ( *rest == L'\0' )
+	{
+		*value = nullptr;
+		return true;
+	}
+	else if ( *rest == L':' || *rest == L'=' )
+	{
+		*value = rest + 1;
+		return true;
+	}
+
+	return false;
+}
+
+void ParseCommandLine () noexcept
+{
+	int argc;
+	LPWSTR * argv = CommandLineToArgvW ( GetCommandLineW (), &argc );
+	if ( argv == nullptr )
+		return;
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		LPCWSTR value;
+		if ( IsOption ( argv [ i ], TEXT ( "follow" ), &value ) )
+		{
+			g_followMode = true;
+			if ( value != nullptr )
+				g_followIdleTimeout = wcstoul ( value, nullptr, 10 );
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "lowlatency" ), &value ) )
+			g_lowLatency = true;
+		else if ( IsOption ( argv [ i ], TEXT ( "priority" ), &value ) && value != nullptr )
+		{
+			if ( _wcsicmp ( value, TEXT ( "low" ) ) == 0 )
+				g_workerPriority = THREAD_PRIORITY_BELOW_NORMAL;
+			else if ( _wcsicmp ( value, TEXT ( "high" ) ) == 0 )
+				g_workerPriority = THREAD_PRIORITY_ABOVE_NORMAL;
+			else
+				g_workerPriority = THREAD_PRIORITY_NORMAL;
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "affinity" ), &value ) && value != nullptr )
+		{
+			if ( _wcsicmp ( value, TEXT ( "pin" ) ) == 0 )
+				g_cpuPlacement = CP_PIN;
+			else if ( _wcsicmp ( value, TEXT ( "separate" ) ) == 0 )
+				g_cpuPlacement = CP_SEPARATE;
+			else if ( _wcsicmp ( value, TEXT ( "siblings" ) ) == 0 )
+				g_cpuPlacement = CP_SIBLINGS;
+			else
+				g_cpuPlacement = CP_NONE;
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "numa" ), &value ) )
+			g_nodeLocalBuffers = true;
+		else if ( IsOption ( argv [ i ], TEXT ( "nobalance" ), &value ) )
+			g_balanceStages = false;
+		else if ( IsOption ( argv [ i ], TEXT ( "wic" ), &value ) )
+			g_imageBackend = IEB_WIC;
+		else if ( IsOption ( argv [ i ], TEXT ( "ffmpeg" ), &value ) )
+			g_imageBackend = IEB_FFMPEG;
+		else if ( IsOption ( argv [ i ], TEXT ( "verify" ), &value ) )
+			g_verifyImages = true;
+		else if ( IsOption ( argv [ i ], TEXT ( "imagethreads" ), &value ) && value != nullptr )
+			g_imageThreads = wcstoul ( value, nullptr, 10 );
+		else if ( IsOption ( argv [ i ], TEXT ( "pnglevel" ), &value ) && value != nullptr )
+			g_pngCompressionLevel = ( std::min ) ( _wtoi ( value ), 9 );
+		else if ( IsOption ( argv [ i ], TEXT ( "dirtymb" ), &value ) && value != nullptr )
+			g_dirtyBudget = ( uint64_t ) wcstoul ( value, nullptr, 10 ) * 1024 * 1024;
+		else if ( IsOption ( argv [ i ], TEXT ( "writers" ), &value ) && value != nullptr )
+			g_writerThreads = ( std::max ) ( wcstoul ( value, nullptr, 10 ), 1ul );
+		else if ( IsOption ( argv [ i ], TEXT ( "writequeue" ), &value ) && value != nullptr )
+			g_writeQueueDepth = wcstoul ( value, nullptr, 10 );
+		else if ( IsOption ( argv [ i ], TEXT ( "unbuffered" ), &value ) )
+			g_unbufferedWrites = true;
+		else if ( IsOption ( argv [ i ], TEXT ( "fsync" ), &value ) && value != nullptr )
+		{
+			if ( _wcsicmp ( value, TEXT ( "file" ) ) == 0 )
+				g_flushPolicy = IFP_PER_FILE;
+			else if ( _wcsicmp ( value, TEXT ( "job" ) ) == 0 )
+				g_flushPolicy = IFP_END_OF_JOB;
+			else
+				g_flushPolicy = IFP_NONE;
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "archive" ), &value ) && value != nullptr )
+		{
+			if ( _wcsicmp ( value, TEXT ( "zip" ) ) == 0 )
+				g_archiveFormat = IAF_ZIP;
+			else if ( _wcsicmp ( value, TEXT ( "tar" ) ) == 0 )
+				g_archiveFormat = IAF_TAR;
+			else if ( _wcsicmp ( value, TEXT ( "pack" ) ) == 0 )
+				g_archiveFormat = IAF_PACK;
+			else
+				g_archiveFormat = IAF_NONE;
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "readbench" ), &value ) && value != nullptr )
+			g_readBenchmarkCount = wcstoul ( value, nullptr, 10 );
+		else if ( IsOption ( argv [ i ], TEXT ( "benchmark" ), &value ) && value != nullptr )
+			g_benchmark = value;
+		else if ( IsOption ( argv [ i ], TEXT ( "report" ), &value ) && value != nullptr )
+			g_benchmarkReport = value;
+		else if ( IsOption ( argv [ i ], TEXT ( "input" ), &value ) && value != nullptr )
+			g_openedVideoFile = value;
+		else if ( IsOption ( argv [ i ], TEXT ( "output" ), &value ) && value != nullptr )
+			g_saveTo = value;
+		else if ( IsOption ( argv [ i ], TEXT ( "probesize" ), &value ) && value != nullptr )
+			g_probeSize = _wcstoi64 ( value, nullptr, 10 );
+		else if ( IsOption ( argv [ i ], TEXT ( "analyzeduration" ), &value ) && value != nullptr )
+			g_analyzeDuration = _wcstoi64 ( value, nullptr, 10 );
+		else if ( IsOption ( argv [ i ], TEXT ( "probecache" ), &value ) && value != nullptr )
+		{
+			g_probeCacheDirectory = value;
+			CreateDirectory ( value, nullptr );
+		}
+		else if ( IsOption ( argv [ i ], TEXT ( "streams" ), &value ) && value != nullptr )
+		{
+			if ( _wcsicmp ( value, TEXT ( "all" ) ) == 0 )
+				g_allVideoStreams = true;
+			else
+			{
+				for ( LPWSTR next; *value != L'\0'; value = next )
+				{
+					g_streams.push_back ( ( int ) wcstol ( value, &next, 10 ) );
+					if ( next == value )
+						break;
+					if ( *next == L',' )
+						++next;
+				}
+			}
+		}
+	}
+
+	LocalFree ( argv );
+}
 
-	return temp;
+LONG ElapsedMilliseconds ( const LARGE_INTEGER & since ) noexcept
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter ( &now );
+	QueryPerformanceFrequency ( &frequency );
+	return ( LONG ) ( ( now.QuadPart - since.QuadPart ) * 1000 / frequency.QuadPart );
 }
 
 void ErrorExit ( HWND owner, unsigned exitCode )
@@ -68,64 +339,329 @@ void ErrorExit ( HWND owner, unsigned exitCode )
 	ExitProcess ( exitCode );
 }
 
-bool EncodingImageToFile ( IVideoSample * readedSample, LONGLONG readedTimeStamp,
-	UINT width, UINT height, UINT stride ) noexcept
+void GetImageEncoderSettings ( ImageEncoderSettings * settings ) noexcept
 {
-	CComPtr<IVideoSample> sample;
-	*&sample = readedSample;
-
-	BYTE * colorBuffer;
-	uint64_t colorBufferLength;
-	if ( FAILED ( sample->Lock ( ( LPVOID* ) &colorBuffer, &colorBufferLength ) ) )
-		return false;
+	settings->cancel = &g_cancel;
+	settings->backend = g_imageBackend;
+	settings->threads = g_jobImageThreads;
+	settings->post = nullptr;
+	settings->executor = nullptr;
 
-	std::wstring filename = ConvertTimeStamp ( readedTimeStamp, g_saveFileFormat == SFF_PNG ? TEXT ( "png" ) : TEXT ( "jpg" ) );
-	wchar_t outputPath [ MAX_PATH ];
-	PathCombine ( outputPath, g_saveTo.c_str (), filename.c_str () );
-	
-	ImageEncoderSettings settings;
 	switch ( g_saveFileFormat )
 	{
 		case SFF_PNG:
-			settings.codecType = IEC_PNG;
-			settings.settings.png.interlace = false;
-			settings.settings.png.filtering = true;
+			settings->codecType = IEC_PNG;
+			settings->settings.png.interlace = false;
+			settings->settings.png.filtering = true;
+			settings->settings.png.compressionLevel = g_pngCompressionLevel;
 			break;
 
 		case SFF_JPEG_100:
-			settings.codecType = IEC_JPEG;
-			settings.settings.jpeg.quality = 1.0f;
-			settings.settings.jpeg.chromaSubsample = false;
+			settings->codecType = IEC_JPEG;
+			settings->settings.jpeg.quality = 1.0f;
+			settings->settings.jpeg.chromaSubsample = false;
 			break;
 
 		case SFF_JPEG_80:
-			settings.codecType = IEC_JPEG;
-			settings.settings.jpeg.quality = 0.8f;
-			settings.settings.jpeg.chromaSubsample = true;
+			settings->codecType = IEC_JPEG;
+			settings->settings.jpeg.quality = 0.8f;
+			settings->settings.jpeg.chromaSubsample = true;
 			break;
 		case SFF_JPEG_60:
-			settings.codecType = IEC_JPEG;
-			settings.settings.jpeg.quality = 0.6f;
-			settings.settings.jpeg.chromaSubsample = true;
+			settings->codecType = IEC_JPEG;
+			settings->settings.jpeg.quality = 0.6f;
+			settings->settings.jpeg.chromaSubsample = true;
 			break;
+
+		case SFF_QOI:
+			settings->codecType = IEC_QOI;
+			break;
+
+		case SFF_JXL:
+			settings->codecType = IEC_JXL;
+			break;
+	}
+}
+
+LPCWSTR GetImageExtension () noexcept
+{
+	switch ( g_saveFileFormat )
+	{
+		case SFF_PNG: return TEXT ( "png" );
+		case SFF_QOI: return TEXT ( "qoi" );
+		case SFF_JXL: return TEXT ( "jxl" );
+		default: return TEXT ( "jpg" );
+	}
+}
+
+bool VerifyQoiImage ( const EncodedImage * image, const BYTE * pixels, UINT width, UINT height, UINT stride,
+	std::vector<BYTE> & decoded ) noexcept
+{
+	decoded.resize ( ( size_t ) width * height * 3 );
+	uint32_t decodedWidth, decodedHeight;
+	if ( FAILED ( DecodeQoiImage ( image->data, image->size, &decodedWidth, &decodedHeight, decoded.data (), decoded.size () ) )
+		|| decodedWidth != width || decodedHeight != height )
+		return false;
+
+	UINT pixelSize = width * 4 == stride ? 4 : 3;
+	for ( UINT y = 0; y < height; ++y )
+	{
+		const BYTE * source = pixels + ( size_t ) y * stride, * row = &decoded [ ( size_t ) y * width * 3 ];
+		for ( UINT x = 0; x < width; ++x, source += pixelSize, row += 3 )
+			if ( source [ 0 ] != row [ 0 ] || source [ 1 ] != row [ 1 ] || source [ 2 ] != row [ 2 ] )
+				return false;
+	}
+
+	return true;
+}
+
+// Holds an encoder's helper task until it runs; one that try_post refuses or ThreadPool::discard
+// drops still gets its call
+class EncoderHelper
+{
+public:
+	EncoderHelper ( void ( *task ) ( void * argument, bool run ), void * argument )
+		: _task ( task ), _argument ( argument ) { }
+	// Moves without throwing so the pool keeps the helper inline instead of boxing it
+	EncoderHelper ( EncoderHelper && other ) noexcept
+		: _task ( other._task ), _argument ( other._argument ) { other._task = nullptr; }
+	~EncoderHelper () { if ( _task != nullptr ) _task ( _argument, false ); }
+
+	void operator () ()
+	{
+		void ( *task ) ( void * argument, bool run ) = _task;
+		_task = nullptr;
+		task ( _argument, true );
 	}
+
+private:
+	void ( *_task ) ( void * argument, bool run );
+	void * _argument;
+};
+
+// Helpers land on the posting worker's own deque, where idle workers steal them. A stopping pool
+// refuses them, and the refused helper is called with run false as it is destroyed.
+bool PostEncoderHelper ( void * executor, void ( *task ) ( void * argument, bool run ), void * argument ) noexcept
+{
+	return ( ( ThreadPool* ) executor )->try_post ( EncoderHelper ( task, argument ) );
+}
+
+void * InitializeEncodeWorker ( size_t index, DWORD_PTR affinity, ThreadPool * pool ) noexcept
+{
+	typedef HRESULT ( WINAPI * SetThreadDescriptionFunc ) ( HANDLE, PCWSTR );
+	static SetThreadDescriptionFunc setThreadDescription = ( SetThreadDescriptionFunc )
+		GetProcAddress ( GetModuleHandle ( TEXT ( "kernel32.dll" ) ), "SetThreadDescription" );
+
+	// Windows 10 1607 and later only; older systems just keep unnamed workers
+	if ( setThreadDescription != nullptr )
+	{
+		wchar_t name [ 32 ];
+		wsprintf ( name, TEXT ( "VideoSlicer Encoder %u" ), ( UINT ) index );
+		setThreadDescription ( GetCurrentThread (), name );
+	}
+
+	if ( g_workerPriority != THREAD_PRIORITY_NORMAL )
+		SetThreadPriority ( GetCurrentThread (), g_workerPriority );
+	if ( affinity != 0 )
+		SetThreadAffinityMask ( GetCurrentThread (), affinity );
+
+	EncodeWorker * worker = new EncodeWorker;
+	worker->comInitialized = SUCCEEDED ( CoInitializeEx ( nullptr, COINIT_MULTITHREADED ) );
+	GetImageEncoderSettings ( &worker->settings );
+	worker->settings.post = PostEncoderHelper;
+	worker->settings.executor = pool;
+	if ( FAILED ( CreateImageEncoderContext ( &worker->encoderContext ) ) )
+		worker->encoderContext = nullptr;
+	return worker;
+}
+
+void UninitializeEncodeWorker ( size_t, void * context ) noexcept
+{
+	EncodeWorker * worker = ( EncodeWorker* ) context;
+	DestroyImageEncoderContext ( worker->encoderContext );
+	if ( worker->comInitialized )
+		CoUninitialize ();
+	delete worker;
+}
+
+void GetImagePath ( LPCWSTR saveTo, LONGLONG readedTimeStamp, LPWSTR outputPath ) noexcept
+{
+	wchar_t filename [ 64 ];
+	ConvertTimeStamp ( readedTimeStamp, GetImageExtension (), filename );
+	PathCombine ( outputPath, saveTo, filename );
+}
+
+// Encodes one frame into memory; writing it is up to the caller. The sample's own layout wins over
+// the stream's size from open time, which only stands in for samples that have none. encodedWidth
+// and encodedHeight, when given, get the size the image was encoded at.
+bool EncodingImage ( IVideoSample * sample, UINT width, UINT height, UINT stride, EncodedImage * image,
+	UINT * encodedWidth = nullptr, UINT * encodedHeight = nullptr ) noexcept
+{
+	if ( g_cancel.IsCancelled () )
+		return false;
+
+	BYTE * colorBuffer;
+	uint64_t colorBufferLength;
+	if ( FAILED ( sample->Lock ( ( LPVOID* ) &colorBuffer, &colorBufferLength ) ) )
+		return false;
+
+	EncodeWorker * worker = ThreadPool::context<EncodeWorker> ();
+	ImageEncoderSettings settings;
+	if ( worker != nullptr )
+		settings = worker->settings;
+	else
+		GetImageEncoderSettings ( &settings );
 	settings.imageProp.width = width;
 	settings.imageProp.height = height;
 	settings.imageProp.stride = stride;
+	settings.imageProp.pixelFormat = IEPF_BGR;
 
-	if ( FAILED ( SaveImage ( outputPath, &settings, colorBuffer, colorBufferLength ) ) )
+	VideoSampleLayout layout;
+	if ( SUCCEEDED ( sample->GetLayout ( &layout ) ) )
+	{
+		settings.imageProp.width = layout.width;
+		settings.imageProp.height = layout.height;
+		settings.imageProp.stride = layout.stride;
+		if ( layout.format != VSF_BGR24 )
+		{
+			settings.imageProp.chromaStride = layout.chromaStride;
+			settings.imageProp.fullRange = layout.fullRange;
+			settings.imageProp.pixelFormat = layout.format == VSF_YUV420P ? IEPF_YUV420P
+				: ( layout.format == VSF_YUV422P ? IEPF_YUV422P : IEPF_YUV444P );
+		}
+	}
+
+	HRESULT hr = EncodeImage ( &settings, colorBuffer, colorBufferLength, image,
+		worker != nullptr ? worker->encoderContext : nullptr );
+	if ( FAILED ( hr ) )
 	{
 		sample->Unlock ();
 		return false;
 	}
 
+	if ( g_verifyImages && settings.codecType == IEC_QOI )
+	{
+		std::vector<BYTE> inlineBuffer;
+		if ( !VerifyQoiImage ( image, colorBuffer, settings.imageProp.width, settings.imageProp.height,
+			settings.imageProp.stride, worker != nullptr ? worker->verifyBuffer : inlineBuffer ) )
+			InterlockedIncrement ( &g_verifyFailures );
+	}
+
 	sample->Unlock ();
 
+	InterlockedIncrement ( &g_encodedFrames );
+	InterlockedAdd64 ( &g_encodedBytes, ( LONGLONG ) image->size );
+
+	if ( encodedWidth != nullptr )
+		*encodedWidth = settings.imageProp.width;
+	if ( encodedHeight != nullptr )
+		*encodedHeight = settings.imageProp.height;
+
 	return true;
 }
 
+void ImageWritten ( HRESULT hr ) noexcept
+{
+	if ( SUCCEEDED ( hr ) && g_timeToFirstFrame < 0 )
+	{
+		LONG elapsed = ElapsedMilliseconds ( g_jobStarted );
+		if ( InterlockedCompareExchange ( &g_timeToFirstFrame, elapsed, -1 ) == -1 )
+		{
+			wchar_t message [ 64 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: time to first frame %d ms\n" ), elapsed );
+			OutputDebugString ( message );
+		}
+	}
+}
+
+// Encodes and writes one frame on the calling thread, for the first frame ahead of the pipeline. It is
+// flushed at once only under IFP_PER_FILE; outputPath gets its path for the end-of-job flush.
+bool EncodingImageToFile ( LPCWSTR saveTo, IVideoSample * sample, LONGLONG readedTimeStamp,
+	UINT width, UINT height, UINT stride, wchar_t outputPath [ MAX_PATH ] ) noexcept
+{
+	GetImagePath ( saveTo, readedTimeStamp, outputPath );
+
+	EncodedImage image = { 0, };
+	bool written = EncodingImage ( sample, width, height, stride, &image )
+		&& SUCCEEDED ( WriteImageFile ( outputPath, &image, g_flushPolicy == IFP_PER_FILE ) );
+	FreeEncodedImage ( &image );
+
+	ImageWritten ( written ? S_OK : E_FAIL );
+	return written;
+}
+
+// Decode stage of one stream; frames bound for an archive take their place in it here
+void SliceStream ( std::vector<SushiStream> & streams, size_t index, PipelineWriter<SushiFrame> & writer,
+	ReorderBuffer<ArchiveImage> * order ) noexcept
+{
+	SushiStream & stream = streams [ index ];
+
+	if ( stream.affinity != 0 )
+		SetThreadAffinityMask ( GetCurrentThread (), stream.affinity );
+
+	// The first image of every stream jumps the backlog of the others
+	size_t lane = ThreadPool::interactiveLane;
+
+	while ( !writer.IsCancelled () )
+	{
+		SushiFrame frame;
+		if ( FAILED ( stream.decoder->ReadSample ( &frame.sample, &frame.timeStamp ) ) )
+			continue;
+
+		if ( nullptr == frame.sample )
+			break;
+
+		frame.stream = &stream;
+		frame.lane = lane;
+		lane = stream.lane;
+
+		// Blocks while the archive waits on too many images ahead of it
+		frame.sequence = 0;
+		if ( order != nullptr && !order->Acquire ( frame.sequence ) )
+			break;
+
+		// Blocks while the encode lane is full
+		uint64_t readedTimeStamp = frame.timeStamp, sequence = frame.sequence;
+		if ( !writer.Push ( std::move ( frame ) ) )
+		{
+			if ( order != nullptr )
+				order->Abandon ( sequence );
+			break;
+		}
+
+		if ( InterlockedIncrement ( &g_submittedFrames ) == WARM_UP_FRAMES )
+			g_warmAllocationCount = GetAllocationCount ();
+
+		// A followed recording keeps growing past the duration known at open time
+		if ( stream.duration != 0 && !g_followMode )
+		{
+			InterlockedExchange ( &stream.progress, ( LONG ) ( readedTimeStamp * 10000 / stream.duration ) );
+
+			LONGLONG progress = 0;
+			for ( SushiStream & s : streams )
+				progress += InterlockedCompareExchange ( &s.progress, 0, 0 );
+			g_progress = progress / 10000.0 / streams.size ();
+		}
+	}
+
+	// Stop the shared demuxer from queueing packets nobody reads anymore
+	stream.decoder.Release ();
+}
+
 DWORD WINAPI DoSushi ( LPVOID ) noexcept
 {
+	// The low-latency path encodes its first frame on this thread
+	CoInitializeEx ( nullptr, COINIT_MULTITHREADED );
+
+	QueryPerformanceCounter ( &g_jobStarted );
+	g_timeToFirstFrame = -1;
+	g_submittedFrames = 0;
+	g_encodedFrames = 0;
+	g_encodedBytes = 0;
+	g_verifyFailures = 0;
+	g_warmAllocationCount = 0;
+	g_steadyAllocationCount = 0;
+
 	CComPtr<IVideoDecoder> videoDecoder;
 	//if ( FAILED ( CreateMediaFoundationVideoDecoder ( &videoDecoder ) ) )
 	if ( FAILED ( CreateFFmpegVideoDecoder ( &videoDecoder ) ) )
@@ -134,62 +670,443 @@ DWORD WINAPI DoSushi ( LPVOID ) noexcept
 		return -1;
 	}
 
-	if ( FAILED ( videoDecoder->Initialize ( g_openedVideoFile.c_str () ) ) )
+	VideoDecoderSettings decoderSettings = { 0, };
+	decoderSettings.follow = g_followMode;
+	decoderSettings.followIdleTimeout = g_followIdleTimeout;
+	decoderSettings.cancelEvent = g_cancel.GetWaitHandle ();
+	decoderSettings.streams = g_streams.data ();
+	decoderSettings.streamCount = ( uint32_t ) g_streams.size ();
+	decoderSettings.allVideoStreams = g_allVideoStreams;
+	decoderSettings.probeSize = g_probeSize;
+	decoderSettings.analyzeDuration = g_analyzeDuration;
+	decoderSettings.probeCacheDirectory = g_probeCacheDirectory.empty () ? nullptr : g_probeCacheDirectory.c_str ();
+	decoderSettings.minimalProbing = g_lowLatency;
+	decoderSettings.nodeLocalBuffers = g_nodeLocalBuffers;
+	// The FFmpeg encoders take the decoded planes and do any colour conversion themselves
+	ImageEncoderSettings formatSettings;
+	GetImageEncoderSettings ( &formatSettings );
+	decoderSettings.planarOutput = ImageEncoderTakesPlanar ( &formatSettings );
+
+	// Size both stages to the processors we may actually use rather than every processor in the machine
+	CpuTopology topology;
+	if ( FAILED ( QueryCpuTopology ( &topology ) ) )
 	{
-		ErrorExit ( nullptr, -5 );
-		return -1;
+		topology.processorCount = topology.usableCount = std::thread::hardware_concurrency ();
+		topology.cores.clear ();
 	}
 
-	uint64_t duration;
-	if ( FAILED ( videoDecoder->GetDuration ( &duration ) ) )
+	// Both stages share one fixed budget: a share of it goes to the codec threads of all streams
+	// together, split among them by the decoder once it knows how many it opened, and the encode
+	// pool gets the rest. The balancer can still park encode workers to lend their cores to decoding.
+	uint32_t decodeBudget = ( std::max ) ( topology.usableCount / DECODE_BUDGET_SHARE, 1u );
+	uint32_t encodeBudget = topology.usableCount > decodeBudget ? topology.usableCount - decodeBudget : 1;
+	decoderSettings.decoderThreads = decodeBudget;
+	if ( g_lowLatency && decoderSettings.probeSize == 0 )
+		decoderSettings.probeSize = 32 * 1024;
+	if ( g_lowLatency && decoderSettings.analyzeDuration == 0 )
+		decoderSettings.analyzeDuration = 100 * 1000;
+
+	if ( FAILED ( videoDecoder->Initialize ( g_openedVideoFile.c_str (), &decoderSettings ) ) )
 	{
 		ErrorExit ( nullptr, -5 );
 		return -1;
 	}
 
-	uint32_t width, height, stride;
-	if ( FAILED ( videoDecoder->GetVideoSize ( &width, &height, &stride ) ) )
+	uint32_t streamCount;
+	if ( FAILED ( videoDecoder->GetStreamCount ( &streamCount ) ) )
 	{
 		ErrorExit ( nullptr, -5 );
 		return -1;
 	}
-	
+
+	std::vector<SushiStream> streams ( streamCount );
+	for ( uint32_t i = 0; i < streamCount; ++i )
+	{
+		SushiStream & stream = streams [ i ];
+		stream.index = i;
+		stream.progress = 0;
+		stream.affinity = 0;
+		stream.lane = ThreadPool::defaultLane;
+
+		if ( FAILED ( videoDecoder->GetStreamDecoder ( i, &stream.decoder ) ) )
+		{
+			ErrorExit ( nullptr, -5 );
+			return -1;
+		}
+
+		if ( FAILED ( stream.decoder->GetDuration ( &stream.duration ) ) )
+		{
+			ErrorExit ( nullptr, -5 );
+			return -1;
+		}
+
+		if ( FAILED ( stream.decoder->GetVideoSize ( &stream.width, &stream.height, &stream.stride ) ) )
+		{
+			ErrorExit ( nullptr, -5 );
+			return -1;
+		}
+
+		stream.saveTo = g_saveTo;
+		if ( streamCount > 1 )
+		{
+			uint32_t streamId;
+			if ( FAILED ( stream.decoder->GetStreamId ( &streamId ) ) )
+				streamId = i;
+
+			wchar_t streamDirectory [ 32 ], outputPath [ MAX_PATH ];
+			wsprintf ( streamDirectory, TEXT ( "Stream %u" ), streamId );
+			PathCombine ( outputPath, g_saveTo.c_str (), streamDirectory );
+			stream.saveTo = outputPath;
+			if ( g_archiveFormat != IAF_NONE )
+				stream.archivePrefix = std::wstring ( streamDirectory ) + TEXT ( "/" );
+			else
+				CreateDirectory ( outputPath, nullptr );
+		}
+	}
+	videoDecoder.Release ();
+
+	CpuAssignment assignment;
+	AssignProcessors ( &topology, g_cpuPlacement, streamCount, encodeBudget, &assignment );
+	if ( assignment.encoders.empty () )
+		assignment.encoders.push_back ( 0 );
+	for ( uint32_t i = 0; i < streamCount && i < assignment.decoders.size (); ++i )
+		streams [ i ].affinity = assignment.decoders [ i ];
+
+	// Frames past 4K UHD are each split across several workers so each comes out sooner, for the
+	// encoders that can split an image at all. The split borrows idle workers of the full pool, so
+	// the pool keeps one worker per processor either way; JPEG XL borrows from all of them.
+	g_jobImageThreads = ImageEncoderSplitsImages ( &formatSettings ) ? g_imageThreads : 1;
+	if ( g_saveFileFormat == SFF_JXL )
+		g_jobImageThreads = ( uint32_t ) assignment.encoders.size ();
+	else if ( g_jobImageThreads == 0 )
+	{
+		g_jobImageThreads = 1;
+		for ( const SushiStream & stream : streams )
+			if ( ( uint64_t ) stream.width * stream.height > LARGE_IMAGE_PIXELS )
+				g_jobImageThreads = LARGE_IMAGE_THREADS;
+	}
+	g_jobImageThreads = ( std::max ) ( ( std::min ) ( g_jobImageThreads, ( uint32_t ) assignment.encoders.size () ), 1u );
+
 	g_progress = 0;
 	g_isStarted = true;
 
+	// Decode and write the first frame inline, ahead of the pool spin-up and the frame queue. An archive
+	// takes its entries in order from the archive stage only.
+	wchar_t firstImagePath [ MAX_PATH ];
+	bool firstImageWritten = false;
+	if ( g_lowLatency && g_archiveFormat == IAF_NONE && !g_cancel.IsCancelled () )
+	{
+		SushiStream & stream = streams [ 0 ];
+
+		uint64_t readedTimeStamp = 0;
+		CComPtr<IVideoSample> readedSample;
+
+		// One try only; a stream that fails to decode is left to its decode stage instead of retried here
+		if ( SUCCEEDED ( stream.decoder->ReadSample ( &readedSample, &readedTimeStamp ) ) && nullptr != readedSample )
+			firstImageWritten = EncodingImageToFile ( stream.saveTo.c_str (), readedSample, readedTimeStamp,
+				stream.width, stream.height, stream.stride, firstImagePath );
+	}
+
 	{
-		ThreadPool threadPool ( std::thread::hardware_concurrency () );
+		size_t workerCount = assignment.encoders.size ();
+		ThreadPool threadPool ( workerCount, workerCount * 4,
+			[ &assignment, &threadPool ] ( size_t index )
+			{
+				return InitializeEncodeWorker ( index, assignment.encoders [ index ], &threadPool );
+			},
+			UninitializeEncodeWorker );
 
-		while ( g_isStarted )
+		// Streams share the workers evenly instead of in proportion to how fast they decode. Past the
+		// pool's last lane, streams take turns joining the lanes already handed out.
+		for ( size_t i = 1; i < streams.size (); ++i )
 		{
-			if ( threadPool.taskSize () >= std::thread::hardware_concurrency () * 4 )
+			size_t lane = threadPool.addLane ( 1 );
+			streams [ i ].lane = lane != ThreadPool::noLane ? lane
+				: streams [ i % ( threadPool.laneCount () - ThreadPool::defaultLane ) ].lane;
+		}
+
+		std::unique_ptr<StageBalancer> balancer;
+		if ( g_balanceStages )
+			balancer.reset ( new StageBalancer ( threadPool, &g_submittedFrames, &g_encodedFrames ) );
+
+		// Every stream decodes in a stage of its own while sharing one demux pass; all of them feed
+		// the encode stage on the pool, which encodes into memory and leaves the disk to the write
+		// stage. Cancelling drops the frames and images still queued, and running encoders stop at
+		// their next row band, so no partial image reaches the disk.
+		// An archive takes the place of the write stage: encoders finish out of order, so the images
+		// pass a reorder buffer on their way to a single archive stage that appends them in decode order.
+		ImageArchive archive;
+		EncodedImagePool archivePool;
+		ImageEncoderSettings jobSettings;
+		GetImageEncoderSettings ( &jobSettings );
+		ImageEncoderCodec archiveCodec = jobSettings.codecType;
+		wchar_t archivePath [ MAX_PATH ];
+		if ( g_archiveFormat != IAF_NONE )
+		{
+			PathCombine ( archivePath, g_saveTo.c_str (), g_archiveFormat == IAF_ZIP ? TEXT ( "frames.zip" )
+				: ( g_archiveFormat == IAF_TAR ? TEXT ( "frames.tar" ) : TEXT ( "frames.pack" ) ) );
+			if ( FAILED ( archive.Open ( archivePath, g_archiveFormat ) ) )
 			{
-				Sleep ( 1 );
-				continue;
+				ErrorExit ( nullptr, -5 );
+				return -1;
 			}
+		}
+
+		Pipeline pipeline ( &g_cancel );
+		ImageWriter * imageWriter = nullptr;
+		ReorderBuffer<ArchiveImage> * order = nullptr;
+		PipelineInlet<SushiFrame> * encode;
+		if ( g_archiveFormat != IAF_NONE )
+		{
+			order = pipeline.AddConnection<ReorderBuffer<ArchiveImage>> ( ( std::max ) ( workerCount * 8, ( size_t ) 16 ), g_dirtyBudget );
+			encode = pipeline.AddPoolSink<SushiFrame> ( TEXT ( "encode" ), threadPool,
+				[] ( const SushiFrame & frame ) { return frame.lane; },
+				[ order, &archivePool ] ( SushiFrame & frame )
+				{
+					ArchiveImage archived;
+					archived.stream = frame.stream;
+					archived.timeStamp = frame.timeStamp;
+					archived.image = archivePool.Acquire ();
+					if ( !EncodingImage ( frame.sample, frame.stream->width, frame.stream->height, frame.stream->stride, archived.image,
+						&archived.width, &archived.height ) )
+					{
+						archivePool.Recycle ( archived.image );
+						order->Abandon ( frame.sequence );
+						return;
+					}
 
-			uint64_t readedTimeStamp = 0;
-			CComPtr<IVideoSample> readedSample;
+					// Checksummed here, in parallel, rather than on the archive stage
+					archived.crc = g_archiveFormat != IAF_TAR ? ImageArchive::Checksum ( archived.image->data, archived.image->size ) : 0;
+					uint64_t bytes = archived.image->capacity;
+					order->Complete ( frame.sequence, std::move ( archived ), bytes );
+				}, order );
+			pipeline.AddSink<ArchiveImage> ( TEXT ( "archive" ), 1, order, [ &archive, &archivePool, archiveCodec ] ( ArchiveImage & archived )
+			{
+				wchar_t name [ MAX_PATH ];
+				lstrcpyn ( name, archived.stream->archivePrefix.c_str (), MAX_PATH - 64 );
+				ConvertTimeStamp ( archived.timeStamp, GetImageExtension (), name + lstrlen ( name ) );
+
+				ImageArchiveEntry entry;
+				entry.name = name;
+				entry.crc = archived.crc;
+				entry.timeStamp = ( int64_t ) archived.timeStamp;
+				entry.stream = archived.stream->index;
+				entry.codec = archiveCodec;
+				entry.width = archived.width;
+				entry.height = archived.height;
+				HRESULT hr = archive.Append ( entry, archived.image );
+				archivePool.Recycle ( archived.image );
+				ImageWritten ( hr );
+			} );
+		}
+		else
+		{
+			ImageWriterSettings writerSettings;
+			writerSettings.dirtyBudget = g_dirtyBudget;
+			writerSettings.flushPolicy = g_flushPolicy;
+			writerSettings.queueDepth = g_writeQueueDepth;
+			writerSettings.unbuffered = g_unbufferedWrites;
+			writerSettings.completed = ImageWritten;
+			imageWriter = pipeline.AddConnection<ImageWriter> ( writerSettings );
+			if ( firstImageWritten )
+				imageWriter->AddWritten ( firstImagePath );
+			encode = pipeline.AddPoolSink<SushiFrame> ( TEXT ( "encode" ), threadPool,
+				[] ( const SushiFrame & frame ) { return frame.lane; },
+				[ imageWriter ] ( SushiFrame & frame )
+				{
+					ImageWrite write;
+					write.image = imageWriter->AcquireBuffer ();
+					GetImagePath ( frame.stream->saveTo.c_str (), frame.timeStamp, write.path );
+
+					// Blocks while the write stage is behind by the whole dirty budget
+					EncodedImage * image = write.image;
+					if ( !EncodingImage ( frame.sample, frame.stream->width, frame.stream->height, frame.stream->stride, image )
+						|| !imageWriter->Push ( std::move ( write ) ) )
+						imageWriter->RecycleBuffer ( image );
+				}, imageWriter );
+			pipeline.AddSink<ImageWrite> ( TEXT ( "write" ), g_writerThreads, imageWriter, [ imageWriter ] ( ImageWrite & write )
+			{
+				imageWriter->Write ( write );
+			} );
+		}
+		for ( size_t i = 0; i < streams.size (); ++i )
+		{
+			wchar_t name [ 32 ];
+			wsprintf ( name, TEXT ( "decode %u" ), ( UINT ) i );
+			pipeline.AddSource<SushiFrame> ( name, 1, encode, [ &streams, i, order ] ( size_t, PipelineWriter<SushiFrame> & writer )
+			{
+				SliceStream ( streams, i, writer, order );
+			} );
+		}
 
-			if ( FAILED ( videoDecoder->ReadSample ( &readedSample, &readedTimeStamp ) ) )
-				continue;
+		HRESULT runResult = pipeline.Run ();
+		if ( g_submittedFrames > WARM_UP_FRAMES )
+			g_steadyAllocationCount = GetAllocationCount () - g_warmAllocationCount;
+		if ( imageWriter != nullptr )
+		{
+			imageWriter->Drain ();
+			if ( SUCCEEDED ( runResult ) && g_flushPolicy == IFP_END_OF_JOB )
+				imageWriter->Flush ();
+		}
+		else
+		{
+			// A cancelled job still leaves a readable archive of the images that made it in
+			HRESULT archiveResult = archive.Close ();
+
+			wchar_t message [ 192 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: archived %u images, %u KB, %u held for reordering at peak in %u KB, result 0x%08X\n" ),
+				( UINT ) archive.GetEntryCount (), ( UINT ) ( archive.GetSize () / 1024 ), ( UINT ) order->GetPeakHeld (),
+				( UINT ) ( order->GetPeakHeldBytes () / 1024 ), ( UINT ) archiveResult );
+			OutputDebugString ( message );
+		}
 
-			if ( nullptr == readedSample )
-				break;
+		for ( size_t stage = 0; stage < pipeline.GetStageCount (); ++stage )
+		{
+			PipelineStageStats stats = pipeline.GetStageStats ( stage );
+			wchar_t message [ 160 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: stage %s handled %u items, busy %u ms, waited %u ms for input and %u ms for output\n" ),
+				stats.name, ( UINT ) stats.items, stats.busyTime, stats.inputWaitTime, stats.outputWaitTime );
+			OutputDebugString ( message );
+		}
 
-			auto result = threadPool.enqueue ( EncodingImageToFile,
-				readedSample.Detach (), readedTimeStamp,
-				width, height, stride );
-			
-			g_progress = ( readedTimeStamp / 10000 ) / ( double ) ( duration / 10000 );
+		// One line per run; runs at different PNG levels or JPEG qualities make up a size/speed table
+		if ( g_encodedFrames > 0 )
+		{
+			PipelineStageStats stats = pipeline.GetStageStats ( 0 );
+			wchar_t message [ 160 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: format %d level %d wrote %d images, %u KB each, %u images per busy second\n" ),
+				( int ) g_saveFileFormat, g_saveFileFormat == SFF_PNG ? g_pngCompressionLevel : -1, g_encodedFrames,
+				( UINT ) ( g_encodedBytes / g_encodedFrames / 1024 ),
+				( UINT ) ( stats.busyTime > 0 ? ( uint64_t ) g_encodedFrames * 1000 / stats.busyTime : 0 ) );
+			OutputDebugString ( message );
+		}
+		if ( imageWriter != nullptr )
+		{
+			wchar_t message [ 128 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: write-behind peaked at %u of %u KB dirty, flush policy %d\n" ),
+				( UINT ) ( imageWriter->GetPeakDirtyBytes () / 1024 ), ( UINT ) ( imageWriter->GetDirtyBudget () / 1024 ),
+				( int ) g_flushPolicy );
+			OutputDebugString ( message );
+		}
+		if ( imageWriter != nullptr )
+		{
+			// Files per power-of-two latency band, from opening to closing them
+			uint64_t buckets [ IMAGE_WRITE_LATENCY_BUCKETS ];
+			imageWriter->GetLatencyHistogram ( buckets );
+
+			wchar_t message [ 1024 ];
+			int length = wsprintf ( message, TEXT ( "VideoSlicer: %s writes," ),
+				imageWriter->IsOverlapped () ? ( g_unbufferedWrites ? TEXT ( "unbuffered overlapped" ) : TEXT ( "overlapped" ) )
+				: TEXT ( "synchronous" ) );
+			for ( int bucket = 0; bucket < IMAGE_WRITE_LATENCY_BUCKETS; ++bucket )
+				if ( buckets [ bucket ] > 0 )
+					length += wsprintf ( message + length, TEXT ( " <%u us: %u" ), 2u << bucket, ( UINT ) buckets [ bucket ] );
+			wsprintf ( message + length, TEXT ( "\n" ) );
+			OutputDebugString ( message );
+		}
+		if ( g_verifyImages && g_saveFileFormat == SFF_QOI )
+		{
+			wchar_t message [ 96 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: %d of %d images failed verification\n" ), g_verifyFailures, g_encodedFrames );
+			OutputDebugString ( message );
 		}
+
+		for ( size_t lane = 0; lane < threadPool.laneCount (); ++lane )
+		{
+			ThreadPool::LaneStats stats = threadPool.laneStats ( lane );
+			wchar_t message [ 96 ];
+			wsprintf ( message, TEXT ( "VideoSlicer: lane %u started %u tasks, peak depth %u\n" ),
+				( UINT ) lane, ( UINT ) stats.started, ( UINT ) stats.peak );
+			OutputDebugString ( message );
+		}
+	}
+
+	if ( g_cancel.IsCancelled () )
+	{
+		wchar_t message [ 64 ];
+		wsprintf ( message, TEXT ( "VideoSlicer: cancel to idle %d ms\n" ), ElapsedMilliseconds ( g_cancel.GetRequestTime () ) );
+		OutputDebugString ( message );
+	}
+
+	if ( g_submittedFrames > WARM_UP_FRAMES )
+	{
+		wchar_t message [ 128 ];
+		wsprintf ( message, TEXT ( "VideoSlicer: %u allocations over %d frames after warm-up\n" ),
+			( UINT ) g_steadyAllocationCount, g_submittedFrames - WARM_UP_FRAMES );
+		OutputDebugString ( message );
 	}
 
 	g_progress = 1;
 
+	CoUninitialize ();
+
 	return 0;
 }
 
+// Runs a whole job into the work directory and checks that no frame after warm-up allocates. The
+// job runs on a thread of its own, as it does from the dialog, and writes loose files: an archive
+// grows its index with every image by design.
+HRESULT BenchmarkAllocations ( BenchmarkReport & report, LPCWSTR workDirectory ) noexcept
+{
+	if ( !IsAllocationCountEnabled () )
+	{
+		report.Check ( false, TEXT ( "alloc: this build does not count allocations, define VIDEOSLICER_COUNT_ALLOCATIONS" ) );
+		return E_NOTIMPL;
+	}
+
+	g_saveTo = workDirectory;
+	g_archiveFormat = IAF_NONE;
+
+	HANDLE thread = CreateThread ( nullptr, 0, DoSushi, nullptr, 0, nullptr );
+	if ( thread == nullptr )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+	WaitForSingleObject ( thread, INFINITE );
+	DWORD exitCode = 0;
+	GetExitCodeThread ( thread, &exitCode );
+	CloseHandle ( thread );
+	if ( exitCode != 0 )
+		return E_FAIL;
+
+	report.Print ( TEXT ( "alloc: %s, %d frames encoded, %d of them warm-up" ), PathFindFileName ( g_openedVideoFile.c_str () ),
+		g_encodedFrames, WARM_UP_FRAMES );
+	report.Check ( g_submittedFrames > WARM_UP_FRAMES, TEXT ( "alloc: the video runs past warm-up" ) );
+	report.Check ( g_steadyAllocationCount == 0, TEXT ( "alloc: %u allocations over %d frames after warm-up" ),
+		( UINT ) g_steadyAllocationCount, g_submittedFrames - WARM_UP_FRAMES );
+	return S_OK;
+}
+
+// Exits with zero only when every check of the benchmark passed
+int RunBenchmark () noexcept
+{
+	BenchmarkReport report;
+	if ( FAILED ( report.Open ( g_benchmarkReport.c_str () ) ) )
+		return -1;
+
+	wchar_t workDirectory [ MAX_PATH ];
+	if ( !g_saveTo.empty () )
+		lstrcpyn ( workDirectory, g_saveTo.c_str (), MAX_PATH );
+	else
+		GetTempPath ( MAX_PATH, workDirectory );
+
+	HRESULT hr = E_INVALIDARG;
+	if ( _wcsicmp ( g_benchmark.c_str (), TEXT ( "follow" ) ) == 0 )
+		hr = BenchmarkFollow ( report, g_openedVideoFile.c_str (), workDirectory );
+	else if ( _wcsicmp ( g_benchmark.c_str (), TEXT ( "alloc" ) ) == 0 )
+		hr = BenchmarkAllocations ( report, workDirectory );
+	else if ( _wcsicmp ( g_benchmark.c_str (), TEXT ( "threadpool" ) ) == 0 )
+		hr = BenchmarkThreadPool ( report );
+	else if ( _wcsicmp ( g_benchmark.c_str (), TEXT ( "encoders" ) ) == 0 )
+		hr = BenchmarkEncoders ( report, g_openedVideoFile.c_str () );
+	else if ( _wcsicmp ( g_benchmark.c_str (), TEXT ( "framereads" ) ) == 0 )
+		hr = BenchmarkFrameReads ( report, g_openedVideoFile.c_str (), workDirectory, g_readBenchmarkCount );
+	else
+		report.Print ( TEXT ( "unknown benchmark %s" ), g_benchmark.c_str () );
+
+	bool passed = SUCCEEDED ( hr ) && report.HasPassed ();
+	report.Close ();
+	return passed ? 0 : 1;
+}
+
 int WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE, LPSTR, int )
 {
 #ifdef _DEBUG
@@ -206,6 +1123,15 @@ int WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE, LPSTR, int )
 	if ( FAILED ( CoInitializeEx ( nullptr, COINIT_APARTMENTTHREADED ) ) )
 		return -1;
 
+	ParseCommandLine ();
+
+	if ( !g_benchmark.empty () )
+	{
+		int exitCode = RunBenchmark ();
+		CoUninitialize ();
+		return exitCode;
+	}
+
 	HICON hIcon = LoadIcon ( hInstance, MAKEINTRESOURCE ( IDI_MAIN_ICON ) );
 
 	TASKDIALOG_BUTTON buttonArray [] =
@@ -219,6 +1145,10 @@ int WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE, LPSTR, int )
 		{ 202, TEXT ( "JPEG로 저장하기(100% 화질)" ) },
 		{ 203, TEXT ( "JPEG로 저장하기(80% 화질)" ) },
 		{ 204, TEXT ( "JPEG로 저장하기(60% 화질)" ) },
+		{ 205, TEXT ( "QOI로 저장하기(무손실, 빠름)" ) },
+#ifdef VIDEOSLICER_JXL
+		{ 206, TEXT ( "JPEG XL로 저장하기(무손실)" ) },
+#endif
 	};
 
 	TASKDIALOGCONFIG mainConfig = { 0, };
@@ -342,8 +1272,9 @@ int WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE, LPSTR, int )
 
 						if ( ::g_thread != NULL )
 						{
-							g_isStarted = false;
+							g_cancel.Cancel ();
 							WaitForSingleObject ( g_thread, INFINITE );
+							g_isStarted = false;
 						}
 					}
 				}
@@ -378,6 +1309,14 @@ int WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE, LPSTR, int )
 						taskDialog.pszWindowTitle = TEXT ( "안내" );
 						taskDialog.pszMainInstruction = TEXT ( "작업이 완료되었습니다." );
 						taskDialog.pszContent = TEXT ( "작업이 완료되어 프로그램을 종료합니다." );
+
+						static wchar_t content [ 256 ];
+						if ( ::g_timeToFirstFrame >= 0 )
+						{
+							wsprintf ( content, TEXT ( "%s\n첫 이미지까지 걸린 시간: %d ms" ),
+								taskDialog.pszContent, ::g_timeToFirstFrame );
+							taskDialog.pszContent = content;
+						}
 						taskDialog.dwCommonButtons = TDCBF_OK_BUTTON;
 						SendMessage ( hWnd, TDM_NAVIGATE_PAGE, 0, ( LPARAM ) &taskDialog );
 					}
@@ -0,0 +1,125 @@
+#include "Pipeline.h"
+
+Pipeline::Pipeline ( const CancellationToken * token )
+	: _token ( token )
+	, _cancelled ( false )
+	, _finishedStages ( 0 )
+	, _finished ( CreateEvent ( nullptr, TRUE, FALSE, nullptr ) )
+{
+
+}
+
+Pipeline::~Pipeline ()
+{
+	for ( std::unique_ptr<Stage> & stage : _stages )
+		for ( std::thread & thread : stage->threads )
+			if ( thread.joinable () )
+				thread.join ();
+
+	if ( _finished != nullptr )
+		CloseHandle ( _finished );
+}
+
+size_t Pipeline::CreateStage ( LPCWSTR name, size_t workers, PipelineConnection * output )
+{
+	std::unique_ptr<Stage> stage ( new Stage );
+	stage->name = name;
+	stage->workers = workers;
+	stage->output = output;
+	stage->outstanding = workers;
+	stage->items = 0;
+	stage->busyTicks = stage->inputWaitTicks = stage->outputWaitTicks = 0;
+
+	if ( output != nullptr )
+		output->AddWriter ();
+
+	_stages.push_back ( std::move ( stage ) );
+	return _stages.size () - 1;
+}
+
+void Pipeline::Release ( size_t stage )
+{
+	if ( --_stages [ stage ]->outstanding == 0 )
+		Finish ( stage );
+}
+
+// The stage's end of stream becomes its output's; the last stage to finish ends the run
+void Pipeline::Finish ( size_t stage )
+{
+	if ( _stages [ stage ]->output != nullptr )
+		_stages [ stage ]->output->RemoveWriter ();
+
+	if ( ++_finishedStages == _stages.size () )
+		SetEvent ( _finished );
+}
+
+uint64_t Pipeline::Account ( size_t stage, std::atomic<uint64_t> Stage::* counter, const LARGE_INTEGER & since )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter ( &now );
+	uint64_t elapsed = now.QuadPart - since.QuadPart;
+	( ( *_stages [ stage ] ).*counter ) += elapsed;
+	return elapsed;
+}
+
+HRESULT Pipeline::Run ()
+{
+	if ( _finished == nullptr )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+	if ( _stages.empty () )
+		return S_OK;
+
+	// A pool stage nobody writes to has nothing to wait for
+	for ( size_t i = 0; i < _stages.size (); ++i )
+		if ( _stages [ i ]->workers == 0 && _stages [ i ]->outstanding == 0 )
+			Finish ( i );
+
+	for ( size_t i = 0; i < _stages.size (); ++i )
+	{
+		for ( size_t worker = 0; worker < _stages [ i ]->workers; ++worker )
+		{
+			_stages [ i ]->threads.emplace_back ( [ this, i, worker ]
+			{
+				_stages [ i ]->body ( worker );
+				Release ( i );
+			} );
+		}
+	}
+
+	HANDLE handles [ 2 ] = { _finished, _token != nullptr ? _token->GetWaitHandle () : nullptr };
+	if ( WaitForMultipleObjects ( handles [ 1 ] != nullptr ? 2 : 1, handles, FALSE, INFINITE ) == WAIT_OBJECT_0 + 1 )
+	{
+		Cancel ();
+		WaitForSingleObject ( _finished, INFINITE );
+	}
+
+	for ( std::unique_ptr<Stage> & stage : _stages )
+		for ( std::thread & thread : stage->threads )
+			thread.join ();
+
+	return IsCancelled () ? E_ABORT : S_OK;
+}
+
+void Pipeline::Cancel ()
+{
+	if ( _cancelled.exchange ( true ) )
+		return;
+
+	for ( std::unique_ptr<PipelineConnection> & connection : _connections )
+		connection->Cancel ();
+}
+
+PipelineStageStats Pipeline::GetStageStats ( size_t stage ) const
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency ( &frequency );
+
+	const Stage & s = *_stages [ stage ];
+	PipelineStageStats stats;
+	stats.name = s.name.c_str ();
+	stats.items = s.items;
+	stats.busyTime = ( uint32_t ) ( s.busyTicks * 1000 / frequency.QuadPart );
+	stats.inputWaitTime = ( uint32_t ) ( s.inputWaitTicks * 1000 / frequency.QuadPart );
+	stats.outputWaitTime = ( uint32_t ) ( s.outputWaitTicks * 1000 / frequency.QuadPart );
+	return stats;
+}
@@ -0,0 +1,442 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <Windows.h>
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <atomic>
+
+#include "ThreadPool.h"
+#include "CancellationToken.h"
+
+class Pipeline;
+
+struct PipelineStageStats
+{
+	LPCWSTR name;
+	uint64_t items;
+	// Milliseconds summed over the stage's workers: running stage code, waiting for an item,
+	// and waiting for room downstream
+	uint32_t busyTime, inputWaitTime, outputWaitTime;
+};
+
+// Anything a stage can deliver items to. The pipeline counts the stages writing to it;
+// when the last one finishes, the connection sees the end of its stream.
+class PipelineConnection
+{
+public:
+	virtual ~PipelineConnection () { }
+
+protected:
+	friend class Pipeline;
+	virtual void AddWriter () = 0;
+	virtual void RemoveWriter () = 0;
+	virtual void Cancel () = 0;
+};
+
+template<class T>
+class PipelineInlet : public PipelineConnection
+{
+public:
+	// Blocks while the receiving stage is saturated; false once the pipeline is cancelled
+	virtual bool Push ( T && item ) = 0;
+};
+
+// Anything a stage can take items from
+template<class T>
+class PipelineOutlet
+{
+public:
+	virtual ~PipelineOutlet () { }
+	// Blocks until an item arrives; false at the end of the stream or once cancelled
+	virtual bool Pop ( T & item ) = 0;
+};
+
+// Bounded MPMC queue between stages
+template<class T>
+class Channel : public PipelineInlet<T>, public PipelineOutlet<T>
+{
+public:
+	explicit Channel ( size_t capacity );
+
+	bool Push ( T && item ) override;
+	bool Pop ( T & item ) override;
+
+private:
+	void AddWriter () override;
+	void RemoveWriter () override;
+	void Cancel () override;
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _readable, _writable;
+	std::vector<T> _items;
+	size_t _head, _count;
+	size_t _writers;
+	bool _cancelled;
+};
+
+// Hands a source stage's items downstream, accounting the time it waits there
+template<class T>
+class PipelineWriter
+{
+public:
+	bool Push ( T && item );
+	bool IsCancelled () const;
+
+private:
+	friend class Pipeline;
+	PipelineWriter ( Pipeline * pipeline, size_t stage, PipelineInlet<T> * output )
+		: _pipeline ( pipeline ), _stage ( stage ), _output ( output ), _waitTicks ( 0 ) { }
+
+	Pipeline * _pipeline;
+	size_t _stage;
+	PipelineInlet<T> * _output;
+	// time this worker spent in Push
+	uint64_t _waitTicks;
+};
+
+// Stages connected by bounded connections. Each stage runs on its own workers or as tasks on a
+// ThreadPool lane, and a full connection stalls the stages writing to it. Stages end when their
+// input stream ends; cancelling ends every stage early and drops what is still queued.
+class Pipeline
+{
+public:
+	explicit Pipeline ( const CancellationToken * token = nullptr );
+	~Pipeline ();
+
+	Pipeline ( const Pipeline & ) = delete;
+	Pipeline & operator= ( const Pipeline & ) = delete;
+
+public:
+	template<class T>
+	Channel<T> * AddChannel ( size_t capacity ) { return AddConnection<Channel<T>> ( capacity ); }
+	// Any other connection type, owned by the pipeline like its channels
+	template<class Connection, class... Args>
+	Connection * AddConnection ( Args&&... args );
+
+	// produce ( worker, writer ) runs once per worker and pushes items until its input is exhausted
+	template<class Out, class Produce>
+	void AddSource ( LPCWSTR name, size_t workers, PipelineInlet<Out> * output, Produce produce );
+	// transform ( in, out ) runs per item; returning false drops the item
+	template<class In, class Out, class Transform>
+	void AddStage ( LPCWSTR name, size_t workers, PipelineOutlet<In> * input, PipelineInlet<Out> * output, Transform transform );
+	// consume ( item ) runs per item
+	template<class In, class Consume>
+	void AddSink ( LPCWSTR name, size_t workers, PipelineOutlet<In> * input, Consume consume );
+	// consume ( item ) runs per item as a task on the lane ( item ) returns; the lane bound is the backpressure.
+	// output is whatever consume delivers to by itself; its stream ends when this stage's does
+	template<class In, class Lane, class Consume>
+	PipelineInlet<In> * AddPoolSink ( LPCWSTR name, ThreadPool & threadPool, Lane lane, Consume consume,
+		PipelineConnection * output = nullptr );
+
+	// Starts every stage and waits until all have finished. E_ABORT when cancelled.
+	HRESULT Run ();
+	void Cancel ();
+	bool IsCancelled () const { return _cancelled.load ( std::memory_order_acquire ); }
+
+	size_t GetStageCount () const { return _stages.size (); }
+	PipelineStageStats GetStageStats ( size_t stage ) const;
+
+private:
+	struct Stage
+	{
+		std::wstring name;
+		size_t workers;
+		std::function<void ( size_t worker )> body;
+		std::vector<std::thread> threads;
+		PipelineConnection * output;
+		// workers still running, or for pool stages writers still attached plus queued and running tasks
+		std::atomic<size_t> outstanding;
+
+		std::atomic<uint64_t> items;
+		std::atomic<uint64_t> busyTicks, inputWaitTicks, outputWaitTicks;
+	};
+
+	// Counts a pool stage's task from submission until it has run or was discarded
+	class Ticket
+	{
+	public:
+		Ticket ( Pipeline * pipeline, size_t stage ) : _pipeline ( pipeline ), _stage ( stage ) { }
+		Ticket ( Ticket && other ) noexcept : _pipeline ( other._pipeline ), _stage ( other._stage ) { other._pipeline = nullptr; }
+		~Ticket () { if ( _pipeline != nullptr ) _pipeline->Release ( _stage ); }
+
+		Ticket ( const Ticket & ) = delete;
+		Ticket & operator= ( const Ticket & ) = delete;
+
+	private:
+		Pipeline * _pipeline;
+		size_t _stage;
+	};
+
+	template<class In, class Lane, class Consume>
+	class PoolInlet;
+
+	size_t CreateStage ( LPCWSTR name, size_t workers, PipelineConnection * output );
+	void Release ( size_t stage );
+	void Finish ( size_t stage );
+	uint64_t Account ( size_t stage, std::atomic<uint64_t> Stage::* counter, const LARGE_INTEGER & since );
+
+	template<class T>
+	friend class PipelineWriter;
+
+private:
+	const CancellationToken * _token;
+	std::atomic<bool> _cancelled;
+
+	std::vector<std::unique_ptr<Stage>> _stages;
+	std::vector<std::unique_ptr<PipelineConnection>> _connections;
+
+	std::atomic<size_t> _finishedStages;
+	HANDLE _finished;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T>
+Channel<T>::Channel ( size_t capacity )
+	: _items ( capacity > 0 ? capacity : 1 ), _head ( 0 ), _count ( 0 ), _writers ( 0 ), _cancelled ( false )
+{
+
+}
+
+template<class T>
+bool Channel<T>::Push ( T && item )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_writable.wait ( lock, [ this ] { return _cancelled || _count < _items.size (); } );
+	if ( _cancelled )
+		return false;
+
+	_items [ ( _head + _count ) % _items.size () ] = std::move ( item );
+	++_count;
+
+	lock.unlock ();
+	_readable.notify_one ();
+	return true;
+}
+
+template<class T>
+bool Channel<T>::Pop ( T & item )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_readable.wait ( lock, [ this ] { return _cancelled || _count > 0 || _writers == 0; } );
+	if ( _cancelled || _count == 0 )
+		return false;
+
+	item = std::move ( _items [ _head ] );
+	_items [ _head ] = T ();
+	_head = ( _head + 1 ) % _items.size ();
+	--_count;
+
+	lock.unlock ();
+	_writable.notify_one ();
+	return true;
+}
+
+template<class T>
+void Channel<T>::AddWriter ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	++_writers;
+}
+
+template<class T>
+void Channel<T>::RemoveWriter ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		--_writers;
+	}
+	_readable.notify_all ();
+}
+
+template<class T>
+void Channel<T>::Cancel ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_cancelled = true;
+	}
+	_readable.notify_all ();
+	_writable.notify_all ();
+}
+
+template<class T>
+bool PipelineWriter<T>::Push ( T && item )
+{
+	LARGE_INTEGER started;
+	QueryPerformanceCounter ( &started );
+	bool pushed = !_pipeline->IsCancelled () && _output->Push ( std::move ( item ) );
+	_waitTicks += _pipeline->Account ( _stage, &Pipeline::Stage::outputWaitTicks, started );
+	if ( pushed )
+		++_pipeline->_stages [ _stage ]->items;
+	return pushed;
+}
+
+template<class T>
+bool PipelineWriter<T>::IsCancelled () const
+{
+	return _pipeline->IsCancelled ();
+}
+
+template<class In, class Lane, class Consume>
+class Pipeline::PoolInlet : public PipelineInlet<In>
+{
+public:
+	PoolInlet ( Pipeline * pipeline, size_t stage, ThreadPool & threadPool, Lane lane, Consume consume )
+		: _pipeline ( pipeline ), _stage ( stage ), _threadPool ( threadPool )
+		, _lane ( std::move ( lane ) ), _consume ( std::move ( consume ) ), _usedLanes ( 0 )
+	{
+
+	}
+
+	bool Push ( In && item ) override
+	{
+		if ( _pipeline->IsCancelled () )
+			return false;
+
+		++_pipeline->_stages [ _stage ]->outstanding;
+		size_t lane = _lane ( item );
+		if ( lane < 32 )
+			_usedLanes.fetch_or ( 1u << lane, std::memory_order_relaxed );
+		_threadPool.post ( lane, [ this, item = std::move ( item ), ticket = Ticket ( _pipeline, _stage ) ] () mutable
+		{
+			if ( _pipeline->IsCancelled () )
+				return;
+
+			LARGE_INTEGER started;
+			QueryPerformanceCounter ( &started );
+			_consume ( item );
+			_pipeline->Account ( _stage, &Stage::busyTicks, started );
+			++_pipeline->_stages [ _stage ]->items;
+		} );
+		return true;
+	}
+
+private:
+	void AddWriter () override { ++_pipeline->_stages [ _stage ]->outstanding; }
+	void RemoveWriter () override { _pipeline->Release ( _stage ); }
+	// Only the batch lanes we posted to are emptied; the interactive lane is everyone's. Our tasks
+	// left there or already in a worker's deque see the cancel when they run and drop their item.
+	void Cancel () override
+	{
+		uint32_t usedLanes = _usedLanes.load ( std::memory_order_relaxed );
+		for ( size_t lane = ThreadPool::defaultLane; lane < 32; ++lane )
+			if ( usedLanes & ( 1u << lane ) )
+				_threadPool.discard ( lane );
+	}
+
+private:
+	Pipeline * _pipeline;
+	size_t _stage;
+	ThreadPool & _threadPool;
+	Lane _lane;
+	Consume _consume;
+	// Bit per pool lane Push has posted to
+	std::atomic<uint32_t> _usedLanes;
+};
+
+template<class Connection, class... Args>
+Connection * Pipeline::AddConnection ( Args&&... args )
+{
+	Connection * connection = new Connection ( std::forward<Args> ( args )... );
+	_connections.emplace_back ( connection );
+	return connection;
+}
+
+template<class Out, class Produce>
+void Pipeline::AddSource ( LPCWSTR name, size_t workers, PipelineInlet<Out> * output, Produce produce )
+{
+	size_t stage = CreateStage ( name, workers, output );
+	_stages [ stage ]->body = [ this, stage, output, produce ] ( size_t worker )
+	{
+		LARGE_INTEGER started;
+		QueryPerformanceCounter ( &started );
+
+		PipelineWriter<Out> writer ( this, stage, output );
+		produce ( worker, writer );
+
+		// Everything the producer did not spend waiting downstream was its own work
+		LARGE_INTEGER finished;
+		QueryPerformanceCounter ( &finished );
+		_stages [ stage ]->busyTicks += finished.QuadPart - started.QuadPart - writer._waitTicks;
+	};
+}
+
+template<class In, class Out, class Transform>
+void Pipeline::AddStage ( LPCWSTR name, size_t workers, PipelineOutlet<In> * input, PipelineInlet<Out> * output, Transform transform )
+{
+	size_t stage = CreateStage ( name, workers, output );
+	_stages [ stage ]->body = [ this, stage, input, output, transform ] ( size_t )
+	{
+		for ( ;; )
+		{
+			LARGE_INTEGER started;
+			QueryPerformanceCounter ( &started );
+			In item;
+			bool popped = input->Pop ( item );
+			Account ( stage, &Stage::inputWaitTicks, started );
+			if ( !popped )
+				break;
+
+			QueryPerformanceCounter ( &started );
+			Out result;
+			bool keep = transform ( item, result );
+			Account ( stage, &Stage::busyTicks, started );
+			++_stages [ stage ]->items;
+			if ( !keep )
+				continue;
+
+			QueryPerformanceCounter ( &started );
+			bool pushed = output->Push ( std::move ( result ) );
+			Account ( stage, &Stage::outputWaitTicks, started );
+			if ( !pushed )
+				break;
+		}
+	};
+}
+
+template<class In, class Consume>
+void Pipeline::AddSink ( LPCWSTR name, size_t workers, PipelineOutlet<In> * input, Consume consume )
+{
+	size_t stage = CreateStage ( name, workers, nullptr );
+	_stages [ stage ]->body = [ this, stage, input, consume ] ( size_t )
+	{
+		for ( ;; )
+		{
+			LARGE_INTEGER started;
+			QueryPerformanceCounter ( &started );
+			In item;
+			bool popped = input->Pop ( item );
+			Account ( stage, &Stage::inputWaitTicks, started );
+			if ( !popped )
+				break;
+
+			QueryPerformanceCounter ( &started );
+			consume ( item );
+			Account ( stage, &Stage::busyTicks, started );
+			++_stages [ stage ]->items;
+		}
+	};
+}
+
+template<class In, class Lane, class Consume>
+PipelineInlet<In> * Pipeline::AddPoolSink ( LPCWSTR name, ThreadPool & threadPool, Lane lane, Consume consume,
+	PipelineConnection * output )
+{
+	size_t stage = CreateStage ( name, 0, output );
+	PoolInlet<In, Lane, Consume> * inlet = new PoolInlet<In, Lane, Consume> (
+		this, stage, threadPool, std::move ( lane ), std::move ( consume ) );
+	_connections.emplace_back ( inlet );
+	return inlet;
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef __REORDERBUFFER_H__
+#define __REORDERBUFFER_H__
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "Pipeline.h"
+
+// Takes items completed in any order and hands them to a sequential sink in sequence order.
+// Producers number their work with Acquire, which blocks while window sequences are unreleased or
+// while another sequence could take the bytes held back past a budget, so encoders keep running out
+// of order while the reordering stays bounded in both count and memory.
+// The stages that complete sequences are its writers; once they have all finished, sequences
+// nobody completed count as abandoned.
+template<class T>
+class ReorderBuffer : public PipelineConnection, public PipelineOutlet<T>
+{
+public:
+	// A byte budget of 0 bounds the window by count alone. Otherwise every sequence still out is
+	// counted at the size of the largest item so far, one at a time until the first item is in, and
+	// the held bytes stay within the budget give or take one item.
+	ReorderBuffer ( size_t window, uint64_t byteBudget );
+
+	// The next sequence number; false once cancelled
+	bool Acquire ( uint64_t & sequence );
+	// Every acquired sequence ends in exactly one of these; neither blocks. bytes is what the item
+	// holds on to until it is popped.
+	void Complete ( uint64_t sequence, T && item, uint64_t bytes );
+	void Abandon ( uint64_t sequence );
+
+	// The item of the next sequence, skipping abandoned ones
+	bool Pop ( T & item ) override;
+
+	// Most completed items, and most of their bytes, ever held back at once
+	size_t GetPeakHeld ();
+	uint64_t GetPeakHeldBytes ();
+
+private:
+	void AddWriter () override;
+	void RemoveWriter () override;
+	void Cancel () override;
+
+	void Resolve ( uint64_t sequence, bool ready, T * item, uint64_t bytes );
+
+private:
+	enum SlotState
+	{
+		RS_PENDING,
+		RS_READY,
+		RS_ABANDONED,
+	};
+
+	struct Slot
+	{
+		SlotState state;
+		T item;
+		uint64_t bytes;
+	};
+
+	std::mutex _mutex;
+	std::condition_variable _acquirable, _releasable;
+	std::vector<Slot> _slots;
+	// next sequence Acquire hands out and next sequence Pop releases
+	uint64_t _acquired, _released;
+	size_t _held, _peakHeld;
+	uint64_t _byteBudget, _heldBytes, _peakHeldBytes, _largestItem;
+	size_t _writers;
+	bool _cancelled;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T>
+ReorderBuffer<T>::ReorderBuffer ( size_t window, uint64_t byteBudget )
+	: _slots ( window > 0 ? window : 1 ), _acquired ( 0 ), _released ( 0 )
+	, _held ( 0 ), _peakHeld ( 0 ), _byteBudget ( byteBudget ), _heldBytes ( 0 ), _peakHeldBytes ( 0 ), _largestItem ( 0 )
+	, _writers ( 0 ), _cancelled ( false )
+{
+	for ( Slot & slot : _slots )
+	{
+		slot.state = RS_PENDING;
+		slot.bytes = 0;
+	}
+}
+
+template<class T>
+bool ReorderBuffer<T>::Acquire ( uint64_t & sequence )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	// With anything out the oldest sequence is among it, so what is held gets popped without this one
+	_acquirable.wait ( lock, [ this ] {
+		uint64_t outstanding = _acquired - _released - _held;
+		return _cancelled || ( _acquired < _released + _slots.size ()
+			&& ( _byteBudget == 0 || _acquired == _released
+				|| ( _largestItem != 0 && _heldBytes + ( outstanding + 1 ) * _largestItem <= _byteBudget ) ) );
+	} );
+	if ( _cancelled )
+		return false;
+
+	sequence = _acquired++;
+	return true;
+}
+
+template<class T>
+void ReorderBuffer<T>::Complete ( uint64_t sequence, T && item, uint64_t bytes )
+{
+	Resolve ( sequence, true, &item, bytes );
+}
+
+template<class T>
+void ReorderBuffer<T>::Abandon ( uint64_t sequence )
+{
+	Resolve ( sequence, false, nullptr, 0 );
+}
+
+template<class T>
+void ReorderBuffer<T>::Resolve ( uint64_t sequence, bool ready, T * item, uint64_t bytes )
+{
+	bool next;
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		Slot & slot = _slots [ sequence % _slots.size () ];
+		slot.state = ready ? RS_READY : RS_ABANDONED;
+		if ( ready )
+			slot.item = std::move ( *item );
+		slot.bytes = bytes;
+
+		next = sequence == _released;
+		if ( ++_held > _peakHeld )
+			_peakHeld = _held;
+		_heldBytes += bytes;
+		if ( _heldBytes > _peakHeldBytes )
+			_peakHeldBytes = _heldBytes;
+		if ( bytes > _largestItem )
+			_largestItem = bytes;
+	}
+
+	// Only the completion of the oldest sequence lets the sink move on; an item smaller than the
+	// largest one may leave room for another sequence
+	if ( next )
+		_releasable.notify_all ();
+	if ( _byteBudget != 0 )
+		_acquirable.notify_all ();
+}
+
+template<class T>
+bool ReorderBuffer<T>::Pop ( T & item )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	for ( ;; )
+	{
+		_releasable.wait ( lock, [ this ] {
+			return _cancelled || _writers == 0 || _slots [ _released % _slots.size () ].state != RS_PENDING;
+		} );
+		if ( _cancelled )
+			return false;
+
+		// with every writer gone, a sequence still pending never completes
+		Slot & slot = _slots [ _released % _slots.size () ];
+		if ( slot.state == RS_PENDING && _released == _acquired )
+			return false;
+
+		SlotState state = slot.state;
+		if ( state == RS_READY )
+		{
+			item = std::move ( slot.item );
+			slot.item = T ();
+		}
+		if ( state != RS_PENDING )
+			--_held;
+		_heldBytes -= slot.bytes;
+		slot.bytes = 0;
+		slot.state = RS_PENDING;
+		++_released;
+
+		lock.unlock ();
+		_acquirable.notify_all ();
+		if ( state == RS_READY )
+			return true;
+		lock.lock ();
+	}
+}
+
+template<class T>
+size_t ReorderBuffer<T>::GetPeakHeld ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	return _peakHeld;
+}
+
+template<class T>
+uint64_t ReorderBuffer<T>::GetPeakHeldBytes ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	return _peakHeldBytes;
+}
+
+template<class T>
+void ReorderBuffer<T>::AddWriter ()
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	++_writers;
+}
+
+template<class T>
+void ReorderBuffer<T>::RemoveWriter ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		--_writers;
+	}
+	_releasable.notify_all ();
+}
+
+template<class T>
+void ReorderBuffer<T>::Cancel ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_cancelled = true;
+	}
+	_acquirable.notify_all ();
+	_releasable.notify_all ();
+}
+
+#endif
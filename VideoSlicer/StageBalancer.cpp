@@ -0,0 +1,91 @@
+#include "StageBalancer.h"
+
+#define BALANCE_PERIOD 500
+
+StageBalancer::StageBalancer ( ThreadPool & threadPool,
+	const volatile LONG * decodedFrames, const volatile LONG * encodedFrames )
+	: _threadPool ( threadPool )
+	, _decodedFrames ( decodedFrames )
+	, _encodedFrames ( encodedFrames )
+	, _stop ( false )
+{
+	_thread = std::thread ( &StageBalancer::Run, this );
+}
+
+StageBalancer::~StageBalancer ()
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		_stop = true;
+	}
+	_condition.notify_all ();
+	_thread.join ();
+}
+
+void StageBalancer::Run ()
+{
+	LONG lastDecoded = *_decodedFrames, lastEncoded = *_encodedFrames;
+	// encode rate from before the last park, kept until the park has been judged
+	LONG parkedEncodeRate = -1;
+	int hold = 0;
+
+	std::unique_lock<std::mutex> lock ( _mutex );
+	while ( !_condition.wait_for ( lock, std::chrono::milliseconds ( BALANCE_PERIOD ), [ this ] { return _stop; } ) )
+	{
+		LONG decoded = *_decodedFrames, encoded = *_encodedFrames;
+		LONG decodeRate = ( decoded - lastDecoded ) * 1000 / BALANCE_PERIOD;
+		LONG encodeRate = ( encoded - lastEncoded ) * 1000 / BALANCE_PERIOD;
+		lastDecoded = decoded;
+		lastEncoded = encoded;
+
+		// the fullest batch lane; a full lane means its decoder is waiting on the encoders
+		size_t occupancy = 0;
+		for ( size_t lane = ThreadPool::defaultLane; lane < _threadPool.laneCount (); ++lane )
+		{
+			size_t queued = _threadPool.laneStats ( lane ).queued * 100 / _threadPool.taskCapacity ();
+			if ( queued > occupancy )
+				occupancy = queued;
+		}
+		size_t active = _threadPool.activeWorkers (), next = active;
+		LPCWSTR reason = nullptr;
+
+		// the period right after a change is skipped while the workers settle
+		if ( hold > 0 )
+		{
+			--hold;
+			continue;
+		}
+
+		// a slower source lowers the rate too, but then the queue stays empty
+		if ( parkedEncodeRate >= 0 && encodeRate < parkedEncodeRate * 9 / 10 && occupancy >= 25 )
+		{
+			next = active + 1;
+			reason = TEXT ( "parking cost encode throughput" );
+			hold = 4;
+		}
+		else if ( occupancy > 75 && active < _threadPool.workerCount () )
+		{
+			next = active + 1;
+			reason = TEXT ( "encoders are behind" );
+			hold = 1;
+		}
+		else if ( occupancy < 25 && active > 1 && decodeRate > 0 )
+		{
+			next = active - 1;
+			reason = TEXT ( "decoders are behind" );
+			hold = 1;
+		}
+
+		parkedEncodeRate = next < active ? encodeRate : -1;
+
+		if ( next == active )
+			continue;
+
+		_threadPool.setActiveWorkers ( next );
+
+		wchar_t message [ 160 ];
+		wsprintf ( message, TEXT ( "VideoSlicer: encode workers %u -> %u, %s (fullest lane %u%%, decode %d fps, encode %d fps)\n" ),
+			( UINT ) active, ( UINT ) next, reason, ( UINT ) occupancy, decodeRate, encodeRate );
+		OutputDebugString ( message );
+	}
+}
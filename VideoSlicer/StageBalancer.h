@@ -0,0 +1,36 @@
+#ifndef __STAGEBALANCER_H__
+#define __STAGEBALANCER_H__
+
+#include <Windows.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ThreadPool.h"
+
+// Moves processor budget between the decode threads and the encode workers while a job runs.
+// Each period it parks an encode worker when the encode queue runs dry, so the decoders get the
+// core, and unparks one when the queue backs up. A park that costs encode throughput is undone.
+class StageBalancer
+{
+public:
+	StageBalancer ( ThreadPool & threadPool,
+		const volatile LONG * decodedFrames, const volatile LONG * encodedFrames );
+	~StageBalancer ();
+
+private:
+	void Run ();
+
+private:
+	ThreadPool & _threadPool;
+	const volatile LONG * _decodedFrames;
+	const volatile LONG * _encodedFrames;
+
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	bool _stop;
+	std::thread _thread;
+};
+
+#endif
@@ -5,7 +5,6 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -13,96 +12,889 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <new>
+#include <cstdint>
 
 class ThreadPool {
 public:
-	ThreadPool ( size_t );
+	// runs on each worker before its first task; the returned context is what context () gives its tasks
+	typedef std::function<void* ( size_t index )> WorkerInitializer;
+	// runs on each worker after its last task, with the context its initializer returned
+	typedef std::function<void ( size_t index, void * context )> WorkerFinalizer;
+
+	// tasks in the interactive lane run before any other queued work; batch lanes share
+	// the workers in proportion to their weights, starting with the default lane
+	static const size_t interactiveLane = 0;
+	static const size_t defaultLane = 1;
+	// what addLane returns once every lane is taken
+	static const size_t noLane = SIZE_MAX;
+
+	struct LaneStats
+	{
+		// tasks waiting in the lane now and at most so far
+		size_t queued, peak;
+		uint64_t started;
+	};
+
+	// capacity bounds the queue of every lane; zero picks a generous default
+	ThreadPool ( size_t threads, size_t capacity = 0,
+		WorkerInitializer initializer = nullptr, WorkerFinalizer finalizer = nullptr );
+	// enqueue and post block while the lane is full
 	template<class F, class... Args>
 	auto enqueue ( F&& f, Args&&... args )
 		->std::future<typename std::result_of<F ( Args... )>::type>;
+	// fire-and-forget submission; callables up to InlineTask::inline_size bytes are
+	// stored in a preallocated queue slot without any allocation
+	template<class F>
+	void post ( F&& f ) { post ( defaultLane, std::forward<F> ( f ) ); }
+	template<class F>
+	void post ( size_t lane, F&& f );
+	// like post, but returns false instead of blocking when the lane is full, and instead of
+	// throwing once the pool is stopping; the callable is destroyed without running then
+	template<class F>
+	bool try_post ( F&& f ) { return try_post ( defaultLane, std::forward<F> ( f ) ); }
+	template<class F>
+	bool try_post ( size_t lane, F&& f );
 	~ThreadPool ();
 
+	// destroys every queued task that has not started yet without running it and returns how many;
+	// tasks workers take meanwhile still run, and the pool stays usable
+	size_t discard ();
+	// the same for one lane's queue only; its tasks already moved to a worker's deque still run
+	size_t discard ( size_t lane );
+
+	// adds a batch lane and returns its index, or noLane when the pool has no lane left
+	size_t addLane ( uint32_t weight );
+	size_t laneCount () const { return lane_count; }
+	LaneStats laneStats ( size_t lane ) const;
+
 	size_t taskSize ();
+	size_t taskCapacity () const { return lanes [ defaultLane ]->ring.capacity (); }
+	size_t workerCount () const { return workers.size (); }
+
+	// workers past the active count park after their current task; at least one always stays active
+	size_t activeWorkers () const { return active_workers; }
+	void setActiveWorkers ( size_t count );
+
+	// the calling worker's context, or null outside of pool workers
+	template<class T>
+	static T * context () { return static_cast< T* > ( current_context () ); }
+
 private:
+	// move-only type-erased callable with inline storage; larger callables fall back to the heap
+	class InlineTask
+	{
+	public:
+		static const size_t inline_size = 64;
+
+		InlineTask () : invoke ( nullptr ), manage ( nullptr ) { }
+		~InlineTask () { reset (); }
+		InlineTask ( const InlineTask& ) = delete;
+		InlineTask& operator= ( const InlineTask& ) = delete;
+
+		template<class F>
+		void emplace ( F&& f );
+		void move_from ( InlineTask & other ) noexcept;
+		void run () { invoke ( &storage ); reset (); }
+		void reset ();
+
+	private:
+		template<class T>
+		static void invoke_inline ( void * storage ) { ( *reinterpret_cast< T* > ( storage ) )( ); }
+		template<class T>
+		static void manage_inline ( void * storage, void * target )
+		{
+			T * callable = reinterpret_cast< T* > ( storage );
+			if ( target != nullptr )
+				new ( target ) T ( std::move ( *callable ) );
+			callable->~T ();
+		}
+		template<class T>
+		static void invoke_boxed ( void * storage ) { ( **reinterpret_cast< T** > ( storage ) )( ); }
+		template<class T>
+		static void manage_boxed ( void * storage, void * target )
+		{
+			T ** callable = reinterpret_cast< T** > ( storage );
+			if ( target != nullptr )
+				*reinterpret_cast< T** > ( target ) = *callable;
+			else
+				delete *callable;
+		}
+
+		template<class F>
+		void emplace ( F&& f, std::true_type );
+		template<class F>
+		void emplace ( F&& f, std::false_type );
+
+		typename std::aligned_storage<inline_size>::type storage;
+		void ( *invoke ) ( void * storage );
+		// moves the callable into target, or destroys it when target is null
+		void ( *manage ) ( void * storage, void * target );
+	};
+
+	struct Task
+	{
+		InlineTask task;
+		Task * next;
+	};
+
+	// Chase-Lev work-stealing deque; the owner pushes and pops at the bottom, thieves take from the top
+	class TaskDeque
+	{
+	public:
+		TaskDeque () : top ( 0 ), bottom ( 0 ) { }
+
+		bool push ( Task * task );
+		Task * pop ();
+		Task * steal ();
+
+	private:
+		static const int64_t capacity = 1024;
+		std::atomic<int64_t> top;
+		std::atomic<int64_t> bottom;
+		std::atomic<Task*> buffer [ capacity ];
+	};
+
+	// bounded lock-free MPMC ring (Vyukov); a slot is reserved, filled in place and then published
+	class TaskRing
+	{
+	public:
+		explicit TaskRing ( size_t capacity );
+
+		bool reserve ( size_t & position );
+		InlineTask & slot ( size_t position ) { return cells [ position & mask ].task; }
+		void publish ( size_t position );
+		bool pop ( InlineTask & task );
+		size_t size () const;
+		size_t capacity () const { return mask + 1; }
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			InlineTask task;
+		};
+
+		std::unique_ptr<Cell []> cells;
+		size_t mask;
+		char padding0 [ 64 ];
+		std::atomic<size_t> enqueue_position;
+		char padding1 [ 64 ];
+		std::atomic<size_t> dequeue_position;
+		char padding2 [ 64 ];
+	};
+
+	struct Lane
+	{
+		Lane ( size_t capacity, uint32_t weight )
+			: ring ( capacity ), weight ( weight ), pass ( 0 ), peak ( 0 ), started ( 0 ) { }
+
+		TaskRing ring;
+		uint32_t weight;
+		// stride scheduling position; the waiting batch lane with the lowest pass goes next
+		std::atomic<uint64_t> pass;
+		std::atomic<size_t> peak;
+		std::atomic<uint64_t> started;
+	};
+
+	struct Worker
+	{
+		TaskDeque deque;
+		// executed tasks go back to the shared free list in batches
+		std::vector<Task*> freeTasks;
+		uint32_t seed;
+		// interactive tasks run back to back; capped while batch work waits
+		uint32_t interactiveStreak;
+		// keep neighbouring workers' indices off this cache line
+		char padding [ 64 ];
+	};
+
+	static const size_t injectBatch = 32;
+	static const size_t freeBatch = 64;
+	static const size_t maxLanes = 16;
+	static const uint64_t laneStride = 1 << 20;
+	static const uint32_t starvationLimit = 16;
+
+	void worker_loop ( size_t index );
+	bool take ( size_t index, InlineTask & task );
+	Lane * next_lane ();
+	void charge ( Lane & lane, size_t tasks );
+	Task * allocate ( size_t index );
+	void recycle ( size_t index, Task * task );
+	template<class F>
+	bool submit ( size_t lane, F&& f, bool wait );
+	void wake ();
+	void release_slot ();
+
+	// the pool and worker index of the calling thread; the index is only valid for that pool
+	static ThreadPool *& current_pool () { static thread_local ThreadPool * pool; return pool; }
+	static size_t & current_index () { static thread_local size_t index; return index; }
+	static void *& current_context () { static thread_local void * context; return context; }
+
 	// need to keep track of threads so we can join them
 	std::vector< std::thread > workers;
-	// the task queue
-	std::queue< std::function<void ()> > tasks;
+	std::vector< std::unique_ptr<Worker> > worker_states;
+	WorkerInitializer initializer;
+	WorkerFinalizer finalizer;
 
-	// synchronization
-	std::mutex queue_mutex;
+	// the injection queues for tasks from external producers such as the decode thread;
+	// lanes are only ever added, so workers read them without locking
+	std::unique_ptr<Lane> lanes [ maxLanes ];
+	std::atomic<size_t> lane_count;
+	std::mutex lane_mutex;
+	std::atomic<uint64_t> virtual_time;
+
+	// deque nodes are allocated in slabs and recycled
+	Task * free_tasks;
+	std::vector< std::unique_ptr<Task []> > slabs;
+	std::mutex free_mutex;
+
+	// queued but not yet started tasks
+	std::atomic<size_t> pending;
+
+	// synchronization for idle workers
+	std::mutex sleep_mutex;
 	std::condition_variable condition;
-	bool stop;
+	std::atomic<size_t> sleepers;
+	std::atomic<bool> stop;
+
+	// parked workers wait here so that wake () only ever reaches active ones
+	std::condition_variable park_condition;
+	std::atomic<size_t> active_workers;
+
+	// synchronization for producers waiting on a full queue
+	std::mutex space_mutex;
+	std::condition_variable space_condition;
+	std::atomic<size_t> space_waiters;
 };
 
+template<class F>
+void ThreadPool::InlineTask::emplace ( F&& f )
+{
+	using callable_type = typename std::decay<F>::type;
+	reset ();
+	emplace ( std::forward<F> ( f ), std::integral_constant<bool,
+		sizeof ( callable_type ) <= inline_size
+		&& alignof ( callable_type ) <= alignof ( decltype ( storage ) )
+		&& std::is_nothrow_move_constructible<callable_type>::value> () );
+}
+
+template<class F>
+void ThreadPool::InlineTask::emplace ( F&& f, std::true_type )
+{
+	using callable_type = typename std::decay<F>::type;
+	new ( &storage ) callable_type ( std::forward<F> ( f ) );
+	invoke = &invoke_inline<callable_type>;
+	manage = &manage_inline<callable_type>;
+}
+
+template<class F>
+void ThreadPool::InlineTask::emplace ( F&& f, std::false_type )
+{
+	using callable_type = typename std::decay<F>::type;
+	*reinterpret_cast< callable_type** > ( &storage ) = new callable_type ( std::forward<F> ( f ) );
+	invoke = &invoke_boxed<callable_type>;
+	manage = &manage_boxed<callable_type>;
+}
+
+inline void ThreadPool::InlineTask::move_from ( InlineTask & other ) noexcept
+{
+	reset ();
+	if ( other.manage == nullptr )
+		return;
+
+	other.manage ( &other.storage, &storage );
+	invoke = other.invoke;
+	manage = other.manage;
+	other.invoke = nullptr;
+	other.manage = nullptr;
+}
+
+inline void ThreadPool::InlineTask::reset ()
+{
+	if ( manage != nullptr )
+		manage ( &storage, nullptr );
+	invoke = nullptr;
+	manage = nullptr;
+}
+
+inline bool ThreadPool::TaskDeque::push ( Task * task )
+{
+	int64_t b = bottom.load ( std::memory_order_relaxed );
+	int64_t t = top.load ( std::memory_order_acquire );
+	if ( b - t >= capacity )
+		return false;
+
+	buffer [ b & ( capacity - 1 ) ].store ( task, std::memory_order_relaxed );
+	bottom.store ( b + 1, std::memory_order_release );
+	return true;
+}
+
+inline ThreadPool::Task * ThreadPool::TaskDeque::pop ()
+{
+	int64_t b = bottom.load ( std::memory_order_relaxed ) - 1;
+	bottom.store ( b, std::memory_order_relaxed );
+	std::atomic_thread_fence ( std::memory_order_seq_cst );
+	int64_t t = top.load ( std::memory_order_relaxed );
+
+	if ( t > b )
+	{
+		bottom.store ( b + 1, std::memory_order_relaxed );
+		return nullptr;
+	}
+
+	Task * task = buffer [ b & ( capacity - 1 ) ].load ( std::memory_order_relaxed );
+	if ( t == b )
+	{
+		// last element; race against thieves for it
+		if ( !top.compare_exchange_strong ( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+			task = nullptr;
+		bottom.store ( b + 1, std::memory_order_relaxed );
+	}
+	return task;
+}
+
+inline ThreadPool::Task * ThreadPool::TaskDeque::steal ()
+{
+	int64_t t = top.load ( std::memory_order_acquire );
+	std::atomic_thread_fence ( std::memory_order_seq_cst );
+	int64_t b = bottom.load ( std::memory_order_acquire );
+	if ( t >= b )
+		return nullptr;
+
+	Task * task = buffer [ t & ( capacity - 1 ) ].load ( std::memory_order_relaxed );
+	if ( !top.compare_exchange_strong ( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+		return nullptr;
+	return task;
+}
+
+inline ThreadPool::TaskRing::TaskRing ( size_t capacity )
+	: enqueue_position ( 0 ), dequeue_position ( 0 )
+{
+	size_t rounded = 2;
+	while ( rounded < capacity )
+		rounded <<= 1;
+
+	cells.reset ( new Cell [ rounded ] );
+	mask = rounded - 1;
+	for ( size_t i = 0; i < rounded; ++i )
+		cells [ i ].sequence.store ( i, std::memory_order_relaxed );
+}
+
+inline bool ThreadPool::TaskRing::reserve ( size_t & position )
+{
+	size_t pos = enqueue_position.load ( std::memory_order_relaxed );
+	for ( ;; )
+	{
+		Cell & cell = cells [ pos & mask ];
+		intptr_t diff = ( intptr_t ) cell.sequence.load ( std::memory_order_acquire ) - ( intptr_t ) pos;
+		if ( diff == 0 )
+		{
+			if ( enqueue_position.compare_exchange_weak ( pos, pos + 1, std::memory_order_relaxed ) )
+			{
+				position = pos;
+				return true;
+			}
+		}
+		else if ( diff < 0 )
+			return false;
+		else
+			pos = enqueue_position.load ( std::memory_order_relaxed );
+	}
+}
+
+inline void ThreadPool::TaskRing::publish ( size_t position )
+{
+	cells [ position & mask ].sequence.store ( position + 1, std::memory_order_release );
+}
+
+inline bool ThreadPool::TaskRing::pop ( InlineTask & task )
+{
+	size_t pos = dequeue_position.load ( std::memory_order_relaxed );
+	for ( ;; )
+	{
+		Cell & cell = cells [ pos & mask ];
+		intptr_t diff = ( intptr_t ) cell.sequence.load ( std::memory_order_acquire ) - ( intptr_t ) ( pos + 1 );
+		if ( diff == 0 )
+		{
+			if ( dequeue_position.compare_exchange_weak ( pos, pos + 1, std::memory_order_relaxed ) )
+			{
+				task.move_from ( cell.task );
+				cell.sequence.store ( pos + mask + 1, std::memory_order_release );
+				return true;
+			}
+		}
+		else if ( diff < 0 )
+			return false;
+		else
+			pos = dequeue_position.load ( std::memory_order_relaxed );
+	}
+}
+
+inline size_t ThreadPool::TaskRing::size () const
+{
+	size_t dequeued = dequeue_position.load ( std::memory_order_seq_cst );
+	size_t enqueued = enqueue_position.load ( std::memory_order_seq_cst );
+	return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool ( size_t threads )
-	: stop ( false )
+inline ThreadPool::ThreadPool ( size_t threads, size_t capacity,
+	WorkerInitializer initializer, WorkerFinalizer finalizer )
+	: initializer ( std::move ( initializer ) ), finalizer ( std::move ( finalizer ) )
+	, lane_count ( 0 ), virtual_time ( 0 )
+	, free_tasks ( nullptr ), pending ( 0 ), sleepers ( 0 ), stop ( false ), active_workers ( threads )
+	, space_waiters ( 0 )
 {
-	for ( size_t i = 0; i<threads; ++i )
-		workers.emplace_back (
-			[ this ]
+	if ( capacity == 0 )
+		capacity = 4096;
+	lanes [ interactiveLane ].reset ( new Lane ( capacity, 1 ) );
+	lanes [ defaultLane ].reset ( new Lane ( capacity, 1 ) );
+	lane_count = 2;
+
+	for ( size_t i = 0; i < threads; ++i )
+	{
+		worker_states.emplace_back ( new Worker () );
+		worker_states.back ()->freeTasks.reserve ( freeBatch * 2 );
+		worker_states.back ()->seed = ( uint32_t ) ( i * 2654435761u + 1 );
+		worker_states.back ()->interactiveStreak = 0;
+	}
+
+	for ( size_t i = 0; i < threads; ++i )
+		workers.emplace_back ( [ this, i ] { worker_loop ( i ); } );
+}
+
+inline void ThreadPool::worker_loop ( size_t index )
+{
+	current_pool () = this;
+	current_index () = index;
+	if ( initializer )
+		current_context () = initializer ( index );
+
+	InlineTask task;
+	for ( ;; )
+	{
+		if ( index >= active_workers && !stop )
+		{
+			// tasks left in our deque are stolen by the active workers; hand on a wake-up we may have consumed
+			std::unique_lock<std::mutex> lock ( sleep_mutex );
+			if ( pending > 0 )
+				condition.notify_one ();
+			park_condition.wait ( lock, [ this, index ] { return stop || index < active_workers; } );
+			continue;
+		}
+
+		if ( take ( index, task ) )
+		{
+			task.run ();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock ( sleep_mutex );
+		++sleepers;
+		condition.wait ( lock, [ this ] { return stop || pending > 0; } );
+		--sleepers;
+		if ( stop && pending == 0 )
+			break;
+	}
+
+	if ( finalizer )
+		finalizer ( index, current_context () );
+	current_context () = nullptr;
+	current_pool () = nullptr;
+}
+
+// interactive lane first, then our own deque, then the fairest batch lane, then a randomly chosen victim
+inline bool ThreadPool::take ( size_t index, InlineTask & task )
+{
+	Worker & self = *worker_states [ index ];
+
+	Lane & interactive = *lanes [ interactiveLane ];
+	if ( self.interactiveStreak < starvationLimit || pending <= interactive.ring.size () )
 	{
-		for ( ;;)
+		if ( interactive.ring.pop ( task ) )
 		{
-			std::function<void ()> task;
+			++self.interactiveStreak;
+			charge ( interactive, 1 );
+			release_slot ();
+			--pending;
+			return true;
+		}
+	}
+	self.interactiveStreak = 0;
 
+	Task * node = self.deque.pop ();
+	Lane * lane = node == nullptr ? next_lane () : nullptr;
+	if ( lane != nullptr && lane->ring.pop ( task ) )
+	{
+		// move a share of the backlog into our deque so idle workers can steal it
+		size_t share = ( std::min ) ( ( size_t ) injectBatch, lane->ring.size () / worker_states.size () ), shared;
+		for ( shared = 0; shared < share; ++shared )
+		{
+			Task * sharedTask = allocate ( index );
+			if ( !lane->ring.pop ( sharedTask->task ) )
 			{
-				std::unique_lock<std::mutex> lock ( this->queue_mutex );
-				this->condition.wait ( lock,
-					[ this ] { return this->stop || !this->tasks.empty (); } );
-				if ( this->stop && this->tasks.empty () )
-					return;
-				task = std::move ( this->tasks.front () );
-				this->tasks.pop ();
+				recycle ( index, sharedTask );
+				break;
 			}
+			if ( !self.deque.push ( sharedTask ) )
+			{
+				// our deque is full; run this one here rather than lose it, and share no more
+				InlineTask overflow;
+				overflow.move_from ( sharedTask->task );
+				recycle ( index, sharedTask );
+				overflow.run ();
+				--pending;
+				++shared;
+				break;
+			}
+		}
+		charge ( *lane, 1 + shared );
+		release_slot ();
+
+		--pending;
+		return true;
+	}
+
+	if ( node == nullptr && worker_states.size () > 1 )
+	{
+		self.seed ^= self.seed << 13;
+		self.seed ^= self.seed >> 17;
+		self.seed ^= self.seed << 5;
+
+		size_t start = self.seed % worker_states.size ();
+		for ( size_t i = 0; i < worker_states.size () && node == nullptr; ++i )
+		{
+			size_t victim = ( start + i ) % worker_states.size ();
+			if ( victim != index )
+				node = worker_states [ victim ]->deque.steal ();
+		}
+	}
+
+	if ( node == nullptr )
+		return false;
+
+	task.move_from ( node->task );
+	recycle ( index, node );
+	--pending;
+	return true;
+}
+
+inline ThreadPool::Lane * ThreadPool::next_lane ()
+{
+	Lane * next = nullptr;
+	uint64_t nextPass = UINT64_MAX;
+
+	size_t count = lane_count.load ( std::memory_order_acquire );
+	for ( size_t i = defaultLane; i < count; ++i )
+	{
+		Lane * lane = lanes [ i ].get ();
+		uint64_t pass = lane->pass.load ( std::memory_order_relaxed );
+		if ( pass < nextPass && lane->ring.size () > 0 )
+		{
+			next = lane;
+			nextPass = pass;
+		}
+	}
+	return next;
+}
+
+// advances the lane's pass by its stride; a lane that sat idle restarts from the current virtual time
+// instead of catching up on the turns it missed
+inline void ThreadPool::charge ( Lane & lane, size_t tasks )
+{
+	lane.started.fetch_add ( tasks, std::memory_order_relaxed );
+
+	uint64_t base = ( std::max ) ( lane.pass.load ( std::memory_order_relaxed ),
+		virtual_time.load ( std::memory_order_relaxed ) );
+	virtual_time.store ( base, std::memory_order_relaxed );
+	lane.pass.store ( base + tasks * laneStride / lane.weight, std::memory_order_relaxed );
+}
+
+// nodes come from the worker's own cache first, then from the shared slab list
+inline ThreadPool::Task * ThreadPool::allocate ( size_t index )
+{
+	std::vector<Task*> & freeTasks = worker_states [ index ]->freeTasks;
+	if ( !freeTasks.empty () )
+	{
+		Task * task = freeTasks.back ();
+		freeTasks.pop_back ();
+		return task;
+	}
 
-			task ();
+	std::unique_lock<std::mutex> lock ( free_mutex );
+	if ( free_tasks == nullptr )
+	{
+		const size_t slabSize = 64;
+		slabs.emplace_back ( new Task [ slabSize ] );
+		for ( size_t i = 0; i < slabSize; ++i )
+		{
+			slabs.back () [ i ].next = free_tasks;
+			free_tasks = &slabs.back () [ i ];
 		}
 	}
-	);
+
+	Task * task = free_tasks;
+	free_tasks = task->next;
+	return task;
+}
+
+inline void ThreadPool::recycle ( size_t index, Task * task )
+{
+	std::vector<Task*> & freeTasks = worker_states [ index ]->freeTasks;
+	freeTasks.push_back ( task );
+	if ( freeTasks.size () < freeBatch * 2 )
+		return;
+
+	// keep half as a local cache for our own allocations
+	std::unique_lock<std::mutex> lock ( free_mutex );
+	for ( size_t i = 0; i < freeBatch; ++i )
+	{
+		Task * freed = freeTasks.back ();
+		freeTasks.pop_back ();
+		freed->next = free_tasks;
+		free_tasks = freed;
+	}
 }
 
-// add new work item to the pool
+// batch tasks spawned by our own workers go to their deque and never wait for ring space;
+// everything else is moved into its reserved ring slot once it is built
+template<class F>
+bool ThreadPool::submit ( size_t lane, F&& f, bool wait )
+{
+	// don't allow enqueueing after stopping the pool
+	if ( stop )
+	{
+		if ( !wait )
+			return false;
+		throw std::runtime_error ( "enqueue on stopped ThreadPool" );
+	}
+
+	if ( lane >= lane_count.load ( std::memory_order_acquire ) )
+		lane = defaultLane;
+	TaskRing & ring = lanes [ lane ]->ring;
+
+	// built before a slot or node is taken, so a callable that throws while it is constructed
+	// leaves the ring and the deque as they were
+	InlineTask built;
+	built.emplace ( std::forward<F> ( f ) );
+
+	bool worker = current_pool () == this;
+	if ( worker && lane != interactiveLane )
+	{
+		size_t index = current_index ();
+		Task * task = allocate ( index );
+		task->task.move_from ( built );
+
+		// counted before it becomes visible so a thief taking it never sees the count underflow
+		++pending;
+		if ( !worker_states [ index ]->deque.push ( task ) )
+		{
+			// our deque is full; run the task here instead of waiting on our own workers
+			--pending;
+			built.move_from ( task->task );
+			recycle ( index, task );
+			built.run ();
+			return true;
+		}
+
+		wake ();
+		return true;
+	}
+
+	size_t position;
+	while ( !ring.reserve ( position ) )
+	{
+		if ( worker )
+		{
+			// waiting on our own workers could deadlock; run it here instead
+			built.run ();
+			return true;
+		}
+
+		if ( !wait )
+			return false;
+
+		std::unique_lock<std::mutex> lock ( space_mutex );
+		++space_waiters;
+		space_condition.wait ( lock, [ this, &ring ] { return stop || ring.size () < ring.capacity (); } );
+		--space_waiters;
+
+		if ( stop )
+			throw std::runtime_error ( "enqueue on stopped ThreadPool" );
+	}
+
+	ring.slot ( position ).move_from ( built );
+
+	// counted before it becomes visible so a worker taking it never sees the count underflow
+	++pending;
+	ring.publish ( position );
+
+	std::atomic<size_t> & peak = lanes [ lane ]->peak;
+	size_t queued = ring.size (), highest = peak.load ( std::memory_order_relaxed );
+	while ( queued > highest && !peak.compare_exchange_weak ( highest, queued, std::memory_order_relaxed ) )
+		;
+
+	wake ();
+	return true;
+}
+
+inline void ThreadPool::wake ()
+{
+	if ( sleepers == 0 )
+		return;
+
+	// taking the lock orders us after a worker that is about to wait
+	{
+		std::unique_lock<std::mutex> lock ( sleep_mutex );
+	}
+	condition.notify_one ();
+}
+
+inline void ThreadPool::release_slot ()
+{
+	std::atomic_thread_fence ( std::memory_order_seq_cst );
+	if ( space_waiters == 0 )
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock ( space_mutex );
+	}
+	space_condition.notify_all ();
+}
+
+inline size_t ThreadPool::discard ()
+{
+	size_t discarded = 0;
+
+	size_t count = lane_count.load ( std::memory_order_acquire );
+	for ( size_t i = 0; i < count; ++i )
+		discarded += discard ( i );
+
+	// stealing is safe from any thread; nodes go straight back to the shared list
+	for ( std::unique_ptr<Worker> & worker : worker_states )
+	{
+		for ( Task * node; ( node = worker->deque.steal () ) != nullptr; ++discarded )
+		{
+			node->task.reset ();
+			--pending;
+
+			std::unique_lock<std::mutex> lock ( free_mutex );
+			node->next = free_tasks;
+			free_tasks = node;
+		}
+	}
+
+	if ( discarded > 0 )
+		release_slot ();
+	return discarded;
+}
+
+inline size_t ThreadPool::discard ( size_t lane )
+{
+	if ( lane >= lane_count.load ( std::memory_order_acquire ) )
+		return 0;
+
+	size_t discarded = 0;
+	InlineTask task;
+	for ( ; lanes [ lane ]->ring.pop ( task ); ++discarded )
+	{
+		task.reset ();
+		--pending;
+	}
+
+	if ( discarded > 0 )
+		release_slot ();
+	return discarded;
+}
+
+// add new work item to the pool; the future's shared state is the only allocation
 template<class F, class... Args>
 auto ThreadPool::enqueue ( F&& f, Args&&... args )
 -> std::future<typename std::result_of<F ( Args... )>::type>
 {
 	using return_type = typename std::result_of<F ( Args... )>::type;
 
-	auto task = std::make_shared< std::packaged_task<return_type ()> > (
+	std::packaged_task<return_type ()> task (
 		std::bind ( std::forward<F> ( f ), std::forward<Args> ( args )... )
 		);
 
-	std::future<return_type> res = task->get_future ();
-	{
-		std::unique_lock<std::mutex> lock ( queue_mutex );
+	std::future<return_type> res = task.get_future ();
+	submit ( defaultLane, std::move ( task ), true );
+	return res;
+}
 
-		// don't allow enqueueing after stopping the pool
-		if ( stop )
-			throw std::runtime_error ( "enqueue on stopped ThreadPool" );
+template<class F>
+void ThreadPool::post ( size_t lane, F&& f )
+{
+	submit ( lane, std::forward<F> ( f ), true );
+}
+
+template<class F>
+bool ThreadPool::try_post ( size_t lane, F&& f )
+{
+	return submit ( lane, std::forward<F> ( f ), false );
+}
 
-		tasks.emplace ( [ task ] () { ( *task )( ); } );
+inline size_t ThreadPool::addLane ( uint32_t weight )
+{
+	std::unique_lock<std::mutex> lock ( lane_mutex );
+	size_t index = lane_count.load ( std::memory_order_relaxed );
+	if ( index == maxLanes )
+		return noLane;
+
+	lanes [ index ].reset ( new Lane ( taskCapacity (), weight != 0 ? weight : 1 ) );
+	// a new lane starts level with the others instead of owning every turn until it catches up
+	lanes [ index ]->pass = virtual_time.load ( std::memory_order_relaxed );
+	lane_count.store ( index + 1, std::memory_order_release );
+	return index;
+}
+
+inline ThreadPool::LaneStats ThreadPool::laneStats ( size_t lane ) const
+{
+	LaneStats stats = { 0, 0, 0 };
+	if ( lane < lane_count.load ( std::memory_order_acquire ) )
+	{
+		stats.queued = lanes [ lane ]->ring.size ();
+		stats.peak = lanes [ lane ]->peak.load ( std::memory_order_relaxed );
+		stats.started = lanes [ lane ]->started.load ( std::memory_order_relaxed );
 	}
-	condition.notify_one ();
-	return res;
+	return stats;
 }
 
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool ()
 {
 	{
-		std::unique_lock<std::mutex> lock ( queue_mutex );
+		std::unique_lock<std::mutex> lock ( sleep_mutex );
 		stop = true;
 	}
 	condition.notify_all ();
+	park_condition.notify_all ();
+	{
+		std::unique_lock<std::mutex> lock ( space_mutex );
+	}
+	space_condition.notify_all ();
 	for ( std::thread &worker : workers )
 		worker.join ();
 }
 
 inline size_t ThreadPool::taskSize ()
 {
-	return tasks.size ();
+	return pending;
+}
+
+inline void ThreadPool::setActiveWorkers ( size_t count )
+{
+	count = ( std::max ) ( ( size_t ) 1, ( std::min ) ( count, workers.size () ) );
+	{
+		std::unique_lock<std::mutex> lock ( sleep_mutex );
+		active_workers = count;
+	}
+	park_condition.notify_all ();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,281 @@
+#include "ProbeCache.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+
+#include <Shlwapi.h>
+
+#pragma comment ( lib, "Shlwapi.lib" )
+
+#define PROBE_CACHE_MAGIC 0x43505356
+#define PROBE_CACHE_VERSION 1
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma pack ( push, 1 )
+struct ProbeCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t streamCount;
+	uint32_t recordCount;
+	int64_t duration;
+	int64_t startTime;
+};
+
+struct ProbeCacheRecord
+{
+	int32_t streamIndex;
+	int32_t codecId;
+	uint32_t codecTag;
+	int32_t format;
+	int32_t width, height;
+	int32_t sampleAspectRatioNum, sampleAspectRatioDen;
+	int32_t fieldOrder;
+	int32_t colorRange, colorPrimaries, colorTrc, colorSpace, chromaLocation;
+	int32_t profile, level;
+	int32_t videoDelay;
+	int64_t bitRate;
+	int32_t timeBaseNum, timeBaseDen;
+	int32_t frameRateNum, frameRateDen;
+	int32_t averageFrameRateNum, averageFrameRateDen;
+	int64_t startTime;
+	int64_t duration;
+	int64_t frameCount;
+	uint32_t extradataSize;
+};
+#pragma pack ( pop )
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Probing under other limits may find other parameters, so the limits are part of the key
+static HRESULT GetProbeCachePath ( LPCWSTR cacheDirectory, LPCWSTR filename, const AVFormatContext * formatContext,
+	LPWSTR cachePath )
+{
+	HANDLE file = CreateFile ( filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, 0, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL succeeded = GetFileInformationByHandle ( file, &info );
+	CloseHandle ( file );
+	if ( !succeeded )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	uint64_t probeSize = ( uint64_t ) formatContext->probesize, analyzeDuration = ( uint64_t ) formatContext->max_analyze_duration;
+	wchar_t cacheName [ 128 ];
+	wsprintf ( cacheName, TEXT ( "%08X-%08X%08X-%08X%08X-%08X%08X-%08X%08X-%08X%08X.probe" ),
+		info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow,
+		info.nFileSizeHigh, info.nFileSizeLow,
+		info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime,
+		( DWORD ) ( probeSize >> 32 ), ( DWORD ) probeSize, ( DWORD ) ( analyzeDuration >> 32 ), ( DWORD ) analyzeDuration );
+
+	if ( PathCombine ( cachePath, cacheDirectory, cacheName ) == nullptr )
+		return E_FAIL;
+
+	return S_OK;
+}
+
+HRESULT LoadProbeCache ( LPCWSTR cacheDirectory, LPCWSTR filename, AVFormatContext * formatContext )
+{
+	HRESULT hr;
+
+	wchar_t cachePath [ MAX_PATH ];
+	if ( FAILED ( hr = GetProbeCachePath ( cacheDirectory, filename, formatContext, cachePath ) ) )
+		return hr;
+
+	HANDLE file = CreateFile ( cachePath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	LARGE_INTEGER fileSize;
+	std::vector<uint8_t> data;
+	DWORD readBytes = 0;
+	if ( GetFileSizeEx ( file, &fileSize ) && fileSize.QuadPart < 16 * 1024 * 1024 )
+	{
+		data.resize ( ( size_t ) fileSize.QuadPart );
+		if ( !ReadFile ( file, data.data (), ( DWORD ) data.size (), &readBytes, nullptr ) )
+			readBytes = 0;
+	}
+	CloseHandle ( file );
+
+	if ( readBytes != data.size () || data.size () < sizeof ( ProbeCacheHeader ) )
+		return E_FAIL;
+
+	const ProbeCacheHeader * header = ( const ProbeCacheHeader * ) data.data ();
+	if ( header->magic != PROBE_CACHE_MAGIC || header->version != PROBE_CACHE_VERSION )
+		return E_FAIL;
+
+	// Streams created lazily while probing (MPEG-TS and friends) cannot be restored
+	if ( header->streamCount != formatContext->nb_streams )
+		return E_FAIL;
+
+	// Validate the whole file before touching the format context
+	size_t offset = sizeof ( ProbeCacheHeader );
+	for ( uint32_t i = 0; i < header->recordCount; ++i )
+	{
+		if ( offset + sizeof ( ProbeCacheRecord ) > data.size () )
+			return E_FAIL;
+
+		const ProbeCacheRecord * record = ( const ProbeCacheRecord * ) ( data.data () + offset );
+		if ( record->streamIndex < 0 || record->streamIndex >= ( int32_t ) formatContext->nb_streams )
+			return E_FAIL;
+		if ( formatContext->streams [ record->streamIndex ]->codecpar->codec_id != record->codecId )
+			return E_FAIL;
+
+		offset += sizeof ( ProbeCacheRecord ) + record->extradataSize;
+		if ( offset > data.size () )
+			return E_FAIL;
+	}
+
+	offset = sizeof ( ProbeCacheHeader );
+	for ( uint32_t i = 0; i < header->recordCount; ++i )
+	{
+		const ProbeCacheRecord * record = ( const ProbeCacheRecord * ) ( data.data () + offset );
+		const uint8_t * extradata = data.data () + offset + sizeof ( ProbeCacheRecord );
+		offset += sizeof ( ProbeCacheRecord ) + record->extradataSize;
+
+		AVStream * stream = formatContext->streams [ record->streamIndex ];
+		AVCodecParameters * codecpar = stream->codecpar;
+
+		codecpar->codec_tag = record->codecTag;
+		codecpar->format = record->format;
+		codecpar->width = record->width;
+		codecpar->height = record->height;
+		codecpar->sample_aspect_ratio = av_make_q ( record->sampleAspectRatioNum, record->sampleAspectRatioDen );
+		codecpar->field_order = ( AVFieldOrder ) record->fieldOrder;
+		codecpar->color_range = ( AVColorRange ) record->colorRange;
+		codecpar->color_primaries = ( AVColorPrimaries ) record->colorPrimaries;
+		codecpar->color_trc = ( AVColorTransferCharacteristic ) record->colorTrc;
+		codecpar->color_space = ( AVColorSpace ) record->colorSpace;
+		codecpar->chroma_location = ( AVChromaLocation ) record->chromaLocation;
+		codecpar->profile = record->profile;
+		codecpar->level = record->level;
+		codecpar->video_delay = record->videoDelay;
+		codecpar->bit_rate = record->bitRate;
+
+		if ( record->extradataSize > 0 )
+		{
+			uint8_t * copied = ( uint8_t * ) av_mallocz ( record->extradataSize + AV_INPUT_BUFFER_PADDING_SIZE );
+			if ( copied == nullptr )
+				return E_OUTOFMEMORY;
+			memcpy ( copied, extradata, record->extradataSize );
+
+			av_freep ( &codecpar->extradata );
+			codecpar->extradata = copied;
+			codecpar->extradata_size = ( int ) record->extradataSize;
+		}
+
+		stream->time_base = av_make_q ( record->timeBaseNum, record->timeBaseDen );
+		stream->r_frame_rate = av_make_q ( record->frameRateNum, record->frameRateDen );
+		stream->avg_frame_rate = av_make_q ( record->averageFrameRateNum, record->averageFrameRateDen );
+		stream->start_time = record->startTime;
+		stream->duration = record->duration;
+		stream->nb_frames = record->frameCount;
+	}
+
+	formatContext->duration = header->duration;
+	formatContext->start_time = header->startTime;
+
+	return S_OK;
+}
+
+HRESULT StoreProbeCache ( LPCWSTR cacheDirectory, LPCWSTR filename, const AVFormatContext * formatContext )
+{
+	HRESULT hr;
+
+	wchar_t cachePath [ MAX_PATH ];
+	if ( FAILED ( hr = GetProbeCachePath ( cacheDirectory, filename, formatContext, cachePath ) ) )
+		return hr;
+
+	std::vector<uint8_t> data ( sizeof ( ProbeCacheHeader ) );
+	uint32_t recordCount = 0;
+	for ( unsigned i = 0; i < formatContext->nb_streams; ++i )
+	{
+		const AVStream * stream = formatContext->streams [ i ];
+		const AVCodecParameters * codecpar = stream->codecpar;
+		if ( codecpar->codec_type != AVMEDIA_TYPE_VIDEO )
+			continue;
+
+		ProbeCacheRecord record = { 0, };
+		record.streamIndex = ( int32_t ) i;
+		record.codecId = codecpar->codec_id;
+		record.codecTag = codecpar->codec_tag;
+		record.format = codecpar->format;
+		record.width = codecpar->width;
+		record.height = codecpar->height;
+		record.sampleAspectRatioNum = codecpar->sample_aspect_ratio.num;
+		record.sampleAspectRatioDen = codecpar->sample_aspect_ratio.den;
+		record.fieldOrder = codecpar->field_order;
+		record.colorRange = codecpar->color_range;
+		record.colorPrimaries = codecpar->color_primaries;
+		record.colorTrc = codecpar->color_trc;
+		record.colorSpace = codecpar->color_space;
+		record.chromaLocation = codecpar->chroma_location;
+		record.profile = codecpar->profile;
+		record.level = codecpar->level;
+		record.videoDelay = codecpar->video_delay;
+		record.bitRate = codecpar->bit_rate;
+		record.timeBaseNum = stream->time_base.num;
+		record.timeBaseDen = stream->time_base.den;
+		record.frameRateNum = stream->r_frame_rate.num;
+		record.frameRateDen = stream->r_frame_rate.den;
+		record.averageFrameRateNum = stream->avg_frame_rate.num;
+		record.averageFrameRateDen = stream->avg_frame_rate.den;
+		record.startTime = stream->start_time;
+		record.duration = stream->duration;
+		record.frameCount = stream->nb_frames;
+		record.extradataSize = codecpar->extradata_size > 0 ? ( uint32_t ) codecpar->extradata_size : 0;
+
+		const uint8_t * recordBytes = ( const uint8_t * ) &record;
+		data.insert ( data.end (), recordBytes, recordBytes + sizeof ( record ) );
+		data.insert ( data.end (), codecpar->extradata, codecpar->extradata + record.extradataSize );
+		++recordCount;
+	}
+
+	ProbeCacheHeader * header = ( ProbeCacheHeader * ) data.data ();
+	header->magic = PROBE_CACHE_MAGIC;
+	header->version = PROBE_CACHE_VERSION;
+	header->streamCount = formatContext->nb_streams;
+	header->recordCount = recordCount;
+	header->duration = formatContext->duration;
+	header->startTime = formatContext->start_time;
+
+	// Write next to the final name and rename so concurrent jobs never read a torn entry
+	wchar_t temporaryPath [ MAX_PATH + 16 ];
+	wsprintf ( temporaryPath, TEXT ( "%s.%u.tmp" ), cachePath, GetCurrentThreadId () );
+
+	HANDLE file = CreateFile ( temporaryPath, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return HRESULT_FROM_WIN32 ( GetLastError () );
+
+	DWORD writtenBytes;
+	BOOL succeeded = WriteFile ( file, data.data (), ( DWORD ) data.size (), &writtenBytes, nullptr );
+	CloseHandle ( file );
+
+	if ( !succeeded || writtenBytes != data.size ()
+		|| !MoveFileEx ( temporaryPath, cachePath, MOVEFILE_REPLACE_EXISTING ) )
+	{
+		DeleteFile ( temporaryPath );
+		return E_FAIL;
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,14 @@
+#ifndef __PROBECACHE_H__
+#define __PROBECACHE_H__
+
+#include <Windows.h>
+
+struct AVFormatContext;
+
+// Stores the stream parameters found by avformat_find_stream_info in cacheDirectory,
+// keyed by volume, file index, size and last write time of the probed file and by the probesize
+// and max_analyze_duration limits set on formatContext.
+HRESULT LoadProbeCache ( LPCWSTR cacheDirectory, LPCWSTR filename, AVFormatContext * formatContext );
+HRESULT StoreProbeCache ( LPCWSTR cacheDirectory, LPCWSTR filename, const AVFormatContext * formatContext );
+
+#endif
@@ -1,4 +1,5 @@
 #include "VideoDecoder.h"
+#include "ProbeCache.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -16,22 +17,37 @@ extern "C"
 #include <libavutil/imgutils.h>
 }
 
+#include <atlbase.h>
 #include <atlconv.h>
 
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
 #pragma comment ( lib, "avcodec.lib" )
 #pragma comment ( lib, "avfilter.lib" )
 #pragma comment ( lib, "avformat.lib" )
 #pragma comment ( lib, "avutil.lib" )
 #pragma comment ( lib, "swscale.lib" )
 
+#define FOLLOW_POLL_INTERVAL 100
+#define MAX_QUEUED_PACKETS 64
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+class FFVideoSamplePool;
+
 class FFVideoSample : public IVideoSample
 {
+	friend class FFVideoSamplePool;
+
 public:
-	FFVideoSample ( AVCodecContext * codecContext, AVFrame * frame );
+	FFVideoSample ();
 	virtual ~FFVideoSample ();
 
 public:
@@ -43,12 +59,101 @@ public:
 public:
 	virtual HRESULT Lock ( LPVOID * buffer, uint64_t * length );
 	virtual HRESULT Unlock ();
+	virtual HRESULT GetLayout ( VideoSampleLayout * layout );
+
+public:
+	HRESULT Convert ( SwsContext * swsContext, AVFrame * frame, bool nodeLocal );
+	HRESULT CopyPlanes ( AVFrame * frame, VideoSampleFormat format, bool nodeLocal );
+
+private:
+	HRESULT ReserveArray ( uint64_t size, bool nodeLocal );
+	void FreeArray ();
 
 private:
 	ULONG _refCount;
+	FFVideoSamplePool * _pool;
 
 	uint8_t * array;
 	uint64_t arraySize;
+	uint64_t arrayCapacity;
+	bool arrayNodeLocal;
+	VideoSampleLayout layout;
+};
+
+// Samples return here on their final Release so frame buffers are reused after warm-up
+class FFVideoSamplePool
+{
+public:
+	FFVideoSamplePool ();
+	~FFVideoSamplePool ();
+
+public:
+	ULONG AddRef ();
+	ULONG Release ();
+
+public:
+	FFVideoSample * Acquire ();
+	void Recycle ( FFVideoSample * sample );
+
+private:
+	ULONG _refCount;
+
+	std::mutex _mutex;
+	std::vector<FFVideoSample*> _samples;
+};
+
+class FFDemuxer
+{
+public:
+	FFDemuxer ();
+	~FFDemuxer ();
+
+public:
+	ULONG AddRef ();
+	ULONG Release ();
+
+public:
+	HRESULT Open ( LPCWSTR filename, const VideoDecoderSettings * settings );
+	AVFormatContext * GetFormatContext () { return _formatContext; }
+	const VideoDecoderSettings & GetSettings () { return _settings; }
+
+public:
+	void Subscribe ( int streamIndex );
+	void Unsubscribe ( int streamIndex );
+	int ReadPacket ( int streamIndex, AVPacket * packet );
+
+private:
+	int ReadNextPacket ( AVPacket * packet );
+	bool IsCancelled () const;
+	bool IsNewPacket ( const AVPacket * packet );
+	bool WaitForFileGrowth ();
+	bool Reopen ();
+
+private:
+	struct PacketQueue
+	{
+		bool subscribed;
+		AVPacket * packets [ MAX_QUEUED_PACKETS ];
+		size_t head, count;
+	};
+
+private:
+	ULONG _refCount;
+
+	VideoDecoderSettings _settings;
+
+	std::string _path;
+	AVFormatContext * _formatContext;
+	int64_t _resumePosition;
+	// Decode time stamp of the last packet read from each stream, to skip what a reopen reads again
+	std::vector<int64_t> _lastTimeStamps;
+	bool _reopened;
+
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::vector<PacketQueue> _queues;
+	bool _demuxing;
+	bool _endOfFile;
 };
 
 class FFVideoDecoder : public IVideoDecoder
@@ -64,7 +169,12 @@ public:
 	virtual ULONG Release ();
 
 public:
-	virtual HRESULT Initialize ( LPCWSTR filename );
+	virtual HRESULT Initialize ( LPCWSTR filename, const VideoDecoderSettings * settings );
+
+public:
+	virtual HRESULT GetStreamCount ( uint32_t * count );
+	virtual HRESULT GetStreamDecoder ( uint32_t index, IVideoDecoder ** decoder );
+	virtual HRESULT GetStreamId ( uint32_t * id );
 
 public:
 	virtual HRESULT GetVideoSize ( uint32_t * width, uint32_t * height, uint32_t * stride );
@@ -76,18 +186,29 @@ public:
 public:
 	virtual HRESULT ReadSample ( IVideoSample ** sample, uint64_t * readPosition );
 
+private:
+	HRESULT OpenStream ( FFDemuxer * demuxer, int streamIndex, uint32_t threads );
+
 private:
 	ULONG _refCount;
 
-	AVFormatContext* _formatContext;
+	FFDemuxer * _demuxer;
 	AVFrame * _frame;
 	AVCodec * _codec;
 	AVCodecContext * _codecContext;
 	AVPacket * _packet;
+	SwsContext * _swsContext;
+	FFVideoSamplePool * _samplePool;
 
 	int64_t _duration;
+	// The demuxer may replace its format context while following a file, so nothing refers to it
+	AVRational _timeBase;
 
 	int _streamIndex;
+	bool _nodeLocalBuffers;
+	bool _planarOutput;
+
+	std::vector<CComPtr<IVideoDecoder>> _siblings;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -104,29 +225,116 @@ HRESULT CreateFFmpegVideoDecoder ( IVideoDecoder ** decoder )
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-FFVideoSample::FFVideoSample ( AVCodecContext * codecContext, AVFrame * frame )
+FFVideoSample::FFVideoSample ()
 	: _refCount ( 1 )
+	, _pool ( nullptr )
+	, array ( nullptr )
+	, arraySize ( 0 )
+	, arrayCapacity ( 0 )
+	, arrayNodeLocal ( false )
 {
-	SwsContext * swsContext = sws_getContext ( codecContext->width, codecContext->height,
-		codecContext->pix_fmt, codecContext->width, codecContext->height,
-		AV_PIX_FMT_BGR24, SWS_BICUBIC, NULL, NULL, NULL );
+	memset ( &layout, 0, sizeof ( layout ) );
+}
 
-	int width  = codecContext->width;
-	int height = codecContext->height;
+FFVideoSample::~FFVideoSample ()
+{
+	FreeArray ();
+}
+
+void FFVideoSample::FreeArray ()
+{
+	if ( array )
+	{
+		if ( arrayNodeLocal )
+			VirtualFree ( array, 0, MEM_RELEASE );
+		else
+			av_free ( array );
+		array = nullptr;
+	}
+	arrayCapacity = 0;
+}
+
+HRESULT FFVideoSample::ReserveArray ( uint64_t size, bool nodeLocal )
+{
+	arraySize = size;
+	if ( arrayCapacity >= arraySize && arrayNodeLocal == nodeLocal )
+		return S_OK;
+
+	FreeArray ();
+
+	UCHAR node;
+	if ( nodeLocal && GetNumaProcessorNode ( ( UCHAR ) GetCurrentProcessorNumber (), &node ) )
+		array = ( uint8_t* ) VirtualAllocExNuma ( GetCurrentProcess (), nullptr, ( SIZE_T ) arraySize,
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node );
+	else
+	{
+		nodeLocal = false;
+		array = ( uint8_t* ) av_malloc ( arraySize );
+	}
+
+	arrayNodeLocal = nodeLocal;
+	arrayCapacity = array != nullptr ? arraySize : 0;
+	if ( array == nullptr )
+		return E_OUTOFMEMORY;
+
+	return S_OK;
+}
+
+HRESULT FFVideoSample::Convert ( SwsContext * swsContext, AVFrame * frame, bool nodeLocal )
+{
+	int width  = frame->width;
+	int height = frame->height;
 	int stride = ( width * 24 + 7 ) / 8;
-	arraySize = av_image_get_buffer_size ( AV_PIX_FMT_BGR24, width, height, stride );
-	array = ( uint8_t* ) av_mallocz ( arraySize );
+
+	HRESULT hr;
+	if ( FAILED ( hr = ReserveArray ( av_image_get_buffer_size ( AV_PIX_FMT_BGR24, width, height, stride ), nodeLocal ) ) )
+		return hr;
 
 	sws_scale ( swsContext, frame->data, frame->linesize,
 		0, height, &array, &stride );
+
+	layout.format = VSF_BGR24;
+	layout.width = width;
+	layout.height = height;
+	layout.stride = stride;
+	layout.chromaStride = 0;
+	layout.fullRange = true;
+
+	return S_OK;
 }
 
-FFVideoSample::~FFVideoSample ()
+// A plain copy of the planes, packed without row padding
+HRESULT FFVideoSample::CopyPlanes ( AVFrame * frame, VideoSampleFormat format, bool nodeLocal )
 {
-	if ( array )
-	{
-		av_free ( array );
-	}
+	int width  = frame->width;
+	int height = frame->height;
+	AVPixelFormat pixelFormat = ( AVPixelFormat ) frame->format;
+
+	HRESULT hr;
+	int size = av_image_get_buffer_size ( pixelFormat, width, height, 1 );
+	if ( size < 0 )
+		return E_FAIL;
+	if ( FAILED ( hr = ReserveArray ( size, nodeLocal ) ) )
+		return hr;
+
+	if ( av_image_copy_to_buffer ( array, size, frame->data, frame->linesize, pixelFormat, width, height, 1 ) < 0 )
+		return E_FAIL;
+
+	layout.format = format;
+	layout.width = width;
+	layout.height = height;
+	layout.stride = width;
+	layout.chromaStride = format == VSF_YUV444P ? width : ( width + 1 ) / 2;
+	layout.fullRange = frame->color_range == AVCOL_RANGE_JPEG
+		|| pixelFormat == AV_PIX_FMT_YUVJ420P || pixelFormat == AV_PIX_FMT_YUVJ422P || pixelFormat == AV_PIX_FMT_YUVJ444P;
+
+	return S_OK;
+}
+
+HRESULT FFVideoSample::GetLayout ( VideoSampleLayout * layout )
+{
+	*layout = this->layout;
+	return S_OK;
 }
 
 HRESULT FFVideoSample::QueryInterface ( REFIID riid, void ** ppvObject )
@@ -146,7 +354,18 @@ ULONG FFVideoSample::Release ()
 {
 	ULONG ret = InterlockedDecrement ( &_refCount );
 	if ( ret <= 0 )
-		delete this;
+	{
+		if ( _pool != nullptr )
+		{
+			// The pool may delete this sample when its last reference goes away
+			FFVideoSamplePool * pool = _pool;
+			_pool = nullptr;
+			pool->Recycle ( this );
+			pool->Release ();
+		}
+		else
+			delete this;
+	}
 	return ret;
 }
 
@@ -166,24 +385,444 @@ HRESULT FFVideoSample::Unlock ()
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-FFVideoDecoder::FFVideoDecoder ()
+FFVideoSamplePool::FFVideoSamplePool ()
+	: _refCount ( 1 )
+{
+
+}
+
+FFVideoSamplePool::~FFVideoSamplePool ()
+{
+	for ( FFVideoSample * sample : _samples )
+		delete sample;
+}
+
+ULONG FFVideoSamplePool::AddRef ()
+{
+	return InterlockedIncrement ( &_refCount );
+}
+ULONG FFVideoSamplePool::Release ()
+{
+	ULONG ret = InterlockedDecrement ( &_refCount );
+	if ( ret <= 0 )
+		delete this;
+	return ret;
+}
+
+FFVideoSample * FFVideoSamplePool::Acquire ()
+{
+	FFVideoSample * sample = nullptr;
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+		if ( !_samples.empty () )
+		{
+			sample = _samples.back ();
+			_samples.pop_back ();
+		}
+	}
+
+	if ( sample == nullptr )
+		sample = new FFVideoSample ();
+
+	sample->_refCount = 1;
+	sample->_pool = this;
+	AddRef ();
+
+	return sample;
+}
+
+void FFVideoSamplePool::Recycle ( FFVideoSample * sample )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+	_samples.push_back ( sample );
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+FFDemuxer::FFDemuxer ()
 	: _refCount ( 1 )
 	, _formatContext ( nullptr )
+	, _resumePosition ( 0 )
+	, _reopened ( false )
+	, _demuxing ( false )
+	, _endOfFile ( false )
+{
+	memset ( &_settings, 0, sizeof ( _settings ) );
+}
+
+FFDemuxer::~FFDemuxer ()
+{
+	for ( PacketQueue & queue : _queues )
+	{
+		for ( AVPacket *& packet : queue.packets )
+			av_packet_free ( &packet );
+	}
+
+	if ( _formatContext )
+		avformat_close_input ( &_formatContext );
+}
+
+ULONG FFDemuxer::AddRef ()
+{
+	return InterlockedIncrement ( &_refCount );
+}
+ULONG FFDemuxer::Release ()
+{
+	ULONG ret = InterlockedDecrement ( &_refCount );
+	if ( ret <= 0 )
+		delete this;
+	return ret;
+}
+
+static bool HasVideoParameters ( const AVFormatContext * formatContext )
+{
+	for ( unsigned i = 0; i < formatContext->nb_streams; ++i )
+	{
+		const AVCodecParameters * codecpar = formatContext->streams [ i ]->codecpar;
+		if ( codecpar->codec_type == AVMEDIA_TYPE_VIDEO && codecpar->codec_id != AV_CODEC_ID_NONE
+			&& codecpar->width > 0 && codecpar->height > 0 )
+			return true;
+	}
+	return false;
+}
+
+HRESULT FFDemuxer::Open ( LPCWSTR filename, const VideoDecoderSettings * settings )
+{
+	USES_CONVERSION;
+
+	if ( settings != nullptr )
+		_settings = *settings;
+
+	_formatContext = avformat_alloc_context ();
+	if ( _settings.probeSize > 0 )
+		_formatContext->probesize = _settings.probeSize;
+	if ( _settings.analyzeDuration > 0 )
+		_formatContext->max_analyze_duration = _settings.analyzeDuration;
+
+	_path = W2A ( filename );
+	if ( 0 != avformat_open_input ( &_formatContext, _path.c_str (), NULL, NULL ) )
+	{
+		avformat_free_context ( _formatContext );
+		_formatContext = nullptr;
+		return E_FAIL;
+	}
+
+	LPCWSTR cacheDirectory = _settings.probeCacheDirectory;
+	if ( ( cacheDirectory == nullptr || FAILED ( LoadProbeCache ( cacheDirectory, filename, _formatContext ) ) )
+		&& !( _settings.minimalProbing && HasVideoParameters ( _formatContext ) ) )
+	{
+		if ( avformat_find_stream_info ( _formatContext, nullptr ) < 0 )
+		{
+			avformat_close_input ( &_formatContext );
+			return E_FAIL;
+		}
+
+		// A growing recording changes identity on every write, so caching it is pointless
+		if ( cacheDirectory != nullptr && !_settings.follow )
+			StoreProbeCache ( cacheDirectory, filename, _formatContext );
+	}
+
+	_lastTimeStamps.assign ( _formatContext->nb_streams, AV_NOPTS_VALUE );
+	_queues.resize ( _formatContext->nb_streams );
+	for ( PacketQueue & queue : _queues )
+	{
+		queue.subscribed = false;
+		queue.head = queue.count = 0;
+		memset ( queue.packets, 0, sizeof ( queue.packets ) );
+	}
+
+	return S_OK;
+}
+
+void FFDemuxer::Subscribe ( int streamIndex )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+
+	PacketQueue & queue = _queues [ streamIndex ];
+	queue.subscribed = true;
+	for ( AVPacket *& packet : queue.packets )
+	{
+		if ( packet == nullptr )
+			packet = av_packet_alloc ();
+	}
+}
+
+void FFDemuxer::Unsubscribe ( int streamIndex )
+{
+	{
+		std::unique_lock<std::mutex> lock ( _mutex );
+
+		PacketQueue & queue = _queues [ streamIndex ];
+		queue.subscribed = false;
+		for ( ; queue.count > 0; --queue.count, queue.head = ( queue.head + 1 ) % MAX_QUEUED_PACKETS )
+			av_packet_unref ( queue.packets [ queue.head ] );
+	}
+	_condition.notify_all ();
+}
+
+int FFDemuxer::ReadPacket ( int streamIndex, AVPacket * packet )
+{
+	std::unique_lock<std::mutex> lock ( _mutex );
+
+	for ( ;; )
+	{
+		PacketQueue & queue = _queues [ streamIndex ];
+		if ( queue.count > 0 )
+		{
+			av_packet_move_ref ( packet, queue.packets [ queue.head ] );
+			queue.head = ( queue.head + 1 ) % MAX_QUEUED_PACKETS;
+			--queue.count;
+
+			lock.unlock ();
+			_condition.notify_all ();
+			return 0;
+		}
+
+		if ( _endOfFile )
+			return AVERROR_EOF;
+
+		// Another decoder is demuxing; it queues our packets for us. Cancelling does not notify
+		// this condition, so the wait polls for it.
+		if ( _demuxing )
+		{
+			_condition.wait_for ( lock, std::chrono::milliseconds ( FOLLOW_POLL_INTERVAL ) );
+			if ( IsCancelled () )
+				return AVERROR_EOF;
+			continue;
+		}
+
+		_demuxing = true;
+		lock.unlock ();
+		int result = ReadNextPacket ( packet );
+		lock.lock ();
+
+		if ( result < 0 )
+		{
+			_endOfFile = true;
+			_demuxing = false;
+			lock.unlock ();
+			_condition.notify_all ();
+			return AVERROR_EOF;
+		}
+
+		if ( packet->stream_index == streamIndex )
+		{
+			_demuxing = false;
+			lock.unlock ();
+			_condition.notify_all ();
+			return 0;
+		}
+
+		if ( packet->stream_index >= ( int ) _queues.size () )
+		{
+			av_packet_unref ( packet );
+			_demuxing = false;
+			_condition.notify_all ();
+			continue;
+		}
+
+		// Keep demuxing ownership while waiting so packets stay in order
+		PacketQueue & target = _queues [ packet->stream_index ];
+		bool cancelled = false;
+		while ( !cancelled && !_condition.wait_for ( lock, std::chrono::milliseconds ( FOLLOW_POLL_INTERVAL ), [ &target ] {
+			return !target.subscribed || target.count < MAX_QUEUED_PACKETS;
+		} ) )
+			cancelled = IsCancelled ();
+
+		// A cancelled job reads no further, so every decoder ends as at the end of the file
+		if ( cancelled )
+		{
+			av_packet_unref ( packet );
+			_endOfFile = true;
+			_demuxing = false;
+			lock.unlock ();
+			_condition.notify_all ();
+			return AVERROR_EOF;
+		}
+
+		if ( target.subscribed )
+		{
+			av_packet_move_ref ( target.packets [ ( target.head + target.count ) % MAX_QUEUED_PACKETS ], packet );
+			++target.count;
+		}
+		else
+			av_packet_unref ( packet );
+
+		_demuxing = false;
+		_condition.notify_all ();
+	}
+}
+
+int FFDemuxer::ReadNextPacket ( AVPacket * packet )
+{
+	for ( ;; )
+	{
+		int result = av_read_frame ( _formatContext, packet );
+		if ( result == 0 )
+		{
+			if ( _settings.follow && !IsNewPacket ( packet ) )
+			{
+				av_packet_unref ( packet );
+				continue;
+			}
+
+			_resumePosition = avio_tell ( _formatContext->pb );
+			return 0;
+		}
+
+		if ( result != AVERROR_EOF || !_settings.follow )
+			return AVERROR_EOF;
+
+		if ( !WaitForFileGrowth () )
+			return AVERROR_EOF;
+	}
+}
+
+bool FFDemuxer::IsCancelled () const
+{
+	return _settings.cancelEvent != nullptr && WaitForSingleObject ( _settings.cancelEvent, 0 ) == WAIT_OBJECT_0;
+}
+
+bool FFDemuxer::IsNewPacket ( const AVPacket * packet )
+{
+	int64_t timeStamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+	if ( timeStamp == AV_NOPTS_VALUE || packet->stream_index >= ( int ) _lastTimeStamps.size () )
+		return true;
+
+	int64_t & lastTimeStamp = _lastTimeStamps [ packet->stream_index ];
+	if ( _reopened && lastTimeStamp != AV_NOPTS_VALUE && timeStamp <= lastTimeStamp )
+		return false;
+
+	lastTimeStamp = timeStamp;
+	return true;
+}
+
+// Demuxers of plain byte streams pick up again wherever the reader left off. The others keep state
+// past the end of the file: matroska latches its end and mov does not look for another root atom,
+// so a file of theirs that grows has to be opened again.
+static bool CanResumeInPlace ( const AVInputFormat * format )
+{
+	static const char * const formatNames [] = { "mpegts", "mpeg", "flv", "live_flv", "h264", "hevc", "mjpeg" };
+	for ( const char * name : formatNames )
+		if ( strcmp ( format->name, name ) == 0 )
+			return true;
+	return false;
+}
+
+bool FFDemuxer::WaitForFileGrowth ()
+{
+	AVIOContext * io = _formatContext->pb;
+	int64_t readSize = io->pos;
+
+	DWORD idleStarted = GetTickCount ();
+	while ( GetTickCount () - idleStarted < _settings.followIdleTimeout )
+	{
+		if ( _settings.cancelEvent == nullptr )
+			Sleep ( FOLLOW_POLL_INTERVAL );
+		else if ( WaitForSingleObject ( _settings.cancelEvent, FOLLOW_POLL_INTERVAL ) == WAIT_OBJECT_0 )
+			return false;
+
+		int64_t fileSize = avio_size ( io );
+		if ( fileSize > readSize )
+		{
+			if ( !CanResumeInPlace ( _formatContext->iformat ) )
+				return Reopen ();
+
+			// Resume right after the last complete packet; a partially written one is read again
+			io->eof_reached = 0;
+			if ( avio_seek ( io, _resumePosition, SEEK_SET ) < 0 )
+				return false;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Opens the grown file anew and seeks back to the earliest stream's last packet. Whatever comes
+// before the packets already read is skipped by IsNewPacket, so a failed seek only costs time.
+bool FFDemuxer::Reopen ()
+{
+	AVFormatContext * formatContext = avformat_alloc_context ();
+	if ( formatContext == nullptr )
+		return false;
+	if ( _settings.probeSize > 0 )
+		formatContext->probesize = _settings.probeSize;
+	if ( _settings.analyzeDuration > 0 )
+		formatContext->max_analyze_duration = _settings.analyzeDuration;
+
+	if ( 0 != avformat_open_input ( &formatContext, _path.c_str (), _formatContext->iformat, NULL ) )
+	{
+		avformat_free_context ( formatContext );
+		return false;
+	}
+
+	// The open decoders keep the parameters and time bases of the first open
+	bool matches = formatContext->nb_streams >= _formatContext->nb_streams;
+	for ( unsigned i = 0; matches && i < _formatContext->nb_streams; ++i )
+	{
+		const AVStream * stream = _formatContext->streams [ i ], * reopened = formatContext->streams [ i ];
+		matches = stream->codecpar->codec_id == reopened->codecpar->codec_id
+			&& av_cmp_q ( stream->time_base, reopened->time_base ) == 0;
+	}
+	if ( !matches )
+	{
+		avformat_close_input ( &formatContext );
+		return false;
+	}
+
+	int64_t resumeTime = INT64_MAX;
+	for ( size_t i = 0; i < _lastTimeStamps.size (); ++i )
+	{
+		if ( _lastTimeStamps [ i ] != AV_NOPTS_VALUE && _queues [ i ].subscribed )
+			resumeTime = ( std::min ) ( resumeTime, av_rescale_q ( _lastTimeStamps [ i ],
+				formatContext->streams [ i ]->time_base, AVRational { 1, AV_TIME_BASE } ) );
+	}
+	if ( resumeTime != INT64_MAX )
+		av_seek_frame ( formatContext, -1, resumeTime, AVSEEK_FLAG_BACKWARD );
+
+	avformat_close_input ( &_formatContext );
+	_formatContext = formatContext;
+	_reopened = true;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+FFVideoDecoder::FFVideoDecoder ()
+	: _refCount ( 1 )
+	, _demuxer ( nullptr )
 	, _frame ( nullptr )
 	, _codec ( nullptr )
 	, _codecContext ( nullptr )
+	, _packet ( nullptr )
+	, _swsContext ( nullptr )
+	, _samplePool ( nullptr )
+	, _duration ( 0 )
+	, _timeBase ( AVRational { 0, 1 } )
+	, _streamIndex ( -1 )
+	, _nodeLocalBuffers ( false )
+	, _planarOutput ( false )
 {
 
 }
 
 FFVideoDecoder::~FFVideoDecoder ()
 {
+	_siblings.clear ();
+
 	if ( _packet )
-	{
-		av_free ( _packet->data );
-		_packet->data = nullptr;
 		av_packet_free ( &_packet );
-	}
+
+	if ( _swsContext )
+		sws_freeContext ( _swsContext );
+
+	if ( _samplePool )
+		_samplePool->Release ();
 
 	if ( _frame )
 		av_frame_free ( &_frame );
@@ -194,8 +833,12 @@ FFVideoDecoder::~FFVideoDecoder ()
 		avcodec_free_context ( &_codecContext );
 	}
 
-	if ( _formatContext )
-		avformat_close_input ( &_formatContext );
+	if ( _demuxer )
+	{
+		if ( _streamIndex >= 0 )
+			_demuxer->Unsubscribe ( _streamIndex );
+		_demuxer->Release ();
+	}
 }
 
 HRESULT FFVideoDecoder::QueryInterface ( REFIID riid, void ** ppvObject )
@@ -219,90 +862,153 @@ ULONG FFVideoDecoder::Release ()
 	return ret;
 }
 
-HRESULT FFVideoDecoder::Initialize ( LPCWSTR filename )
+HRESULT FFVideoDecoder::Initialize ( LPCWSTR filename, const VideoDecoderSettings * settings )
 {
-	USES_CONVERSION;
-
-	_formatContext = avformat_alloc_context ();
-	if ( 0 != avformat_open_input ( &_formatContext, W2A ( filename ), NULL, NULL ) )
+	FFDemuxer * demuxer = new FFDemuxer ();
+	if ( FAILED ( demuxer->Open ( filename, settings ) ) )
 	{
-		avformat_free_context ( _formatContext );
+		demuxer->Release ();
 		return E_FAIL;
 	}
 
-	if ( avformat_find_stream_info ( _formatContext, nullptr ) < 0 )
+	AVFormatContext * formatContext = demuxer->GetFormatContext ();
+
+	std::vector<int> streamIndices;
+	if ( settings != nullptr && settings->streamCount > 0 )
 	{
-		avformat_close_input ( &_formatContext );
+		for ( uint32_t i = 0; i < settings->streamCount; ++i )
+			streamIndices.push_back ( settings->streams [ i ] );
+	}
+	else if ( settings != nullptr && settings->allVideoStreams )
+	{
+		for ( unsigned i = 0; i < formatContext->nb_streams; ++i )
+			if ( formatContext->streams [ i ]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO )
+				streamIndices.push_back ( i );
+	}
+	else
+	{
+		int best = av_find_best_stream ( formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0 );
+		if ( best >= 0 )
+			streamIndices.push_back ( best );
+	}
+
+	if ( streamIndices.empty () )
+	{
+		demuxer->Release ();
 		return E_FAIL;
 	}
 
-	for ( int i = 0; i < _formatContext->nb_streams; ++i )
+	// Split over the streams picked here, however they were picked
+	uint32_t threads = demuxer->GetSettings ().decoderThreads;
+	if ( threads > 0 )
+		threads = ( std::max ) ( threads / ( uint32_t ) streamIndices.size (), 1u );
+
+	HRESULT hr = OpenStream ( demuxer, streamIndices [ 0 ], threads );
+	for ( size_t i = 1; SUCCEEDED ( hr ) && i < streamIndices.size (); ++i )
 	{
-		auto stream = _formatContext->streams [ _streamIndex ];
+		CComPtr<FFVideoDecoder> sibling;
+		*&sibling = new FFVideoDecoder ();
+		if ( SUCCEEDED ( hr = sibling->OpenStream ( demuxer, streamIndices [ i ], threads ) ) )
+			_siblings.push_back ( sibling.p );
+	}
+	demuxer->Release ();
 
-		_codec = avcodec_find_decoder ( stream->codecpar->codec_id );
+	return hr;
+}
 
-		_codecContext = avcodec_alloc_context3 ( _codec );
-		if ( _codecContext == nullptr )
-		{
-			avformat_close_input ( &_formatContext );
-			return E_FAIL;
-		}
+HRESULT FFVideoDecoder::OpenStream ( FFDemuxer * demuxer, int streamIndex, uint32_t threads )
+{
+	AVFormatContext * formatContext = demuxer->GetFormatContext ();
+	if ( streamIndex < 0 || streamIndex >= ( int ) formatContext->nb_streams )
+		return E_INVALIDARG;
 
-		avcodec_parameters_to_context ( _codecContext, stream->codecpar );
-		
-		if ( avcodec_open2 ( _codecContext, _codec, nullptr ) < 0 )
-		{
-			avformat_close_input ( &_formatContext );
-			return E_FAIL;
-		}
+	AVStream * stream = formatContext->streams [ streamIndex ];
+	if ( stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO )
+		return E_INVALIDARG;
 
-		if ( _codecContext->codec_type != AVMEDIA_TYPE_VIDEO )
-		{
-			avcodec_close ( _codecContext );
-			avcodec_free_context ( &_codecContext );
-			_codec = nullptr;
-		}
-		else
-		{
-			_streamIndex = i;
-			float timeBase = stream->time_base.num / ( double ) stream->time_base.den;
-			_duration = ( uint64_t ) ( stream->duration * timeBase * 1000 * 10000 );
-			break;
-		}
-	}
+	_codec = avcodec_find_decoder ( stream->codecpar->codec_id );
+	if ( _codec == nullptr )
+		return E_FAIL;
 
-	if ( _streamIndex < 0 )
-	{
-		avformat_close_input ( &_formatContext );
+	_codecContext = avcodec_alloc_context3 ( _codec );
+	if ( _codecContext == nullptr )
+		return E_FAIL;
+
+	avcodec_parameters_to_context ( _codecContext, stream->codecpar );
+	if ( threads > 0 )
+		_codecContext->thread_count = ( int ) threads;
+
+	if ( avcodec_open2 ( _codecContext, _codec, nullptr ) < 0 )
 		return E_FAIL;
-	}
 
 	_frame = av_frame_alloc ();
 	if ( _frame == nullptr )
-	{
-		avcodec_free_context ( &_codecContext );
-		avformat_close_input ( &_formatContext );
 		return E_FAIL;
-	}
 
 	_packet = av_packet_alloc ();
 	if ( _packet == nullptr )
-	{
-		avcodec_free_context ( &_codecContext );
-		avformat_close_input ( &_formatContext );
 		return E_FAIL;
+
+	_samplePool = new FFVideoSamplePool ();
+
+	float timeBase = stream->time_base.num / ( double ) stream->time_base.den;
+	if ( stream->duration != AV_NOPTS_VALUE )
+		_duration = ( uint64_t ) ( stream->duration * timeBase * 1000 * 10000 );
+	else if ( formatContext->duration != AV_NOPTS_VALUE )
+		_duration = formatContext->duration * 10000000 / AV_TIME_BASE;
+	else
+		_duration = 0;
+
+	_demuxer = demuxer;
+	_demuxer->AddRef ();
+	_timeBase = stream->time_base;
+	_streamIndex = streamIndex;
+	_nodeLocalBuffers = demuxer->GetSettings ().nodeLocalBuffers;
+	_planarOutput = demuxer->GetSettings ().planarOutput;
+	_demuxer->Subscribe ( _streamIndex );
+
+	return S_OK;
+}
+
+HRESULT FFVideoDecoder::GetStreamCount ( uint32_t * count )
+{
+	*count = ( uint32_t ) ( _siblings.size () + 1 );
+	return S_OK;
+}
+
+// Siblings are handed over rather than shared, so the caller's reference is the only one and
+// releasing it unsubscribes the stream from the demuxer
+HRESULT FFVideoDecoder::GetStreamDecoder ( uint32_t index, IVideoDecoder ** decoder )
+{
+	if ( index > _siblings.size () )
+		return E_INVALIDARG;
+
+	if ( index == 0 )
+	{
+		*decoder = this;
+		AddRef ();
+		return S_OK;
 	}
-	av_init_packet ( _packet );
-	_packet->size = _codecContext->width * 4 * _codecContext->height;
-	_packet->data = ( uint8_t* ) av_malloc ( _packet->size );
 
+	if ( _siblings [ index - 1 ] == nullptr )
+		return E_FAIL;
+
+	*decoder = _siblings [ index - 1 ].Detach ();
+	return S_OK;
+}
+
+HRESULT FFVideoDecoder::GetStreamId ( uint32_t * id )
+{
+	if ( _streamIndex < 0 )
+		return E_FAIL;
+
+	*id = ( uint32_t ) _streamIndex;
 	return S_OK;
 }
 
 HRESULT FFVideoDecoder::GetVideoSize ( uint32_t * width, uint32_t * height, uint32_t * stride )
 {
-	if ( _formatContext == nullptr )
+	if ( _codecContext == nullptr )
 		return E_FAIL;
 
 	*width = _codecContext->width;
@@ -320,57 +1026,79 @@ HRESULT FFVideoDecoder::GetDuration ( uint64_t * ret )
 
 HRESULT FFVideoDecoder::SetReadPosition ( uint64_t pos )
 {
-	AVStream * stream = _formatContext->streams [ _streamIndex ];
-
 	return E_NOTIMPL;
 }
 
+// The 8-bit planar formats a sample can carry without conversion
+static bool GetPlanarFormat ( AVPixelFormat pixelFormat, VideoSampleFormat * format )
+{
+	switch ( pixelFormat )
+	{
+		case AV_PIX_FMT_YUV420P: case AV_PIX_FMT_YUVJ420P: *format = VSF_YUV420P; return true;
+		case AV_PIX_FMT_YUV422P: case AV_PIX_FMT_YUVJ422P: *format = VSF_YUV422P; return true;
+		case AV_PIX_FMT_YUV444P: case AV_PIX_FMT_YUVJ444P: *format = VSF_YUV444P; return true;
+		default: return false;
+	}
+}
+
 HRESULT FFVideoDecoder::ReadSample ( IVideoSample ** sample, uint64_t * readPosition )
 {
-	HRESULT ret = S_OK;
+	*sample = nullptr;
+	*readPosition = 0;
 
-	while ( 0 == av_read_frame ( _formatContext, _packet ) )
+	for ( ;; )
 	{
-		if ( _packet->stream_index != _streamIndex )
+		int result = avcodec_receive_frame ( _codecContext, _frame );
+		if ( result == 0 )
 		{
-			//av_packet_unref ( _packet );
-			continue;
+			VideoSampleFormat planarFormat;
+			bool planar = _planarOutput && GetPlanarFormat ( ( AVPixelFormat ) _frame->format, &planarFormat );
+			if ( !planar )
+			{
+				_swsContext = sws_getCachedContext ( _swsContext, _frame->width, _frame->height,
+					( AVPixelFormat ) _frame->format, _frame->width, _frame->height,
+					AV_PIX_FMT_BGR24, SWS_BICUBIC, NULL, NULL, NULL );
+				if ( _swsContext == nullptr )
+					return E_FAIL;
+			}
+
+			FFVideoSample * converted = _samplePool->Acquire ();
+			HRESULT hr = planar
+				? converted->CopyPlanes ( _frame, planarFormat, _nodeLocalBuffers )
+				: converted->Convert ( _swsContext, _frame, _nodeLocalBuffers );
+			if ( FAILED ( hr ) )
+			{
+				converted->Release ();
+				return hr;
+			}
+			*sample = converted;
+
+			float timeBase = _timeBase.num / ( double ) _timeBase.den;
+			*readPosition = ( uint64_t ) ( _frame->best_effort_timestamp * timeBase * 1000 ) * 10000;
+			return S_OK;
 		}
-
-		int result = avcodec_send_packet ( _codecContext, _packet );
-		if ( result == AVERROR ( EAGAIN ) ) ret = E_FAIL;
-		else if ( result == AVERROR ( ENOMEM ) ) ret = E_FAIL;
-		else if ( result == AVERROR ( EINVAL ) ) ret = E_FAIL;
-		else if ( result == AVERROR_EOF ) break;
-		else if ( result < 0 ) continue;
-
-		if ( ret == E_FAIL ) break;
-
-		result = avcodec_receive_frame ( _codecContext, _frame );
-
-		if ( result == AVERROR_EOF )
+		else if ( result == AVERROR_EOF )
 		{
 			avcodec_flush_buffers ( _codecContext );
-			*sample = nullptr;
-			*readPosition = 0;
+			return S_OK;
 		}
-		else if ( result == 0 )
-		{
-			*sample = new FFVideoSample ( _codecContext, _frame );
-			float timeBase = _formatContext->streams [ _streamIndex ]->time_base.num
-				/ ( double ) _formatContext->streams [ _streamIndex ]->time_base.den;
-			*readPosition = ( uint64_t ) ( _frame->pts * timeBase * 1000 ) * 10000;
-		}
-		else if ( result == AVERROR ( EAGAIN ) )
+		else if ( result != AVERROR ( EAGAIN ) )
+			return E_FAIL;
+
+		result = _demuxer->ReadPacket ( _streamIndex, _packet );
+		if ( result == AVERROR_EOF )
 		{
-			ret = E_FAIL;
+			// Drain frames still buffered inside the decoder
+			avcodec_send_packet ( _codecContext, nullptr );
+			continue;
 		}
-		else if ( result == AVERROR ( EINVAL ) ) ret = E_FAIL;
-		else ret = E_FAIL;
+		else if ( result < 0 )
+			return E_FAIL;
 
-		break;
-	}
-	av_packet_unref ( _packet );
+		result = avcodec_send_packet ( _codecContext, _packet );
+		av_packet_unref ( _packet );
 
-	return ret;
+		if ( result == AVERROR ( ENOMEM ) || result == AVERROR ( EINVAL ) )
+			return E_FAIL;
+	}
 }
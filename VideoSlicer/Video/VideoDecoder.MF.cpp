@@ -41,6 +41,7 @@ public:
 public:
 	virtual HRESULT Lock ( LPVOID * buffer, uint64_t * length );
 	virtual HRESULT Unlock ();
+	virtual HRESULT GetLayout ( VideoSampleLayout * layout );
 
 private:
 	ULONG _refCount;
@@ -62,7 +63,12 @@ public:
 	virtual ULONG Release ();
 
 public:
-	virtual HRESULT Initialize ( LPCWSTR filename );
+	virtual HRESULT Initialize ( LPCWSTR filename, const VideoDecoderSettings * settings );
+
+public:
+	virtual HRESULT GetStreamCount ( uint32_t * count );
+	virtual HRESULT GetStreamDecoder ( uint32_t index, IVideoDecoder ** decoder );
+	virtual HRESULT GetStreamId ( uint32_t * id );
 
 public:
 	virtual HRESULT GetVideoSize ( uint32_t * width, uint32_t * height, uint32_t * stride );
@@ -135,6 +141,10 @@ HRESULT MFVideoSample::Unlock ()
 {
 	return _buffer->Unlock ();
 }
+HRESULT MFVideoSample::GetLayout ( VideoSampleLayout * layout )
+{
+	return E_NOTIMPL;
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -164,8 +174,11 @@ ULONG MFVideoDecoder::Release ()
 	return ret;
 }
 
-HRESULT MFVideoDecoder::Initialize ( LPCWSTR filename )
+HRESULT MFVideoDecoder::Initialize ( LPCWSTR filename, const VideoDecoderSettings * settings )
 {
+	if ( settings != nullptr && ( settings->follow || settings->streamCount > 0 || settings->allVideoStreams ) )
+		return E_NOTIMPL;
+
 	HRESULT hr;
 	if ( FAILED ( hr = MFStartup ( MF_VERSION ) ) )
 		return hr;
@@ -199,6 +212,28 @@ HRESULT MFVideoDecoder::Initialize ( LPCWSTR filename )
 	return S_OK;
 }
 
+HRESULT MFVideoDecoder::GetStreamCount ( uint32_t * count )
+{
+	*count = 1;
+	return S_OK;
+}
+
+HRESULT MFVideoDecoder::GetStreamDecoder ( uint32_t index, IVideoDecoder ** decoder )
+{
+	if ( index != 0 )
+		return E_INVALIDARG;
+
+	*decoder = this;
+	AddRef ();
+	return S_OK;
+}
+
+HRESULT MFVideoDecoder::GetStreamId ( uint32_t * id )
+{
+	*id = _streamIndex;
+	return S_OK;
+}
+
 HRESULT MFVideoDecoder::GetVideoSize ( uint32_t * width, uint32_t * height, uint32_t * stride )
 {
 	HRESULT hr;
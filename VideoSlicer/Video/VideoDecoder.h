@@ -4,17 +4,82 @@
 #include <Windows.h>
 #include <cstdint>
 
+struct VideoDecoderSettings
+{
+	// Keep demuxing a file that is still being written.
+	// Reading stops when the file does not grow for followIdleTimeout milliseconds.
+	bool follow;
+	uint32_t followIdleTimeout;
+	// Event that ends the wait for a growing file early; may be null.
+	HANDLE cancelEvent;
+
+	// Container stream indices to decode. When empty, every video stream is selected
+	// if allVideoStreams is set, otherwise only the best video stream.
+	const int * streams;
+	uint32_t streamCount;
+	bool allVideoStreams;
+
+	// Limits for container probing in bytes and microseconds; zero keeps the FFmpeg defaults.
+	int64_t probeSize;
+	int64_t analyzeDuration;
+	// Directory for persisted probe results; probing is skipped for files already seen.
+	LPCWSTR probeCacheDirectory;
+	// Skip stream info probing when the container header already describes the video streams.
+	bool minimalProbing;
+
+	// Allocate frame buffers on the NUMA node of the thread that decodes into them.
+	bool nodeLocalBuffers;
+
+	// Codec threads of all decoded streams together, split evenly among the streams opened and at
+	// least one each; zero keeps the decoder's default.
+	uint32_t decoderThreads;
+
+	// Hand out 8-bit 4:2:0, 4:2:2 and 4:4:4 frames in their planar YUV layout instead of converting
+	// them to BGR. Other formats are still converted; GetLayout tells them apart.
+	bool planarOutput;
+};
+
+enum VideoSampleFormat
+{
+	// Packed 24-bit BGR
+	VSF_BGR24,
+	// 8-bit Y, Cb and Cr planes back to back
+	VSF_YUV420P,
+	VSF_YUV422P,
+	VSF_YUV444P,
+};
+
+struct VideoSampleLayout
+{
+	VideoSampleFormat format;
+	uint32_t width, height;
+	// Bytes per row of the first plane and of each chroma plane
+	uint32_t stride, chromaStride;
+	// Samples span 0-255 instead of the 16-235 video range
+	bool fullRange;
+};
+
 interface IVideoSample : public IUnknown
 {
 public:
 	virtual HRESULT Lock ( LPVOID * buffer, uint64_t * length ) PURE;
 	virtual HRESULT Unlock () PURE;
+	// E_NOTIMPL when the sample is BGR24 as GetVideoSize describes it
+	virtual HRESULT GetLayout ( VideoSampleLayout * layout ) PURE;
 };
 
 interface IVideoDecoder : public IUnknown
 {
 public:
-	virtual HRESULT Initialize ( LPCWSTR filename ) PURE;
+	virtual HRESULT Initialize ( LPCWSTR filename, const VideoDecoderSettings * settings ) PURE;
+
+public:
+	// Selected streams share one demux pass; every decoder returned here
+	// must either be read until the end or be released. Each stream's decoder but the first
+	// can be taken only once.
+	virtual HRESULT GetStreamCount ( uint32_t * count ) PURE;
+	virtual HRESULT GetStreamDecoder ( uint32_t index, IVideoDecoder ** decoder ) PURE;
+	virtual HRESULT GetStreamId ( uint32_t * id ) PURE;
 
 public:
 	virtual HRESULT GetVideoSize ( uint32_t * width, uint32_t * height, uint32_t * stride ) PURE;